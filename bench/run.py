@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+#
+# Runs the benchmarks in this directory and reports, for each of them, the median wall time of a number of runs, the
+# peak resident set size and the statistics of the garbage collector, as JSON on stdout. A table of the same numbers
+# goes to stderr for humans.
+#
+# Usage: run.py [--runs N] [--output FILE] ctok [benchmark.tok...]
+#
+# Without benchmarks given, every .tok file next to this script is run. The CMake target "bench" builds ctok in Release
+# and runs this script on it.
+#
+
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# The --gc-stats lines worth keeping, and the names their numbers go by in the report.
+GC_STATS = [
+    (re.compile(r"collections:\s+(\d+) minor, (\d+) major, in (\d+) pauses"),
+     ("minor_collections", "major_collections", "pauses")),
+    (re.compile(r"pause time:\s+([\d.]+) ms total, ([\d.]+) ms max"),
+     ("total_pause_ms", "max_pause_ms")),
+    (re.compile(r"memory:\s+(\d+) bytes allocated, (\d+) freed"),
+     ("bytes_allocated", "bytes_freed")),
+    # ctok measures its peak RSS itself, since the rusage of a child also counts the harness it got forked from.
+    (re.compile(r"peak rss:\s+(\d+) bytes"),
+     ("peak_rss_bytes",)),
+]
+
+
+def parse_gc_stats(output):
+    stats = {}
+    for pattern, names in GC_STATS:
+        match = pattern.search(output)
+        if match is None:
+            continue
+        for name, value in zip(names, match.groups()):
+            stats[name] = float(value) if "." in value else int(value)
+    return stats
+
+
+def run_once(ctok, path):
+    """Runs a benchmark once, returning its wall time in seconds and its GC statistics."""
+    start = time.perf_counter()
+    process = subprocess.run([ctok, "--gc-stats", path], stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    elapsed = time.perf_counter() - start
+    errors = process.stderr.decode(errors="replace")
+    if process.returncode != 0:
+        raise RuntimeError("%s exited with status %d:\n%s" % (path, process.returncode, errors))
+    return elapsed, parse_gc_stats(errors)
+
+
+def run_benchmark(ctok, path, runs):
+    times = []
+    peaks = []
+    gc_stats = {}
+    for _ in range(runs):
+        elapsed, gc_stats = run_once(ctok, path)
+        times.append(elapsed)
+        peaks.append(gc_stats.pop("peak_rss_bytes", None))
+    return {
+        "name": os.path.splitext(os.path.basename(path))[0],
+        "runs": runs,
+        "median_seconds": round(statistics.median(times), 6),
+        "min_seconds": round(min(times), 6),
+        "max_seconds": round(max(times), 6),
+        "peak_rss_bytes": None if None in peaks else max(peaks),
+        # The collector behaves the same on every run, apart from its timings, so the last run stands for all of them.
+        "gc": gc_stats,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Runs the ctok benchmarks.")
+    parser.add_argument("--runs", type=int, default=5, help="number of runs of each benchmark (default 5)")
+    parser.add_argument("--output", help="file to write the JSON report to instead of stdout")
+    parser.add_argument("ctok", help="path of the ctok binary")
+    parser.add_argument("benchmarks", nargs="*", help="benchmarks to run (default: every .tok file in bench/)")
+    args = parser.parse_args()
+
+    benchmarks = args.benchmarks or sorted(
+        os.path.join(BENCH_DIR, name) for name in os.listdir(BENCH_DIR) if name.endswith(".tok"))
+    results = []
+    sys.stderr.write("%-20s %10s %10s %12s %8s\n" % ("benchmark", "median s", "min s", "peak RSS kB", "GCs"))
+    for path in benchmarks:
+        result = run_benchmark(args.ctok, path, args.runs)
+        results.append(result)
+        gc = result["gc"]
+        peak = result["peak_rss_bytes"]
+        sys.stderr.write("%-20s %10.3f %10.3f %12s %8d\n" % (
+            result["name"], result["median_seconds"], result["min_seconds"],
+            "-" if peak is None else str(peak // 1024),
+            gc.get("minor_collections", 0) + gc.get("major_collections", 0)))
+
+    report = json.dumps({"ctok": os.path.abspath(args.ctok), "benchmarks": results}, indent=2)
+    if args.output:
+        with open(args.output, "w") as file:
+            file.write(report + "\n")
+    else:
+        print(report)
+
+
+if __name__ == "__main__":
+    main()
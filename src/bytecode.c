@@ -0,0 +1,654 @@
+//
+// Serialization of compiled Tok code into .tokc bytecode files.
+//
+// A bytecode file starts with a header made of the "TOKC" magic, the format version and a hash and length of the source
+// the code was compiled from, so a stale or foreign file can be told apart from a usable one, and a checksum of the
+// rest of the file, which catches files that got truncated or corrupted on disk. The header is followed by the names of
+// the global variables, in slot order, and by the top level function. A function is stored as its arity, upvalue count,
+// stack depth, optional name and inline cache count, then its constants (nested functions included, recursively) and
+// finally its run-length encoded line table and code. All numbers are written in the byte order of the machine, a file
+// written on a machine with a different one fails the version check.
+//
+// Loading maps the file into memory, and the line tables and code of the loaded functions point straight into the
+// mapping instead of being copied out of it. The line table of each function is padded to start on a 4 byte boundary
+// for this. The mapping is private, so the loader can still patch the global slots in the code without touching the file.
+//
+// Before any of it runs, the loader checks that every constant, inline cache, upvalue and local slot an instruction
+// refers to exists, that the jumps land on instructions, that the instructions never pop more than they pushed, and
+// that the stack never grows deeper than the depth stored for the function, which is what call() makes room for. It
+// doesn't check the types of the values the code works on, though, the way run() trusts the compiler to only emit
+// OP_GET_SUPER with a class below it. Bytecode files are trusted input as far as deliberately crafted code goes, just
+// like the scripts themselves.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "bytecode.h"
+#include "chunk.h"
+#include "memory.h"
+#include "vm.h"
+
+#define BYTECODE_MAGIC "TOKC"
+/// Size of the header: magic, version, source hash, source length and checksum.
+#define BYTECODE_HEADER_SIZE 32
+/// Starting value of the 64 bit FNV-1a hashes.
+#define FNV_OFFSET_BASIS 14695981039346656037u
+
+/**
+ * Tags identifying the type of each serialized constant.
+ */
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION
+} ConstantTag;
+
+/**
+ * A bytecode file loaded into a VM. These are kept around until freeBytecode(), since the functions loaded from them
+ * borrow their code from the file's memory.
+ */
+typedef struct BytecodeMapping {
+    struct BytecodeMapping* next;
+    uint8_t* start;
+    size_t size;
+} Mapping;
+
+typedef struct {
+    FILE* file;
+    // number of bytes written so far, used to align the line tables.
+    size_t offset;
+    // checksum of the bytes written since the header.
+    uint64_t checksum;
+    bool failed;
+} Writer;
+
+typedef struct {
+    // VM the functions are loaded into.
+    VM* vm;
+    const uint8_t* start;
+    const uint8_t* current;
+    const uint8_t* end;
+    bool failed;
+} Reader;
+
+/**
+ * Feeds bytes into a 64 bit FNV-1a hash.
+ * @param hash the hash of the bytes before these, FNV_OFFSET_BASIS for none.
+ * @param bytes
+ * @param count
+ * @return
+ */
+static uint64_t hashBytes(uint64_t hash, const void* bytes, size_t count) {
+    const uint8_t* data = bytes;
+    for (size_t i = 0; i < count; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+/**
+ * Hash of the source, used to tell whether a bytecode file is still up to date with its script.
+ * @param source
+ * @param length
+ * @return
+ */
+static uint64_t hashSource(const char* source, size_t length) {
+    return hashBytes(FNV_OFFSET_BASIS, source, length);
+}
+
+static void writeBytes(Writer* writer, const void* bytes, size_t count) {
+    if (count == 0 || writer->failed) return;
+    if (fwrite(bytes, 1, count, writer->file) != count) writer->failed = true;
+    writer->offset += count;
+    writer->checksum = hashBytes(writer->checksum, bytes, count);
+}
+
+static void writeByte(Writer* writer, uint8_t byte) {
+    writeBytes(writer, &byte, sizeof(byte));
+}
+
+static void writeU32(Writer* writer, uint32_t value) {
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeU64(Writer* writer, uint64_t value) {
+    writeBytes(writer, &value, sizeof(value));
+}
+
+/**
+ * Pads the output with zeroes up to the next multiple of the given alignment.
+ * @param writer
+ * @param alignment
+ */
+static void writePadding(Writer* writer, size_t alignment) {
+    static const uint8_t zeroes[8] = {0};
+    writeBytes(writer, zeroes, (alignment - writer->offset % alignment) % alignment);
+}
+
+static void writeString(Writer* writer, ObjString* string) {
+    writeU32(writer, (uint32_t) string->length);
+    writeBytes(writer, string->chars, (size_t) string->length);
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function);
+
+static void writeConstant(Writer* writer, Value value) {
+    if (IS_NIL(value)) {
+        writeByte(writer, CONSTANT_NIL);
+    } else if (IS_BOOL(value)) {
+        writeByte(writer, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+    } else if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        writeByte(writer, CONSTANT_NUMBER);
+        writeBytes(writer, &number, sizeof(number));
+    } else if (IS_STRING(value)) {
+        writeByte(writer, CONSTANT_STRING);
+        writeString(writer, AS_STRING(value));
+    } else if (IS_FUNCTION(value)) {
+        writeByte(writer, CONSTANT_FUNCTION);
+        writeFunction(writer, AS_FUNCTION(value));
+    } else {
+        // The compiler never puts any other kind of value in a constant table.
+        writer->failed = true;
+    }
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function) {
+    // A function left for lazy compilation has no bytecode to save yet.
+    if (function->lazySource != NULL) {
+        writer->failed = true;
+        return;
+    }
+    Chunk* chunk = &function->chunk;
+
+    writeU32(writer, (uint32_t) function->arity);
+    writeU32(writer, (uint32_t) function->upvalueCount);
+    writeU32(writer, (uint32_t) function->maxSlots);
+    writeByte(writer, function->name != NULL);
+    if (function->name != NULL) writeString(writer, function->name);
+    writeU32(writer, (uint32_t) chunk->cacheCount);
+
+    writeU32(writer, (uint32_t) chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        writeConstant(writer, chunk->constants.values[i]);
+    }
+
+    writeU32(writer, (uint32_t) chunk->lineCount);
+    writePadding(writer, sizeof(int));
+    writeBytes(writer, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+    writeU32(writer, (uint32_t) chunk->count);
+    writeBytes(writer, chunk->code, (size_t) chunk->count);
+}
+
+/**
+ * Writes the compiled top level function of a script to a bytecode file.
+ * The file is written under a temporary name and then moved into place, so that a process that has the previous version
+ * of the file loaded never sees it change underneath it.
+ * @param vm VM the function was compiled for, which numbered the global variables.
+ * @param path path of the bytecode file.
+ * @param function top level function returned by the compiler.
+ * @param source source code the function was compiled from.
+ * @return true if the file was written successfully.
+ */
+bool saveBytecode(VM* vm, const char* path, ObjFunction* function, const char* source) {
+    size_t pathLength = strlen(path);
+    char* tempPath = malloc(pathLength + 5);
+    if (tempPath == NULL) return false;
+    memcpy(tempPath, path, pathLength);
+    memcpy(tempPath + pathLength, ".tmp", 5);
+
+    Writer writer;
+    writer.file = fopen(tempPath, "wb");
+    writer.offset = 0;
+    writer.checksum = FNV_OFFSET_BASIS;
+    writer.failed = writer.file == NULL;
+    if (writer.failed) {
+        free(tempPath);
+        return false;
+    }
+
+    size_t sourceLength = strlen(source);
+    writeBytes(&writer, BYTECODE_MAGIC, 4);
+    writeU32(&writer, BYTECODE_VERSION);
+    writeU64(&writer, hashSource(source, sourceLength));
+    writeU64(&writer, (uint64_t) sourceLength);
+    // The checksum is only known once everything else is written, it gets patched in afterwards.
+    writeU64(&writer, 0);
+    writer.checksum = FNV_OFFSET_BASIS;
+
+    writeU32(&writer, (uint32_t) vm->globalNames.count);
+    for (int i = 0; i < vm->globalNames.count; i++) {
+        writeString(&writer, AS_STRING(vm->globalNames.values[i]));
+    }
+    writeFunction(&writer, function);
+
+    if (!writer.failed && (fseek(writer.file, BYTECODE_HEADER_SIZE - sizeof(uint64_t), SEEK_SET) != 0 ||
+                           fwrite(&writer.checksum, sizeof(writer.checksum), 1, writer.file) != 1)) {
+        writer.failed = true;
+    }
+    if (fclose(writer.file) != 0) writer.failed = true;
+#ifdef _WIN32
+    if (!writer.failed) remove(path);
+#endif
+    if (writer.failed || rename(tempPath, path) != 0) {
+        remove(tempPath);
+        writer.failed = true;
+    }
+    free(tempPath);
+    return !writer.failed;
+}
+
+/**
+ * Consumes the given number of bytes from the input.
+ * @param reader
+ * @param count
+ * @return pointer to the bytes, or NULL if the input is too short, in which case the reader is marked as failed.
+ */
+static const uint8_t* readBytes(Reader* reader, size_t count) {
+    if (reader->failed || (size_t) (reader->end - reader->current) < count) {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->current;
+    reader->current += count;
+    return bytes;
+}
+
+static uint8_t readByte(Reader* reader) {
+    const uint8_t* bytes = readBytes(reader, sizeof(uint8_t));
+    return bytes == NULL ? 0 : *bytes;
+}
+
+static uint32_t readU32(Reader* reader) {
+    uint32_t value = 0;
+    const uint8_t* bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint64_t readU64(Reader* reader) {
+    uint64_t value = 0;
+    const uint8_t* bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+/**
+ * Reads a count of items of the given size, making sure that many items could actually follow in the input.
+ * @param reader
+ * @param itemSize
+ * @return
+ */
+static int readCount(Reader* reader, size_t itemSize) {
+    uint32_t count = readU32(reader);
+    if (count > INT32_MAX || (size_t) (reader->end - reader->current) / itemSize < count) {
+        reader->failed = true;
+        return 0;
+    }
+    return (int) count;
+}
+
+static ObjString* readString(Reader* reader) {
+    int length = readCount(reader, 1);
+    const uint8_t* chars = readBytes(reader, (size_t) length);
+    if (chars == NULL) return NULL;
+    return copyString(reader->vm, (const char*) chars, length);
+}
+
+/**
+ * Checks that an operand of an instruction is the index of a string constant, as the names instructions take are.
+ * @param chunk
+ * @param index the operand.
+ * @return
+ */
+static bool isStringConstant(Chunk* chunk, int index) {
+    return index < chunk->constants.count && IS_STRING(chunk->constants.values[index]);
+}
+
+/**
+ * Checks that an operand of an instruction is the index of a number constant, as the superinstructions folding one in
+ * take.
+ * @param chunk
+ * @param index the operand.
+ * @return
+ */
+static bool isNumberConstant(Chunk* chunk, int index) {
+    return index < chunk->constants.count && IS_NUMBER(chunk->constants.values[index]);
+}
+
+/**
+ * Checks the operands of an instruction that index into the function's constants, inline caches and upvalues. The
+ * local slots, argument counts and jump targets depend on the state of the stack, see stackDepth().
+ * @param function
+ * @param offset offset of the instruction, whose operands are all within the code.
+ * @return false if an operand is out of range.
+ */
+static bool checkOperands(ObjFunction* function, int offset) {
+    Chunk* chunk = &function->chunk;
+    uint8_t* code = chunk->code + offset;
+    switch (code[0]) {
+        case OP_CONSTANT:
+            return code[1] < chunk->constants.count;
+        case OP_CLASS:
+        case OP_GET_SUPER:
+        case OP_METHOD:
+        case OP_SUPER_INVOKE:
+            return isStringConstant(chunk, code[1]);
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return isStringConstant(chunk, code[1]) && ((code[2] << 8) | code[3]) < chunk->cacheCount;
+        case OP_INVOKE:
+            return isStringConstant(chunk, code[1]) && ((code[3] << 8) | code[4]) < chunk->cacheCount;
+        case OP_GET_LOCAL_PROPERTY:
+            return isStringConstant(chunk, code[2]) && ((code[3] << 8) | code[4]) < chunk->cacheCount;
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return isNumberConstant(chunk, code[2]);
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            return code[1] < function->upvalueCount;
+        case OP_CLOSURE: {
+            // The upvalues captured from the enclosing function have to exist. The locals get checked with the stack.
+            int upvalueCount = AS_FUNCTION(chunk->constants.values[code[1]])->upvalueCount;
+            for (int i = 0; i < upvalueCount; i++) {
+                uint8_t isLocal = code[2 + 2 * i];
+                if (isLocal > 1 || (!isLocal && code[3 + 2 * i] >= function->upvalueCount)) return false;
+            }
+            return true;
+        }
+        default:
+            return true;
+    }
+}
+
+/**
+ * Walks over the loaded code of a function, checking that it is well formed, see checkOperands() and stackDepth(), and
+ * moves the operands of the global variable instructions over to the slots the globals have in this VM.
+ * @param function
+ * @param globals slot in this VM of each global in the bytecode file, NULL if they are the same.
+ * @param globalCount number of globals in the bytecode file.
+ * @return false if the code is malformed.
+ */
+static bool relocateCode(ObjFunction* function, const int* globals, int globalCount) {
+    Chunk* chunk = &function->chunk;
+    if (chunk->count == 0) return false;
+
+    bool valid = true;
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t instruction = chunk->code[offset];
+        if (instruction >= OP_FIRST_QUICKENED) {
+            valid = false;
+            break;
+        }
+        // instructionLength() has to look up the function wrapped by OP_CLOSURE to size it.
+        if (instruction == OP_CLOSURE && (offset + 1 >= chunk->count ||
+                                          chunk->code[offset + 1] >= chunk->constants.count ||
+                                          !IS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]))) {
+            valid = false;
+            break;
+        }
+
+        int length = instructionLength(chunk, offset);
+        if (offset + length > chunk->count || !checkOperands(function, offset)) {
+            valid = false;
+            break;
+        }
+
+        if (instruction == OP_GET_GLOBAL || instruction == OP_DEFINE_GLOBAL || instruction == OP_SET_GLOBAL) {
+            int slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            if (slot >= globalCount) {
+                valid = false;
+                break;
+            }
+            if (globals != NULL) {
+                chunk->code[offset + 1] = (uint8_t) ((globals[slot] >> 8) & 0xff);
+                chunk->code[offset + 2] = (uint8_t) (globals[slot] & 0xff);
+            }
+        }
+        offset += length;
+    }
+
+    // The depth the stack reaches has to be the one stored, as call() reserves that much room.
+    return valid && stackDepth(chunk, function->arity + 1) == function->maxSlots;
+}
+
+static ObjFunction* readFunction(Reader* reader, const int* globals, int globalCount);
+
+static Value readConstant(Reader* reader, const int* globals, int globalCount) {
+    switch (readByte(reader)) {
+        case CONSTANT_NIL:
+            return NIL_VAL;
+        case CONSTANT_FALSE:
+            return BOOL_VAL(false);
+        case CONSTANT_TRUE:
+            return BOOL_VAL(true);
+        case CONSTANT_NUMBER: {
+            double number = 0;
+            const uint8_t* bytes = readBytes(reader, sizeof(number));
+            if (bytes != NULL) memcpy(&number, bytes, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+        case CONSTANT_STRING: {
+            ObjString* string = readString(reader);
+            if (string != NULL) return OBJ_VAL(string);
+            break;
+        }
+        case CONSTANT_FUNCTION: {
+            ObjFunction* function = readFunction(reader, globals, globalCount);
+            if (function != NULL) return OBJ_VAL(function);
+            break;
+        }
+    }
+    reader->failed = true;
+    return NIL_VAL;
+}
+
+/**
+ * Reads a function, its nested functions included, from the input.
+ * @param reader
+ * @param globals slot in this VM of each global in the bytecode file, NULL if they are the same.
+ * @param globalCount number of globals in the bytecode file.
+ * @return the function, or NULL if the input is malformed.
+ */
+static ObjFunction* readFunction(Reader* reader, const int* globals, int globalCount) {
+    VM* vm = reader->vm;
+    ObjFunction* function = newFunction(vm);
+    // The function has to stay reachable while its name and constants get allocated.
+    push(vm, OBJ_VAL(function));
+    Chunk* chunk = &function->chunk;
+
+    uint32_t arity = readU32(reader);
+    uint32_t upvalueCount = readU32(reader);
+    uint32_t maxSlots = readU32(reader);
+    if (arity > 255 || upvalueCount > UINT8_COUNT || maxSlots > INT32_MAX) reader->failed = true;
+    function->arity = (int) arity;
+    function->upvalueCount = (int) upvalueCount;
+    // Checked against the code once that has been read, see relocateCode().
+    function->maxSlots = (int) maxSlots;
+    if (readByte(reader)) function->name = readString(reader);
+    // A collection may make the function old while its name and constants are still being read.
+    if (function->name != NULL) writeBarrier(vm, (Obj*) function, OBJ_VAL(function->name));
+
+    // Inline caches aren't stored, they start out empty like the ones of freshly compiled code.
+    uint32_t cacheCount = readU32(reader);
+    if (cacheCount > UINT16_MAX + 1) reader->failed = true;
+    for (uint32_t i = 0; i < cacheCount && !reader->failed; i++) addInlineCache(vm, chunk);
+
+    int constantCount = readCount(reader, 1);
+    for (int i = 0; i < constantCount && !reader->failed; i++) {
+        Value constant = readConstant(reader, globals, globalCount);
+        addConstant(vm, chunk, constant);
+        writeBarrier(vm, (Obj*) function, constant);
+    }
+
+    int lineCount = readCount(reader, sizeof(LineStart));
+    size_t padding = (sizeof(int) - (size_t) (reader->current - reader->start) % sizeof(int)) % sizeof(int);
+    readBytes(reader, padding);
+    const uint8_t* lines = readBytes(reader, sizeof(LineStart) * lineCount);
+    int count = readCount(reader, 1);
+    const uint8_t* code = readBytes(reader, (size_t) count);
+
+    pop(vm);
+    if (reader->failed) return NULL;
+
+    // The code is borrowed from the mapped file rather than copied. The mapping is private, so relocating the globals
+    // writes to a copy of the affected pages.
+    chunk->ownsCode = false;
+    chunk->count = count;
+    chunk->capacity = count;
+    chunk->lineCount = lineCount;
+    chunk->lineCapacity = lineCount;
+    chunk->lines = (LineStart*) lines;
+    chunk->code = (uint8_t*) code;
+    if (!relocateCode(function, globals, globalCount)) return NULL;
+    return function;
+}
+
+/**
+ * Reads the whole bytecode file into memory. The file is mapped rather than read where the platform supports it, so
+ * that only the parts of it that actually get used are paged in.
+ * @param path
+ * @param size set to the size of the file.
+ * @return the contents of the file, or NULL if it couldn't be read.
+ */
+static uint8_t* mapFile(const char* path, size_t* size) {
+#ifdef _WIN32
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long fileSize = ftell(file);
+    rewind(file);
+
+    uint8_t* buffer = fileSize > 0 ? malloc((size_t) fileSize) : NULL;
+    if (buffer != NULL && fread(buffer, 1, (size_t) fileSize, file) != (size_t) fileSize) {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(file);
+    *size = (size_t) fileSize;
+    return buffer;
+#else
+    int file = open(path, O_RDONLY);
+    if (file < 0) return NULL;
+
+    struct stat status;
+    if (fstat(file, &status) != 0 || status.st_size <= 0) {
+        close(file);
+        return NULL;
+    }
+
+    *size = (size_t) status.st_size;
+    void* start = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+    // The mapping stays valid after the file is closed.
+    close(file);
+    return start == MAP_FAILED ? NULL : start;
+#endif
+}
+
+static void unmapFile(uint8_t* start, size_t size) {
+#ifdef _WIN32
+    (void) size;
+    free(start);
+#else
+    munmap(start, size);
+#endif
+}
+
+/**
+ * Loads the top level function of a script from a bytecode file.
+ * The global variables named in the file are looked up in (or added to) the VM's global slots, and the code is moved
+ * over to those slots if they differ from the ones the file was written with.
+ * @param vm VM to load the function into.
+ * @param path path of the bytecode file.
+ * @param source source code of the script, used to check that the file is up to date with it. If NULL, the file is
+ * used whatever it was compiled from.
+ * @return the function, or NULL if the file is missing, out of date, or unusable, in which case the script needs to be
+ * compiled instead.
+ */
+ObjFunction* loadBytecode(VM* vm, const char* path, const char* source) {
+    size_t size;
+    uint8_t* start = mapFile(path, &size);
+    if (start == NULL) return NULL;
+
+    Reader reader;
+    reader.vm = vm;
+    reader.start = start;
+    reader.current = start;
+    reader.end = start + size;
+    reader.failed = false;
+
+    const uint8_t* magic = readBytes(&reader, 4);
+    bool valid = magic != NULL && memcmp(magic, BYTECODE_MAGIC, 4) == 0 && readU32(&reader) == BYTECODE_VERSION;
+    uint64_t hash = readU64(&reader);
+    uint64_t sourceLength = readU64(&reader);
+    uint64_t checksum = readU64(&reader);
+    if (valid && source != NULL) {
+        size_t length = strlen(source);
+        valid = sourceLength == length && hash == hashSource(source, length);
+    }
+    valid = valid && !reader.failed &&
+            checksum == hashBytes(FNV_OFFSET_BASIS, reader.current, (size_t) (reader.end - reader.current));
+
+    ObjFunction* function = NULL;
+    int globalCount = valid ? readCount(&reader, sizeof(uint32_t)) : 0;
+    int* globals = globalCount > 0 ? malloc(sizeof(int) * globalCount) : NULL;
+    if (valid && !reader.failed && (globals != NULL || globalCount == 0)) {
+        bool relocated = false;
+        for (int i = 0; i < globalCount && !reader.failed; i++) {
+            ObjString* name = readString(&reader);
+            if (name == NULL) break;
+            globals[i] = globalSlot(vm, name);
+            if (globals[i] != i) relocated = true;
+        }
+        if (!reader.failed) function = readFunction(&reader, relocated ? globals : NULL, globalCount);
+        // The script is called without arguments, and has nothing to capture upvalues from.
+        if (function != NULL && (function->arity != 0 || function->upvalueCount != 0)) function = NULL;
+    }
+    free(globals);
+
+    if (function == NULL) {
+        // Whatever got loaded before the failure is unreachable, and never touches the code it borrowed once freed.
+        unmapFile(start, size);
+        return NULL;
+    }
+
+    Mapping* mapping = malloc(sizeof(Mapping));
+    if (mapping == NULL) {
+        fprintf(stderr, "Not enough memory to load \"%s\".\n", path);
+        exit(74);
+    }
+    mapping->start = start;
+    mapping->size = size;
+    mapping->next = vm->bytecodeMappings;
+    vm->bytecodeMappings = mapping;
+    return function;
+}
+
+/**
+ * Releases every bytecode file loaded into a VM. Should only be called once the functions loaded from them have been
+ * freed.
+ * @param vm
+ */
+void freeBytecode(VM* vm) {
+    while (vm->bytecodeMappings != NULL) {
+        Mapping* next = vm->bytecodeMappings->next;
+        unmapFile(vm->bytecodeMappings->start, vm->bytecodeMappings->size);
+        free(vm->bytecodeMappings);
+        vm->bytecodeMappings = next;
+    }
+}
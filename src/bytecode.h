@@ -0,0 +1,23 @@
+//
+// Serialization of compiled Tok code into .tokc bytecode files, so scripts don't have to be recompiled on every run.
+//
+
+#ifndef CTOK_BYTECODE_H
+#define CTOK_BYTECODE_H
+
+#include "common.h"
+#include "object.h"
+
+/**
+ * Version of the bytecode file format. Needs to be bumped every time the format, or the meaning of the bytecode itself,
+ * changes. Files written with a different version are ignored.
+ */
+#define BYTECODE_VERSION 7
+
+bool saveBytecode(VM* vm, const char* path, ObjFunction* function, const char* source);
+
+ObjFunction* loadBytecode(VM* vm, const char* path, const char* source);
+
+void freeBytecode(VM* vm);
+
+#endif //CTOK_BYTECODE_H
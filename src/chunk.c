@@ -16,47 +16,343 @@ void initChunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
+    chunk->ownsCode = true;
     initValueArray(&chunk->constants);
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
 }
 
 /**
  * Function to clear out memory from a chunk, and reinitialize it to a stable state.
+ * @param vm
  * @param chunk
  */
-void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+void freeChunk(VM* vm, Chunk* chunk) {
+    // Borrowed code is released along with the bytecode file it came from.
+    if (chunk->ownsCode) {
+        FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(vm, LineStart, chunk->lines, chunk->lineCapacity);
+    }
+    freeValueArray(vm, &chunk->constants);
+    FREE_ARRAY(vm, InlineCache, chunk->caches, chunk->cacheCapacity);
     initChunk(chunk);
 }
 
 /**
  * Function that is used to append bytecode to chunk->code array and add code to it.
  * Also captures the line numbers for debugging.
+ * @param vm
  * @param chunk
  * @param byte
  * @param line
  */
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    // A new line table entry is only needed when the byte starts a new line.
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) return;
+
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(vm, LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+
+    LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+    lineStart->offset = chunk->count - 1;
+    lineStart->line = line;
+}
+
+/**
+ * Throws away the code at the end of the chunk, keeping only its first bytes.
+ * @param chunk
+ * @param count number of bytes of code to keep.
+ */
+void truncateChunk(Chunk* chunk, int count) {
+    chunk->count = count;
+    while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= count) chunk->lineCount--;
+}
+
+/**
+ * Looks up the source line of a byte of code, by binary searching the line table for the run it belongs to.
+ * @param chunk
+ * @param offset offset of the byte in the chunk's code array.
+ * @return
+ */
+int getLine(Chunk* chunk, int offset) {
+    if (chunk->lineCount == 0) return 0;
+
+    // Find the last run that starts at or before the offset.
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+        if (chunk->lines[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return chunk->lines[low].line;
 }
 
-int addConstant(Chunk* chunk, Value value) {
+int addConstant(VM* vm, Chunk* chunk, Value value) {
     // pushing the value on the stack to make sure it doesn't get GC'd lol.
-    push(value);
-    writeValueArray(&chunk->constants, value);
+    push(vm, value);
+    writeValueArray(vm, &chunk->constants, value);
     // Now that it is in the ValueArray and safe from GC's wrath, we can pop the value off of the VM's stack.
-    pop();
+    pop(vm);
     // we return the index where the constant was appended so that it can be located later.
     return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+/**
+ * Allocates a new, empty inline cache in the chunk.
+ * @param vm
+ * @param chunk
+ * @return index of the cache, which the instruction using it takes as an operand.
+ */
+int addInlineCache(VM* vm, Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(vm, InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    cache->shape = NULL;
+    cache->transition = NULL;
+    cache->field = -1;
+    cache->method = NIL_VAL;
+    return chunk->cacheCount++;
+}
+
+/**
+ * Computes the size in bytes of the instruction starting at the given offset, opcode and operands included.
+ * Every instruction has a fixed size except OP_CLOSURE, which is followed by a pair of bytes for each upvalue of the
+ * function it wraps.
+ * @param chunk chunk containing the instruction.
+ * @param offset offset of the instruction's opcode in the chunk's code array.
+ * @return
+ */
+int instructionLength(Chunk* chunk, int offset) {
+    static const uint8_t lengths[OPCODE_COUNT] = {
+#define OPCODE_LENGTH(name, length) [name] = length,
+            OPCODES(OPCODE_LENGTH)
+#undef OPCODE_LENGTH
+    };
+    uint8_t instruction = chunk->code[offset];
+    if (instruction == OP_CLOSURE) {
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+        return 2 + function->upvalueCount * 2;
+    }
+    return instruction < OPCODE_COUNT ? lengths[instruction] : 1;
+}
+
+/// Value of depths[] for the bytes of the code that are operands rather than the start of an instruction.
+#define DEPTH_OPERAND (-2)
+/// Value of depths[] for the instructions that no path through the code has reached yet.
+#define DEPTH_UNREACHED (-1)
+
+/**
+ * Records the depth of the stack at an instruction that a path through the code reaches.
+ * @param depths
+ * @param pending instructions reached but not checked yet.
+ * @param pendingCount
+ * @param count size of the code.
+ * @param target offset of the instruction.
+ * @param depth
+ * @return false if there's no instruction at the offset, or other paths reach it with another depth.
+ */
+static bool reach(int* depths, int* pending, int* pendingCount, int count, int target, int depth) {
+    if (target < 0 || target >= count || depths[target] == DEPTH_OPERAND) return false;
+    if (depths[target] == DEPTH_UNREACHED) {
+        depths[target] = depth;
+        pending[(*pendingCount)++] = target;
+        return true;
+    }
+    return depths[target] == depth;
+}
+
+/**
+ * Follows every path through the code to find the depth of the stack at each instruction, which has to be the same
+ * whichever path leads there, as it is for the code the compiler emits. Against that depth it checks that the
+ * instructions only pop values they pushed, and that they only access the locals that exist at that point. Jumps have
+ * to land on instructions, and no path may run past the end of the code. The compiler works out ObjFunction.maxSlots
+ * with it, and a loaded bytecode file gets checked with it.
+ * @param chunk
+ * @param startDepth depth of the stack at the start of the code, the callee and its arguments.
+ * @return the largest depth the stack reaches, or -1 if the code doesn't hold up.
+ */
+int stackDepth(Chunk* chunk, int startDepth) {
+    int* depths = malloc(sizeof(int) * chunk->count);
+    int* pending = malloc(sizeof(int) * chunk->count);
+    if (depths == NULL || pending == NULL) {
+        free(depths);
+        free(pending);
+        return -1;
+    }
+    for (int offset = 0; offset < chunk->count;) {
+        int length = instructionLength(chunk, offset);
+        depths[offset] = DEPTH_UNREACHED;
+        for (int i = 1; i < length && offset + i < chunk->count; i++) depths[offset + i] = DEPTH_OPERAND;
+        offset += length;
+    }
+    int pendingCount = 0;
+    int maxDepth = startDepth;
+    bool valid = reach(depths, pending, &pendingCount, chunk->count, 0, startDepth);
+
+    while (valid && pendingCount > 0) {
+        int offset = pending[--pendingCount];
+        uint8_t* code = chunk->code + offset;
+        int depth = depths[offset];
+        int next = offset + instructionLength(chunk, offset);
+        // Number of values the instruction pops, and number it pushes.
+        int pops = 0;
+        int pushes = 0;
+        // Jump target, if the instruction may jump.
+        int target = -1;
+        // Local slot the instruction accesses, if any.
+        int local = -1;
+
+        switch (code[0]) {
+            case OP_CONSTANT:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_GET_GLOBAL:
+            case OP_GET_UPVALUE:
+            case OP_CLASS:
+                pushes = 1;
+                break;
+            case OP_POP:
+            case OP_DEFINE_GLOBAL:
+            case OP_PRINT:
+            case OP_CLOSE_UPVALUE:
+                pops = 1;
+                break;
+            case OP_GET_LOCAL:
+            case OP_GET_LOCAL_PROPERTY:
+            case OP_ADD_LOCAL_CONSTANT:
+            case OP_SUBTRACT_LOCAL_CONSTANT:
+                local = code[1];
+                pushes = 1;
+                break;
+            case OP_SET_LOCAL:
+                local = code[1];
+                pops = pushes = 1;
+                break;
+            case OP_SET_LOCAL_POP:
+                local = code[1];
+                pops = 1;
+                break;
+            case OP_SET_GLOBAL:
+            case OP_SET_UPVALUE:
+            case OP_GET_PROPERTY:
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_YIELD:
+                pops = pushes = 1;
+                break;
+            case OP_SET_PROPERTY:
+            case OP_GET_SUPER:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_ADD_NUMBER:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_GET_INDEX:
+            case OP_RESUME:
+                pops = 2;
+                pushes = 1;
+                break;
+            case OP_INHERIT:
+            case OP_METHOD:
+                // Both leave the class below on the stack.
+                pops = 2;
+                pushes = 1;
+                break;
+            case OP_SET_INDEX:
+                pops = 3;
+                pushes = 1;
+                break;
+            case OP_JUMP:
+                target = next + ((code[1] << 8) | code[2]);
+                next = -1;
+                break;
+            case OP_JUMP_IF_FALSE:
+                // The condition stays on the stack either way.
+                pops = pushes = 1;
+                target = next + ((code[1] << 8) | code[2]);
+                break;
+            case OP_LOOP:
+                target = next - ((code[1] << 8) | code[2]);
+                next = -1;
+                break;
+            case OP_LESS_LOCAL_CONSTANT_JUMP:
+                local = code[1];
+                pushes = 1;
+                target = next + ((code[3] << 8) | code[4]);
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL:
+                // The callee and its arguments are replaced with the result.
+                pops = code[1] + 1;
+                pushes = 1;
+                break;
+            case OP_INVOKE:
+                pops = code[2] + 1;
+                pushes = 1;
+                break;
+            case OP_SUPER_INVOKE:
+                // The superclass sits on top of the receiver and the arguments.
+                pops = code[2] + 2;
+                pushes = 1;
+                break;
+            case OP_BUILD_LIST:
+                pops = code[1];
+                pushes = 1;
+                break;
+            case OP_CLOSURE: {
+                // A local function captures itself from the slot the closure is about to be pushed to.
+                int upvalueCount = AS_FUNCTION(chunk->constants.values[code[1]])->upvalueCount;
+                for (int i = 0; i < upvalueCount; i++) {
+                    if (code[2 + 2 * i] && code[3 + 2 * i] > depth) valid = false;
+                }
+                pushes = 1;
+                break;
+            }
+            case OP_RETURN:
+                pops = 1;
+                next = -1;
+                break;
+            default:
+                valid = false;
+                break;
+        }
+
+        valid = valid && depth >= pops && local < depth;
+        depth += pushes - pops;
+        if (depth > maxDepth) maxDepth = depth;
+        if (valid && target != -1) valid = reach(depths, pending, &pendingCount, chunk->count, target, depth);
+        if (valid && next != -1) valid = reach(depths, pending, &pendingCount, chunk->count, next, depth);
+    }
+
+    free(depths);
+    free(pending);
+    return valid ? maxDepth : -1;
+}
@@ -8,61 +8,140 @@
 #include "common.h"
 #include "value.h"
 
+/**
+ * The instruction set, as one X(name, length) entry per opcode. Everything that has to know about every opcode is
+ * generated from this list: the OpCode enum, the dispatch table of run(), the names in debug.c and instructionLength().
+ * The length is the size of the instruction in bytes, operands included. OP_CLOSURE has 0 there, as it is followed by
+ * a pair of bytes for each upvalue of the function it wraps.
+ */
+#define OPCODES(X) \
+    X(OP_NEGATE, 1) \
+    X(OP_PRINT, 1) \
+    X(OP_JUMP, 3) \
+    X(OP_JUMP_IF_FALSE, 3) \
+    X(OP_LOOP, 3) \
+    X(OP_CALL, 2) \
+    X(OP_TAIL_CALL, 2)                  /* OP_CALL in tail position, right before an OP_RETURN */ \
+    X(OP_INVOKE, 5) \
+    X(OP_SUPER_INVOKE, 3) \
+    X(OP_CLOSURE, 0) \
+    X(OP_CLOSE_UPVALUE, 1) \
+    X(OP_GET_PROPERTY, 4) \
+    X(OP_SET_PROPERTY, 4) \
+    X(OP_CLASS, 2) \
+    X(OP_RETURN, 1) \
+    X(OP_SUBTRACT, 1) \
+    X(OP_MULTIPLY, 1) \
+    X(OP_DIVIDE, 1) \
+    X(OP_NOT, 1) \
+    X(OP_CONSTANT, 2) \
+    X(OP_NIL, 1) \
+    X(OP_TRUE, 1) \
+    X(OP_FALSE, 1) \
+    X(OP_POP, 1) \
+    X(OP_GET_LOCAL, 2) \
+    X(OP_SET_LOCAL, 2) \
+    X(OP_GET_GLOBAL, 3) \
+    X(OP_DEFINE_GLOBAL, 3) \
+    X(OP_SET_GLOBAL, 3) \
+    X(OP_GET_UPVALUE, 2) \
+    X(OP_SET_UPVALUE, 2) \
+    X(OP_GET_SUPER, 2) \
+    X(OP_EQUAL, 1) \
+    X(OP_GREATER, 1) \
+    X(OP_LESS, 1) \
+    X(OP_ADD, 1) \
+    X(OP_INHERIT, 1) \
+    X(OP_METHOD, 2) \
+    X(OP_BUILD_LIST, 2) \
+    X(OP_GET_INDEX, 1) \
+    X(OP_SET_INDEX, 1) \
+    X(OP_YIELD, 1) \
+    X(OP_RESUME, 1) \
+    /* Superinstructions. The compiler never emits these directly; the peephole pass in compiler.c fuses common */ \
+    /* instruction sequences into them once a function has been compiled. */ \
+    X(OP_GET_LOCAL_PROPERTY, 5)         /* OP_GET_LOCAL, OP_GET_PROPERTY */ \
+    X(OP_SET_LOCAL_POP, 2)              /* OP_SET_LOCAL, OP_POP */ \
+    X(OP_ADD_LOCAL_CONSTANT, 3)         /* OP_GET_LOCAL, OP_CONSTANT (number), OP_ADD */ \
+    X(OP_SUBTRACT_LOCAL_CONSTANT, 3)    /* OP_GET_LOCAL, OP_CONSTANT (number), OP_SUBTRACT */ \
+    X(OP_LESS_LOCAL_CONSTANT_JUMP, 5)   /* OP_GET_LOCAL, OP_CONSTANT (number), OP_LESS, OP_JUMP_IF_FALSE */ \
+    /* Quickened instructions. Neither the compiler nor bytecode files contain these; run() rewrites a generic */ \
+    /* instruction into one of them once it has seen the types of its operands, and back whenever the guess turns out */ \
+    /* wrong. They come last, from OP_FIRST_QUICKENED on. */ \
+    X(OP_ADD_NUMBER, 1)                 /* OP_ADD that has seen two numbers */
+
 typedef enum {
-    OP_NEGATE,
-    OP_PRINT,
-    OP_JUMP,
-    OP_JUMP_IF_FALSE,
-    OP_LOOP,
-    OP_CALL,
-    OP_INVOKE,
-    OP_SUPER_INVOKE,
-    OP_CLOSURE,
-    OP_CLOSE_UPVALUE,
-    OP_GET_PROPERTY,
-    OP_SET_PROPERTY,
-    OP_CLASS,
-    OP_RETURN,
-    OP_SUBTRACT,
-    OP_MULTIPLY,
-    OP_DIVIDE,
-    OP_NOT,
-    OP_CONSTANT,
-    OP_NIL,
-    OP_TRUE,
-    OP_FALSE,
-    OP_POP,
-    OP_GET_LOCAL,
-    OP_SET_LOCAL,
-    OP_GET_GLOBAL,
-    OP_DEFINE_GLOBAL,
-    OP_SET_GLOBAL,
-    OP_GET_UPVALUE,
-    OP_SET_UPVALUE,
-    OP_GET_SUPER,
-    OP_EQUAL,
-    OP_GREATER,
-    OP_LESS,
-    OP_ADD,
-    OP_INHERIT,
-    OP_METHOD
+#define OPCODE_ENUM(name, length) name,
+    OPCODES(OPCODE_ENUM)
+#undef OPCODE_ENUM
+    // Number of opcodes, not an opcode itself.
+    OPCODE_COUNT
 } OpCode;
 
+/// First of the quickened instructions, which bytecode files can't contain.
+#define OP_FIRST_QUICKENED OP_ADD_NUMBER
+
+/**
+ * Inline cache for a single property access or method call site.
+ * Most call sites only ever see receivers with one shape, so the cache remembers what the last lookup found for that
+ * shape. The next execution of the instruction checks the receiver's shape against the cached one, and if they match,
+ * skips the hash table lookups altogether. A shape belongs to a single class, so it determines the methods as well.
+ */
+typedef struct {
+    // shape of the receivers the cached lookup applies to, NULL while the cache is empty.
+    Obj* shape;
+    // shape the receiver ends up with after OP_SET_PROPERTY, which differs from shape when the instruction adds a field.
+    Obj* transition;
+    // index of the property in the receiver's field array, -1 if the property is a method.
+    int field;
+    // closure of the method, if the property is one.
+    Value method;
+} InlineCache;
+
+/**
+ * Entry of a chunk's line table, which is run-length encoded: consecutive bytes of code that come from the same source
+ * line share a single entry, which records where that run of bytes starts.
+ */
+typedef struct {
+    // offset of the first byte of code in the run.
+    int offset;
+    int line;
+} LineStart;
+
 typedef struct {
     int count;
     int capacity;
     // array of bytes.
     uint8_t* code;
-    int* lines;
+    // line table, only consulted when reporting errors and disassembling, so it is kept small rather than fast.
+    int lineCount;
+    int lineCapacity;
+    LineStart* lines;
+    // false when code and lines point into a loaded bytecode file rather than into arrays the chunk allocated itself.
+    bool ownsCode;
     ValueArray constants;
+    // inline caches for the property access and method call instructions in the chunk, which refer to them by index.
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache* caches;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 
-void freeChunk(Chunk* chunk);
+void freeChunk(VM* vm, Chunk* chunk);
+
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
+
+void truncateChunk(Chunk* chunk, int count);
+
+int getLine(Chunk* chunk, int offset);
+
+int addConstant(VM* vm, Chunk* chunk, Value value);
+
+int addInlineCache(VM* vm, Chunk* chunk);
 
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
+int instructionLength(Chunk* chunk, int offset);
 
-int addConstant(Chunk* chunk, Value value);
+int stackDepth(Chunk* chunk, int startDepth);
 
 #endif //CTOK_CHUNK_H
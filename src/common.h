@@ -34,6 +34,60 @@
  */
 //#define DEBUG_LOG_GC
 
+/**
+ * When defined, objects small enough are carved out of pages of equally sized cells, one pool of pages per size class,
+ * instead of each of them being malloc'd on its own. Comment it out to fall back to malloc, so that tools like
+ * AddressSanitizer can track every object.
+ */
+#define OBJECT_POOLS
+
+/**
+ * When this flag is defined the VM counts how often the inline caches of property accesses and method calls hit and
+ * miss, and prints the totals when it shuts down.
+ */
+//#define DEBUG_INLINE_CACHE_STATS
+
+/**
+ * When the build enables CTOK_OPCODE_STATS (see the CMake option of the same name), the VM counts how often each opcode
+ * and each pair of consecutive opcodes gets executed, along with an estimate of the cycles each opcode takes, and prints
+ * a report sorted by count when it shuts down.
+ */
+#if defined(CTOK_OPCODE_STATS)
+#define DEBUG_OPCODE_STATS
+#endif
+
+/**
+ * When the build enables CTOK_COMPUTED_GOTO (see the CMake option of the same name) and the compiler supports the GCC/Clang
+ * labels-as-values extension, the VM dispatches bytecode through a jump table of handler addresses instead of a switch.
+ * Other compilers silently fall back to the switch.
+ */
+#if defined(CTOK_COMPUTED_GOTO) && defined(__GNUC__)
+#define COMPUTED_GOTO
+#endif
+
+/**
+ * When the build enables CTOK_JIT (see the CMake option of the same name), hot functions get compiled to machine code
+ * by the baseline JIT in jit.c. It needs NaN boxing, an x86-64 machine with the System V calling convention and mmap()
+ * to get executable memory, everywhere else the VM sticks to the interpreter. Tracing the execution turns it off too,
+ * the machine code runs instructions without tracing them, and so does counting opcodes.
+ */
+#if defined(CTOK_JIT) && defined(NAN_BOXING) && defined(__x86_64__) && !defined(_WIN32) && \
+    (defined(__unix__) || defined(__APPLE__)) && !defined(DEBUG_TRACE_EXECUTION) && !defined(DEBUG_OPCODE_STATS)
+#define JIT
+#endif
+
+/**
+ * Storage class of the state the scanner and the compiler keep in globals. Every thread gets its own copy, so that
+ * threads running VMs of their own can compile at the same time.
+ */
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif //CTOK_COMMON_H
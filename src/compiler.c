@@ -10,6 +10,7 @@
 #include "compiler.h"
 #include "memory.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 
@@ -18,10 +19,14 @@
 #endif
 
 typedef struct {
+    // VM the code is compiled for, which the functions and constants get allocated in.
+    VM* vm;
     Token current;
     Token previous;
     bool hadError;
     bool panicMode;
+    // Source being compiled, when the VM compiles lazily. The functions left for later hold on to it, NULL otherwise.
+    ObjString* source;
 } Parser;
 
 typedef enum {
@@ -84,6 +89,22 @@ typedef enum {
     TYPE_SCRIPT
 } FunctionType;
 
+/**
+ * Records the last literal value (number, string, true, false or nil) emitted into the current chunk.
+ * The compiler is single pass, so by the time it sees an operator, its operands have already been emitted. If the code
+ * for an operand is exactly one literal-loading instruction at the very end of the chunk, we know the operand's value at
+ * compile time, and we can take the instruction back out to fold the operation.
+ */
+typedef struct {
+    // offset of the instruction that loads the literal, -1 if there is no literal to track.
+    int start;
+    // offset right after the instruction.
+    int end;
+    // number of entries in the constant table before the literal was emitted.
+    int constantCount;
+    Value value;
+} Literal;
+
 /**
  * Data structure to back the compiler implementation.
  * A flat array of all the locals that are in the scope during each point in the compilation
@@ -109,6 +130,10 @@ typedef struct Compiler {
     Upvalue upvalues[UINT8_COUNT];
     // scopeDepth tracks the number of blocks surrounding the current bit of code being compiled.
     int scopeDepth;
+    // The last literal emitted into this function's chunk, used for constant folding.
+    Literal lastLiteral;
+    // offset of the last OP_CALL emitted into this function's chunk, used to find calls in tail position.
+    int lastCall;
 } Compiler;
 
 /**
@@ -121,11 +146,10 @@ typedef struct ClassCompiler {
     bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler* current = NULL;
+static THREAD_LOCAL Parser parser;
+static THREAD_LOCAL Compiler* current = NULL;
 // variable pointing to a struct representing the current, innermost class being compiled.
-ClassCompiler* currentClass = NULL;
-Chunk* compilingChunk;
+static THREAD_LOCAL ClassCompiler* currentClass = NULL;
 
 /**
  * Utility method to return a pointer to the current chunk being compiled.
@@ -240,7 +264,21 @@ static bool match(TokenType type) {
  * @param byte bytecode instruction / operand to be emitted
  */
 static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    writeChunk(parser.vm, currentChunk(), byte, parser.previous.line);
+}
+
+/**
+ * Emits an instruction that accesses a variable. Globals are addressed by a two byte slot index, locals and upvalues by
+ * a single byte.
+ * @param instruction
+ * @param arg slot of the variable.
+ */
+static void emitVariable(uint8_t instruction, int arg) {
+    emitByte(instruction);
+    if (instruction == OP_GET_GLOBAL || instruction == OP_SET_GLOBAL || instruction == OP_DEFINE_GLOBAL) {
+        emitByte((arg >> 8) & 0xff);
+    }
+    emitByte(arg & 0xff);
 }
 
 /**
@@ -295,17 +333,39 @@ static void emitReturn() {
     emitByte(OP_RETURN);
 }
 
+/**
+ * Checks whether two constants are interchangeable. Unlike valuesEqual(), numbers are compared bit for bit, otherwise
+ * 0 and -0 would end up sharing a slot in the constant table.
+ * @param a
+ * @param b
+ * @return
+ */
+static bool identicalConstants(Value a, Value b) {
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    return valuesEqual(a, b);
+}
+
 /**
  * This function adds the given value to the end of the chunk's constant table and returns its index.
  * The function's job is mostly to make sure we don't have too many constants.
  * Since the OP_CONSTANT instruction uses a single byte for the index operand,
  * we can store and load only upto 256 constants in a chunk.
+ * If the table already holds the same value, we reuse that slot instead of adding a copy.
  * @param value
  * @return
  */
 static uint8_t makeConstant(Value value) {
+    ValueArray* constants = &currentChunk()->constants;
+    for (int i = 0; i < constants->count && i <= UINT8_MAX; i++) {
+        if (identicalConstants(constants->values[i], value)) return (uint8_t) i;
+    }
+
     // We get the index of the constant in the ValueArray after pushing it there.
-    int constant = addConstant(currentChunk(), value);
+    int constant = addConstant(parser.vm, currentChunk(), value);
     // In case we overflowed our limit for maximum number of constants in one chunk (256), we report this error.
     if (constant > UINT8_MAX) {
         error("Too many constants in one chunk.");
@@ -316,6 +376,17 @@ static uint8_t makeConstant(Value value) {
     return (uint8_t) constant;
 }
 
+/**
+ * Allocates an inline cache in the current chunk and emits its index as a two byte operand.
+ */
+static void emitInlineCache() {
+    int cache = addInlineCache(parser.vm, currentChunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one function.");
+    }
+    emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
 /**
  * Firstly we add the value to the constant table using a call to makeConstant(), then we emit an OP_CONSTANT
  * instruction that pushes it onto the stack at runtime.
@@ -326,6 +397,49 @@ static void emitConstant(Value value) {
     emitBytes(OP_CONSTANT, makeConstant(value));
 }
 
+/**
+ * Emits the instruction that loads a literal value and records it as the current function's last literal.
+ * true, false and nil have dedicated instructions, everything else goes through the constant table.
+ * @param value
+ */
+static void emitLiteral(Value value) {
+    Literal* literal = &current->lastLiteral;
+    literal->constantCount = currentChunk()->constants.count;
+    literal->start = currentChunk()->count;
+    if (IS_NIL(value)) {
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(value);
+    }
+    literal->end = currentChunk()->count;
+    literal->value = value;
+}
+
+/**
+ * Checks whether the code emitted so far ends with a literal, i.e. whether the value of the expression that was just
+ * compiled is known at compile time.
+ * @param literal out parameter, receives the literal if there is one.
+ * @return
+ */
+static bool endsWithLiteral(Literal* literal) {
+    *literal = current->lastLiteral;
+    return literal->start != -1 && literal->end == currentChunk()->count;
+}
+
+/**
+ * Throws away everything that was emitted into the current chunk after the given point. That includes the constants,
+ * anything added to the constant table since then is only referenced by the code being thrown away.
+ * @param codeCount number of bytes of code to keep.
+ * @param constantCount number of constants to keep.
+ */
+static void discardCode(int codeCount, int constantCount) {
+    truncateChunk(currentChunk(), codeCount);
+    currentChunk()->constants.count = constantCount;
+    current->lastLiteral.start = -1;
+}
+
 /**
  * Patches the incomplete jump instruction emitted by emitJump.
  * It goes back to the bytecode and replaces the operand at the given location with the calculated jump offset.
@@ -344,34 +458,42 @@ static void patchJump(int offset) {
     // break the 16 bit offset into two 8 bit pieces.
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
+
+    // The jump lands right after whatever was emitted last. So even if that happens to be a literal, it's no longer
+    // the only way the value on top of the stack could have been produced.
+    current->lastLiteral.start = -1;
 }
 
 /**
  * Initializes the compiler for whatever kind of function we are compiling.
  * @param compiler
+ * @param type
+ * @param function function to compile into, or NULL to create a new one named after the previous token.
  */
-static void initCompiler(Compiler* compiler, FunctionType type) {
+static void initCompiler(Compiler* compiler, FunctionType type, ObjFunction* function) {
     // Save a reference to the enclosing compiler instance.
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lastLiteral.start = -1;
+    compiler->lastCall = -1;
     /**
      * We create an ObjFunction in the compiler itself. Even though its a runtime representation of the function.
      * The way to think of it is that a function is similar to a string or a number literal. It forms a bridge between
      * the compile-time and runtime worlds. When you reach a function declaration - they produce a value of a built in type (ObjFunction).
      * So the compiler creates the function objects during compilation. Then, at runtime, they are simply invoked.
      */
-    compiler->function = newFunction();
+    compiler->function = function != NULL ? function : newFunction(parser.vm);
     current = compiler;
 
     // we call initCompiler right after we parse the function's name. That means we can simply grab the name from the previous token.
-    if (type != TYPE_SCRIPT) {
+    if (type != TYPE_SCRIPT && function == NULL) {
         // NOTE: we create a copy of the name string. Since the lexeme points straight to the source code string.
         // The string may get freed once the code is finished compiling. The function object we create in the compiler outlives
         // the compiler and persists in realtime. So it needs its own heap-allocated name string that it can keep around.
-        current->function->name = copyString(parser.previous.start, parser.previous.length);
+        current->function->name = copyString(parser.vm, parser.previous.start, parser.previous.length);
     }
 
     /**
@@ -398,21 +520,225 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     }
 }
 
+/**
+ * Checks whether the constant at the given index in the chunk's constant table is a number.
+ * The fused arithmetic and comparison superinstructions only handle number constants.
+ * @param chunk
+ * @param constant index into the chunk's constant table.
+ * @return
+ */
+static bool isNumberConstant(Chunk* chunk, uint8_t constant) {
+    return IS_NUMBER(chunk->constants.values[constant]);
+}
+
+/**
+ * Tries to match a fusable instruction sequence starting at the given offset.
+ * A sequence only matches if none of its instructions, except the first one, is the target of a jump. Otherwise some
+ * path through the code would land in the middle of the superinstruction.
+ * @param chunk chunk being optimized.
+ * @param offset offset of the first instruction of the candidate sequence.
+ * @param isTarget flags marking every offset in the chunk that some jump lands on.
+ * @param fused out parameter, receives the superinstruction to emit.
+ * @return number of bytes of the original code covered by the sequence, or 0 if nothing matched.
+ */
+static int matchSuperinstruction(Chunk* chunk, int offset, const bool* isTarget, uint8_t* fused) {
+    uint8_t* code = chunk->code;
+    int end = chunk->count;
+
+    switch (code[offset]) {
+        case OP_GET_LOCAL: {
+            // Every sequence we fuse that starts with OP_GET_LOCAL has another instruction at offset + 2.
+            if (offset + 2 >= end || isTarget[offset + 2]) return 0;
+
+            if (code[offset + 2] == OP_GET_PROPERTY) {
+                *fused = OP_GET_LOCAL_PROPERTY;
+                return 6;
+            }
+
+            if (code[offset + 2] != OP_CONSTANT || !isNumberConstant(chunk, code[offset + 3])) return 0;
+            if (offset + 4 >= end || isTarget[offset + 4]) return 0;
+
+            switch (code[offset + 4]) {
+                case OP_ADD:
+                    *fused = OP_ADD_LOCAL_CONSTANT;
+                    return 5;
+                case OP_SUBTRACT:
+                    *fused = OP_SUBTRACT_LOCAL_CONSTANT;
+                    return 5;
+                case OP_LESS:
+                    // This is the shape of a typical loop header: "while (i < 10)" or "for (...; i < 10; ...)".
+                    if (offset + 5 >= end || isTarget[offset + 5] || code[offset + 5] != OP_JUMP_IF_FALSE) return 0;
+                    *fused = OP_LESS_LOCAL_CONSTANT_JUMP;
+                    return 8;
+                default:
+                    return 0;
+            }
+        }
+        case OP_SET_LOCAL:
+            // The shape of an assignment statement to a local variable.
+            if (offset + 2 >= end || isTarget[offset + 2] || code[offset + 2] != OP_POP) return 0;
+            *fused = OP_SET_LOCAL_POP;
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Records a jump whose offset operand can only be filled in once the whole function has been rewritten.
+ */
+typedef struct {
+    // position of the two byte offset operand in the rewritten code.
+    int operand;
+    // offset of the instruction the jump lands on, in the original code.
+    int target;
+    // true for OP_LOOP, which jumps backwards.
+    bool backward;
+} JumpFixup;
+
+/**
+ * Peephole optimization pass that runs over a function's bytecode once it has been completely compiled.
+ * Some short instruction sequences show up over and over again in Tok programs, for instance, the
+ * <code>OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE</code> sequence at the head of most loops. The pass fuses
+ * such sequences into a single superinstruction, so the VM goes through its dispatch loop fewer times.
+ * Fusing shrinks the code, which moves the instructions around. So we keep a map from each original offset to its
+ * new offset, and once the code has been rewritten we patch the operand of every jump to point at the new location of
+ * its original target.
+ * @param chunk chunk to be optimized in place.
+ */
+static void optimizeChunk(Chunk* chunk) {
+    int count = chunk->count;
+    uint8_t* code = chunk->code;
+
+    // First we mark every offset that a jump lands on. count + 1 entries, since a jump can land right at the end.
+    bool* isTarget = ALLOCATE(parser.vm, bool, count + 1);
+    for (int i = 0; i <= count; i++) isTarget[i] = false;
+    int jumpCount = 0;
+    for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+        uint8_t instruction = code[offset];
+        if (instruction != OP_JUMP && instruction != OP_JUMP_IF_FALSE && instruction != OP_LOOP) continue;
+        int jump = (code[offset + 1] << 8) | code[offset + 2];
+        isTarget[instruction == OP_LOOP ? offset + 3 - jump : offset + 3 + jump] = true;
+        jumpCount++;
+    }
+
+    // Then we rewrite the code into a fresh chunk, fusing whatever sequences we can on the way.
+    Chunk optimized;
+    initChunk(&optimized);
+    int* newOffset = ALLOCATE(parser.vm, int, count + 1);
+    JumpFixup* fixups = ALLOCATE(parser.vm, JumpFixup, jumpCount);
+    int fixupCount = 0;
+
+    for (int offset = 0; offset < count;) {
+        newOffset[offset] = optimized.count;
+        uint8_t fused;
+        int length = matchSuperinstruction(chunk, offset, isTarget, &fused);
+
+        if (length == 0) {
+            // Nothing to fuse, copy the instruction over as is.
+            length = instructionLength(chunk, offset);
+            uint8_t instruction = code[offset];
+            if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP) {
+                int jump = (code[offset + 1] << 8) | code[offset + 2];
+                fixups[fixupCount++] = (JumpFixup) {
+                        optimized.count + 1,
+                        instruction == OP_LOOP ? offset + 3 - jump : offset + 3 + jump,
+                        instruction == OP_LOOP
+                };
+            }
+            int line = getLine(chunk, offset);
+            for (int i = 0; i < length; i++) {
+                writeChunk(parser.vm, &optimized, code[offset + i], line);
+            }
+            offset += length;
+            continue;
+        }
+
+        // The superinstruction takes the line of the last instruction in the sequence, that's the one which can
+        // report a runtime error.
+        int line = getLine(chunk, offset + length - 1);
+        writeChunk(parser.vm, &optimized, fused, line);
+        // All the superinstructions start with the operand of the first instruction: a local slot.
+        writeChunk(parser.vm, &optimized, code[offset + 1], line);
+        switch (fused) {
+            case OP_GET_LOCAL_PROPERTY:
+                // followed by the operands of OP_GET_PROPERTY: the property name and the inline cache index.
+                writeChunk(parser.vm, &optimized, code[offset + 3], line);
+                writeChunk(parser.vm, &optimized, code[offset + 4], line);
+                writeChunk(parser.vm, &optimized, code[offset + 5], line);
+                break;
+            case OP_ADD_LOCAL_CONSTANT:
+            case OP_SUBTRACT_LOCAL_CONSTANT:
+                // followed by the operand of the second instruction: a constant table index.
+                writeChunk(parser.vm, &optimized, code[offset + 3], line);
+                break;
+            case OP_LESS_LOCAL_CONSTANT_JUMP: {
+                writeChunk(parser.vm, &optimized, code[offset + 3], line);
+                // the jump offset gets patched once we know where everything ended up.
+                int jump = (code[offset + 6] << 8) | code[offset + 7];
+                fixups[fixupCount++] = (JumpFixup) {optimized.count, offset + 8 + jump, false};
+                writeChunk(parser.vm, &optimized, 0xff, line);
+                writeChunk(parser.vm, &optimized, 0xff, line);
+                break;
+            }
+            default:
+                break;
+        }
+        // Nothing can jump into the middle of the sequence, so intermediate offsets don't need a mapping.
+        offset += length;
+    }
+    newOffset[count] = optimized.count;
+
+    // Retarget the jumps. The code only ever shrinks, so the new offsets always fit in 16 bits.
+    for (int i = 0; i < fixupCount; i++) {
+        JumpFixup* fixup = &fixups[i];
+        int target = newOffset[fixup->target];
+        int jump = fixup->backward ? fixup->operand + 2 - target : target - (fixup->operand + 2);
+        optimized.code[fixup->operand] = (jump >> 8) & 0xff;
+        optimized.code[fixup->operand + 1] = jump & 0xff;
+    }
+
+    FREE_ARRAY(parser.vm, JumpFixup, fixups, jumpCount);
+    FREE_ARRAY(parser.vm, int, newOffset, count + 1);
+    FREE_ARRAY(parser.vm, bool, isTarget, count + 1);
+
+    // Swap the rewritten code into the chunk. The constant table is left untouched.
+    FREE_ARRAY(parser.vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(parser.vm, LineStart, chunk->lines, chunk->lineCapacity);
+    chunk->code = optimized.code;
+    chunk->count = optimized.count;
+    chunk->capacity = optimized.capacity;
+    chunk->lines = optimized.lines;
+    chunk->lineCount = optimized.lineCount;
+    chunk->lineCapacity = optimized.lineCapacity;
+    freeValueArray(parser.vm, &optimized.constants);
+}
+
 /**
  * Clean up function.
  */
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
+    // Errors may leave the bytecode in an inconsistent state, and it will never run anyway.
+    if (!parser.hadError) {
+        optimizeChunk(currentChunk());
+        function->maxSlots = stackDepth(currentChunk(), function->arity + 1);
+        // The compiler's code always holds up. Should it not, no instruction pushes more than one value.
+        if (function->maxSlots == -1) function->maxSlots = function->arity + 1 + currentChunk()->count;
+    }
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         // We check if the name of the function is null. User defined functions have names, but the implicit
         // top level function does not.
-        disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+        disassembleChunk(parser.vm, currentChunk(), function->name != NULL ? function->name->chars : "<script>");
     }
 #endif
     // restore the enclosing compiler instance.
     current = current->enclosing;
+    // The function is no longer traced as a compiler root, so whatever it got without going through the write barrier
+    // has to be remembered now.
+    rememberObject(parser.vm, (Obj*) function);
     return function;
 }
 
@@ -456,6 +782,8 @@ static int resolveUpvalue(Compiler* compiler, Token* name);
 
 static uint8_t identifierConstant(Token* name);
 
+static uint16_t identifierGlobal(Token* name);
+
 static ParseRule* getRule(TokenType type);
 
 static void parsePrecedence(Precedence precedence);
@@ -464,6 +792,85 @@ static void and_(bool canAssign);
 
 static uint8_t argumentList();
 
+/**
+ * Compile time version of the VM's isFalsey(). nil and false are falsey, every other value is truthy.
+ * @param value
+ * @return
+ */
+static bool isFalseyLiteral(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+/**
+ * Computes the result of a binary operator applied to two literals, exactly the way the VM would at runtime.
+ * Operations that would fail at runtime, like adding a number to a string, are not folded. We leave those in the code,
+ * so the user still gets the runtime error.
+ * @param operatorType operator token.
+ * @param a left operand.
+ * @param b right operand.
+ * @param result out parameter, receives the value of the expression.
+ * @return true if the operation could be folded.
+ */
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value* result) {
+    switch (operatorType) {
+        case TOKEN_EQUAL_EQUAL:
+            *result = BOOL_VAL(valuesEqual(a, b));
+            return true;
+        case TOKEN_BANG_EQUAL:
+            *result = BOOL_VAL(!valuesEqual(a, b));
+            return true;
+        case TOKEN_PLUS:
+            if (IS_STRING(a) && IS_STRING(b)) {
+                ObjString* left = AS_STRING(a);
+                ObjString* right = AS_STRING(b);
+                int length = left->length + right->length;
+                char* chars = ALLOCATE(parser.vm, char, length + 1);
+                memcpy(chars, left->chars, left->length);
+                memcpy(chars + left->length, right->chars, right->length);
+                chars[length] = '\0';
+                *result = OBJ_VAL(takeString(parser.vm, chars, length));
+                return true;
+            }
+            break;
+        default:
+            break;
+    }
+
+    // Everything else only works on numbers.
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType) {
+        case TOKEN_PLUS:
+            *result = NUMBER_VAL(x + y);
+            return true;
+        case TOKEN_MINUS:
+            *result = NUMBER_VAL(x - y);
+            return true;
+        case TOKEN_STAR:
+            *result = NUMBER_VAL(x * y);
+            return true;
+        case TOKEN_SLASH:
+            *result = NUMBER_VAL(x / y);
+            return true;
+        case TOKEN_GREATER:
+            *result = BOOL_VAL(x > y);
+            return true;
+        case TOKEN_LESS:
+            *result = BOOL_VAL(x < y);
+            return true;
+        // The VM compiles these to the negation of the opposite comparison, which makes a difference for NaN.
+        case TOKEN_GREATER_EQUAL:
+            *result = BOOL_VAL(!(x < y));
+            return true;
+        case TOKEN_LESS_EQUAL:
+            *result = BOOL_VAL(!(x > y));
+            return true;
+        default:
+            return false;
+    }
+}
+
 /**
  * Function to be used for infix parsing.
  * When an infix parsing function is called, the entire left hand operation has already been compiled,
@@ -477,9 +884,24 @@ static uint8_t argumentList();
 static void binary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
     ParseRule* rule = getRule(operatorType);
+    // The left operand has already been compiled, check if it was a literal.
+    Literal left;
+    bool isLeftLiteral = endsWithLiteral(&left);
     // Parse the right operand.
     parsePrecedence((Precedence) (rule->precedence + 1));
 
+    // If both operands are literals sitting right next to each other at the end of the chunk, try to compute the
+    // result right away. We drop the code for both operands and load the result instead.
+    Literal right;
+    if (isLeftLiteral && endsWithLiteral(&right) && right.start == left.end) {
+        Value result;
+        if (foldBinary(operatorType, left.value, right.value, &result)) {
+            discardCode(left.start, left.constantCount);
+            emitLiteral(result);
+            return;
+        }
+    }
+
     // Finally, emit the bytecode instruction that will perform the binary operation.
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:
@@ -527,6 +949,7 @@ static void binary(bool canAssign) {
  */
 static void call(bool canAssign) {
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
 }
 
@@ -536,13 +959,13 @@ static void call(bool canAssign) {
 static void literal(bool canAssign) {
     switch (parser.previous.type) {
         case TOKEN_FALSE:
-            emitByte(OP_FALSE);
+            emitLiteral(BOOL_VAL(false));
             break;
         case TOKEN_NIL:
-            emitByte(OP_NIL);
+            emitLiteral(NIL_VAL);
             break;
         case TOKEN_TRUE:
-            emitByte(OP_TRUE);
+            emitLiteral(BOOL_VAL(true));
             break;
         default:
             return;
@@ -566,19 +989,23 @@ static void dot(bool canAssign) {
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
         emitBytes(OP_SET_PROPERTY, name);
+        emitInlineCache();
     } else if (match(TOKEN_LEFT_PAREN)) {
         // optimized flow for method calls, occurs when method access and invocation are performed together (most common case).
         // after the compiler has parsed the property name, we look for a left parenthesis. If we match one, we switch to
         // this new code path. Here, we compile the argument list exactly like we do when compiling a call expression.
         uint8_t argCount = argumentList();
-        // emit OP_INVOKE, it takes two operands:
+        // emit OP_INVOKE, it takes three operands:
         // - index of the property name in the constant table.
         // - the number of arguments passed to the method.
+        // - index of the call site's inline cache.
         // basically, it combines the operands of the OP_GET_PROPERTY and OP_CALL instructions that it replaces, in that order.
         emitBytes(OP_INVOKE, name);
         emitByte(argCount);
+        emitInlineCache();
     } else {
         emitBytes(OP_GET_PROPERTY, name);
+        emitInlineCache();
     }
 }
 
@@ -591,6 +1018,46 @@ static void grouping(bool canAssign) {
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
+/**
+ * Function to compile list literals.
+ * Assumes TOKEN_LEFT_BRACKET has already been consumed. Each item expression leaves its value on the stack, and
+ * OP_BUILD_LIST then gathers that many values from the top of the stack into a new list, in order.
+ * @param canAssign
+ */
+static void list(bool canAssign) {
+    int itemCount = 0;
+    if (!check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            expression();
+            // The item count is an 8 bit operand, like the argument count of a call.
+            if (itemCount == 255) {
+                error("Can't have more than 255 items in a list literal.");
+            }
+            itemCount++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list items.");
+    emitBytes(OP_BUILD_LIST, (uint8_t) itemCount);
+}
+
+/**
+ * Method to handle getting and setting list items by index.
+ * The list has already been compiled and is on the stack, next we compile the index and, for a set expression, the value.
+ * @param canAssign
+ */
+static void subscript(bool canAssign) {
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    // Same as for properties, canAssign keeps a + b[0] = 3 from being read as a + (b[0] = 3).
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emitByte(OP_SET_INDEX);
+    } else {
+        emitByte(OP_GET_INDEX);
+    }
+}
+
 /**
  * Function to compile number literals.
  */
@@ -600,7 +1067,7 @@ static void number(bool canAssign) {
      * We then take that lexeme and use the C stdlib to convert it to a double value.
      */
     double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    emitLiteral(NUMBER_VAL(value));
 }
 
 /**
@@ -632,13 +1099,13 @@ static void or_(bool canAssign) {
  * wraps it in a Value, and adds it to the constant table.
  */
 static void string(bool canAssign) {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    emitLiteral(OBJ_VAL(copyString(parser.vm, parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 /**
  * Emits the bytecode to read a variable with a specific name.
- * Adds the name of the variable to the chunk's constant table as an ObjString, and stores it as an operand for OP_GET_*
- * or OP_SET_* in the bytecode.
+ * Locals and upvalues are resolved to their slots. Any other name is a global, which gets resolved to its slot in the
+ * VM's global variable array. The slot is the operand for OP_GET_* or OP_SET_* in the bytecode.
  * @param name Token for the variable to be read.
  */
 static void namedVariable(Token name, bool canAssign) {
@@ -656,7 +1123,7 @@ static void namedVariable(Token name, bool canAssign) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
+        arg = identifierGlobal(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
@@ -667,11 +1134,11 @@ static void namedVariable(Token name, bool canAssign) {
         // variable assignment.
         // we compile the assigned value.
         expression();
-        // Emit the byte code for variable assignment along with that variable's name's ObjString representation's index in the constant table as the operand to the bytecode.
-        emitBytes(setOp, (uint8_t) arg);
+        // Emit the byte code for variable assignment along with that variable's slot as the operand to the bytecode.
+        emitVariable(setOp, arg);
     } else {
-        // Emit the byte code for reading a variable along with that variable's name's ObjString representation's index in the constant table as the operand to the bytecode.
-        emitBytes(getOp, (uint8_t) arg);
+        // Emit the byte code for reading a variable along with that variable's slot as the operand to the bytecode.
+        emitVariable(getOp, arg);
     }
 }
 
@@ -763,6 +1230,37 @@ static void this_(bool canAssign) {
     variable(false);
 }
 
+/**
+ * Function to compile a yield expression, which hands a value to the fiber that resumed the running one and suspends it.
+ * The value is optional and defaults to nil. The yield itself evaluates to the value passed by the next resume.
+ * @param canAssign
+ */
+static void yield_(bool canAssign) {
+    if (check(TOKEN_SEMICOLON) || check(TOKEN_RIGHT_PAREN) || check(TOKEN_RIGHT_BRACKET) || check(TOKEN_COMMA)) {
+        emitByte(OP_NIL);
+    } else {
+        parsePrecedence(PREC_ASSIGNMENT);
+    }
+    emitByte(OP_YIELD);
+}
+
+/**
+ * Function to compile a resume expression, as in <code>resume(fiber, value)</code>, which runs the fiber until it yields
+ * or returns. The value is optional and defaults to nil. The resume evaluates to the value the fiber yielded or returned.
+ * @param canAssign
+ */
+static void resume_(bool canAssign) {
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'resume'.");
+    expression();
+    if (match(TOKEN_COMMA)) {
+        expression();
+    } else {
+        emitByte(OP_NIL);
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after resume arguments.");
+    emitByte(OP_RESUME);
+}
+
 /**
  * Function to compile unary operations
  */
@@ -777,6 +1275,21 @@ static void unary(bool canAssign) {
      */
     parsePrecedence(PREC_UNARY);
 
+    // If the operand is a literal, replace it with the result of the operation.
+    Literal operand;
+    if (endsWithLiteral(&operand)) {
+        if (operatorType == TOKEN_BANG) {
+            discardCode(operand.start, operand.constantCount);
+            emitLiteral(BOOL_VAL(isFalseyLiteral(operand.value)));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(operand.value)) {
+            discardCode(operand.start, operand.constantCount);
+            emitLiteral(NUMBER_VAL(-AS_NUMBER(operand.value)));
+            return;
+        }
+    }
+
     // Emit the operator instruction.
     switch (operatorType) {
         case TOKEN_BANG:
@@ -801,6 +1314,8 @@ ParseRule rules[] = {
         [TOKEN_RIGHT_PAREN]   = {NULL, NULL, PREC_NONE},
         [TOKEN_LEFT_BRACE]    = {NULL, NULL, PREC_NONE},
         [TOKEN_RIGHT_BRACE]   = {NULL, NULL, PREC_NONE},
+        [TOKEN_LEFT_BRACKET]  = {list, subscript, PREC_CALL},
+        [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
         [TOKEN_COMMA]         = {NULL, NULL, PREC_NONE},
         [TOKEN_DOT]           = {NULL, dot, PREC_CALL},
         [TOKEN_MINUS]         = {unary, binary, PREC_TERM},
@@ -835,6 +1350,8 @@ ParseRule rules[] = {
         [TOKEN_TRUE]          = {literal, NULL, PREC_NONE},
         [TOKEN_VAR]           = {NULL, NULL, PREC_NONE},
         [TOKEN_WHILE]         = {NULL, NULL, PREC_NONE},
+        [TOKEN_YIELD]         = {yield_, NULL, PREC_NONE},
+        [TOKEN_RESUME]        = {resume_, NULL, PREC_NONE},
         [TOKEN_ERROR]         = {NULL, NULL, PREC_NONE},
         [TOKEN_EOF]           = {NULL, NULL, PREC_NONE},
 };
@@ -883,7 +1400,22 @@ static void parsePrecedence(Precedence precedence) {
  * @return Index of the constant (ObjString) in the constant table.
  */
 static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    return makeConstant(OBJ_VAL(copyString(parser.vm, name->start, name->length)));
+}
+
+/**
+ * Resolves the name of a global variable to its slot in the VM's global variable array. The slot is the same every time
+ * the name comes up, in every function, for as long as the VM lives.
+ * @param name Token to be used as the identifier.
+ * @return slot of the global variable.
+ */
+static uint16_t identifierGlobal(Token* name) {
+    int slot = globalSlot(parser.vm, copyString(parser.vm, name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return (uint16_t) slot;
 }
 
 /**
@@ -1053,24 +1585,24 @@ static void declareVariable() {
 }
 
 /**
- *  Parses a variable identifier, stores its name as an ObjString* in the constant table.
+ *  Parses a variable identifier, and resolves it to a slot if it's a global variable.
  * @param errorMessage error message to be displayed when the next token isn't a TOKEN_IDENTIFIER
- * @return returns the index of the identifier in the constant table.
+ * @return returns the slot of the global variable.
  */
-static uint8_t parseVariable(const char* errorMessage) {
+static uint16_t parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     /**
      * First, the variable is 'declared' using declareVariable();
      * We exit the function if we're in local scope since, at runtime, locals aren't looked up
-     * by name, so, there's no need to stuff the variable's name into the constant table.
-     * So, we return a dummy table index instead.
+     * through the global variable array, so, there's no need to give the variable a global slot.
+     * So, we return a dummy slot instead.
      */
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    // returns the index of the identifier string (the variable name) in the constant table.
-    return identifierConstant(&parser.previous);
+    // returns the slot of the global variable.
+    return identifierGlobal(&parser.previous);
 }
 
 /**
@@ -1084,11 +1616,11 @@ static void markInitialized() {
 }
 
 /**
- * Outputs the bytecode instruction to define a new variable and store its initial value in the global constant table.
- * The index of the variable's name in the global constant table is the instruction's operand.
- * @param global index of the variable's name in the chunk's constant table.
+ * Outputs the bytecode instruction to define a new variable and store its initial value in its global slot.
+ * The slot is the instruction's operand.
+ * @param global slot of the global variable.
  */
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
     /**
     * In case we're in local scope, we don't need to emit any bytecode, since locals aren't created at runtime.
      * The VM has already executed the code for the variable's initializer (or the implicit nil if the user omitted the initializer),
@@ -1101,7 +1633,7 @@ static void defineVariable(uint8_t global) {
         markInitialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitVariable(OP_DEFINE_GLOBAL, global);
 }
 
 /**
@@ -1172,19 +1704,10 @@ static void block() {
 }
 
 /**
- * Compiles a function - its parameter list and block body.
- * Generates code that leaves the function on top of the stack.
- * We create a separate compiler for each function being compiled. When we start compiling a function declaration,
- * we create a new Compiler on the C stack and initialize it. <code>initCompiler()</code> sets that to be the current one.
- * Then, as we compile the body, all of the functions that emit bytecode write to the chunk owned by the new compiler's function.
- * After we reach the end of the function we call <code>endCompiler()</code>. That yields the newly compiled function object,
- * which we store as a constant in the surrounding function's constant table. We get a reference back to the surrounding
- * function using the linked list structure in our compiler.
- * @param type the kind of function being compiled.
+ * Compiles the parameter list and the block body of a function, into the function of the current compiler.
+ * @return the compiled function.
  */
-static void function(FunctionType type) {
-    Compiler compiler;
-    initCompiler(&compiler, type);
+static ObjFunction* functionBody() {
     // The beginScope() doesn't have a corresponding endScope() call. Because we end Compiler completely when we reach
     // the end of the function body.
     beginScope();
@@ -1201,7 +1724,7 @@ static void function(FunctionType type) {
             }
             // Semantically, a parameter is simply a local variable declared in the outermost lexical scope of the function body.
             // These variables get initialized later when we pass arguments into function calls.
-            uint8_t constant = parseVariable("Expect parameter name.");
+            uint16_t constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -1210,7 +1733,134 @@ static void function(FunctionType type) {
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
     block();
 
-    ObjFunction* function = endCompiler();
+    return endCompiler();
+}
+
+/**
+ * Checks whether a name is that of a local variable of one of the functions being compiled.
+ * @param name
+ * @return
+ */
+static bool isEnclosingLocal(Token* name) {
+    for (Compiler* compiler = current; compiler != NULL; compiler = compiler->enclosing) {
+        for (int i = compiler->localCount - 1; i >= 0; i--) {
+            if (identifiersEqual(name, &compiler->locals[i].name)) return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Skips the tokens of the parameter list and the body of a function, checking that the function can be compiled later.
+ * It can't be if it refers to anything the functions around it would have to hand down as an upvalue now: their local
+ * variables, 'this' outside of a method, and 'super'. Names are compared as they are, so a local of the function that
+ * shadows an enclosing one is enough to compile it right away.
+ * @param type the kind of function being skipped.
+ * @param end set to the '}' the body ends with.
+ * @return false if the function has to be compiled right away.
+ */
+static bool skipFunctionBody(FunctionType type, Token* end) {
+    // The parameters have to be names separated by commas, which is all the checking the function gets before its
+    // first call. Anything else gets compiled right away, for the error to be reported.
+    Token token = scanToken();
+    if (token.type != TOKEN_RIGHT_PAREN) {
+        int arity = 0;
+        for (;;) {
+            if (token.type != TOKEN_IDENTIFIER || ++arity > 255 || isEnclosingLocal(&token)) return false;
+            token = scanToken();
+            if (token.type == TOKEN_RIGHT_PAREN) break;
+            if (token.type != TOKEN_COMMA) return false;
+            token = scanToken();
+        }
+    }
+    if (scanToken().type != TOKEN_LEFT_BRACE) return false;
+
+    int depth = 1;
+    while (depth > 0) {
+        token = scanToken();
+        switch (token.type) {
+            case TOKEN_LEFT_BRACE:
+                depth++;
+                break;
+            case TOKEN_RIGHT_BRACE:
+                depth--;
+                break;
+            case TOKEN_IDENTIFIER:
+                if (isEnclosingLocal(&token)) return false;
+                break;
+            case TOKEN_THIS:
+                if (type == TYPE_FUNCTION) return false;
+                break;
+            case TOKEN_SUPER:
+            case TOKEN_ERROR:
+            case TOKEN_EOF:
+                return false;
+            default:
+                break;
+        }
+    }
+    *end = token;
+    return true;
+}
+
+/**
+ * Leaves the parameter list and the body of a function for compileFunction() to compile the first time the function
+ * gets called, if it can be compiled then, and emits the closure for it right away. Most functions of a big program
+ * never run, or not early, so their compilation is no longer paid for up front.
+ * @param type the kind of function being compiled.
+ * @return false if the function has to be compiled right away, with the parser back where it was.
+ */
+static bool skipFunction(FunctionType type) {
+    if (!check(TOKEN_LEFT_PAREN)) return false;
+    Token name = parser.previous;
+    Token parameters = parser.current;
+    Token end;
+    if (!skipFunctionBody(type, &end)) {
+        // Scanning starts over right after the '(', which is a single character.
+        initScannerAt(parameters.start + parameters.length, parameters.line);
+        return false;
+    }
+
+    VM* vm = parser.vm;
+    ObjFunction* function = newFunction(vm);
+    // The function has to stay reachable until it is in the constant table.
+    push(vm, OBJ_VAL(function));
+    function->arity = -1;
+    function->name = copyString(vm, name.start, name.length);
+    writeBarrier(vm, (Obj*) function, OBJ_VAL(function->name));
+    function->lazySource = parser.source;
+    writeBarrier(vm, (Obj*) function, OBJ_VAL(parser.source));
+    function->lazyStart = (int) (parameters.start - parser.source->chars);
+    function->lazyLine = parameters.line;
+    function->lazyType = (uint8_t) type;
+    // A function that doesn't capture anything has no upvalue operands.
+    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    pop(vm);
+
+    // The parser carries on after the body.
+    parser.current = end;
+    advance();
+    return true;
+}
+
+/**
+ * Compiles a function - its parameter list and block body.
+ * Generates code that leaves the function on top of the stack.
+ * We create a separate compiler for each function being compiled. When we start compiling a function declaration,
+ * we create a new Compiler on the C stack and initialize it. <code>initCompiler()</code> sets that to be the current one.
+ * Then, as we compile the body, all of the functions that emit bytecode write to the chunk owned by the new compiler's function.
+ * After we reach the end of the function we call <code>endCompiler()</code>. That yields the newly compiled function object,
+ * which we store as a constant in the surrounding function's constant table. We get a reference back to the surrounding
+ * function using the linked list structure in our compiler.
+ * When the VM compiles lazily, the function may get skipped instead, see skipFunction().
+ * @param type the kind of function being compiled.
+ */
+static void function(FunctionType type) {
+    if (parser.source != NULL && skipFunction(type)) return;
+
+    Compiler compiler;
+    initCompiler(&compiler, type, NULL);
+    ObjFunction* function = functionBody();
     // We emit an OP_CLOSURE instruction which takes a single operand that represents a constant table index for the function.
     emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
@@ -1265,7 +1915,7 @@ static void classDeclaration() {
     emitBytes(OP_CLASS, nameConstant);
     // we define the variable before we parse the body. That way users can refer to the containing class inside the bodies
     // of its own methods. That's useful for factory methods that the user may want to define.
-    defineVariable(nameConstant);
+    defineVariable(current->scopeDepth > 0 ? 0 : identifierGlobal(&className));
 
     // We maintain the memory of the ClassCompiler right on the C stack.
     // If we aren't inside any class declaration at all, the module variable currentClass is NULL.
@@ -1340,7 +1990,7 @@ static void classDeclaration() {
  * function to a global variable. Inside a block or other function, a function declaration creates its own local variable.
  */
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+    uint16_t global = parseVariable("Expect function name.");
     // To support recursion, we mark a function declaration as initialized, before completely parsing it. Unlike in case of local variables.
     markInitialized();
     function(TYPE_FUNCTION);
@@ -1353,7 +2003,7 @@ static void funDeclaration() {
 static void varDeclaration() {
     // The 'var' keyword is followed by the name of the variable, we compile that using parseVariable.
     // global stores the index of the identifier string (the variable name) present in the constant table.
-    uint8_t global = parseVariable("Expect variable name.");
+    uint16_t global = parseVariable("Expect variable name.");
 
     // Then we look for an '='.
     if (match(TOKEN_EQUAL)) {
@@ -1474,6 +2124,26 @@ static void ifStatement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+    // If the condition is a literal, we know which branch is going to run. Both branches are still compiled so that
+    // the user gets to see any errors in them, but the dead one is thrown away afterwards along with the condition.
+    Literal condition;
+    if (endsWithLiteral(&condition)) {
+        discardCode(condition.start, condition.constantCount);
+        bool isTrue = !isFalseyLiteral(condition.value);
+        int codeCount = currentChunk()->count;
+        int constantCount = currentChunk()->constants.count;
+        statement();
+        if (!isTrue) discardCode(codeCount, constantCount);
+
+        if (match(TOKEN_ELSE)) {
+            codeCount = currentChunk()->count;
+            constantCount = currentChunk()->constants.count;
+            statement();
+            if (isTrue) discardCode(codeCount, constantCount);
+        }
+        return;
+    }
+
     // We emit an OP_JUMP_IF_FALSE instruction. It has an operand for how much to offset the ip - how many bytes of code to skip.
     // If the condition is falsey, it adjusts the ip by that amount.
     int thenJump = emitJump(OP_JUMP_IF_FALSE);
@@ -1522,6 +2192,12 @@ static void returnStatement() {
         // In case a value is returned, parse that value and emit the OP_RETURN.
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // If the value is the result of a call, that call is what the function ends with, and it becomes a tail call.
+        // The OP_RETURN stays, for the paths that jump past the call, like the short-circuit of 'return a and f();'.
+        Chunk* chunk = currentChunk();
+        if (current->lastCall == chunk->count - 2 && chunk->code[current->lastCall] == OP_CALL) {
+            chunk->code[current->lastCall] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
@@ -1546,6 +2222,20 @@ static void whileStatement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+    // A literal condition means the loop either never runs, in which case we throw the whole thing away once the body
+    // has been compiled, or never stops, in which case there's no need to test the condition on every iteration.
+    Literal condition;
+    if (endsWithLiteral(&condition)) {
+        discardCode(condition.start, condition.constantCount);
+        statement();
+        if (isFalseyLiteral(condition.value)) {
+            discardCode(loopStart, condition.constantCount);
+        } else {
+            emitLoop(loopStart);
+        }
+        return;
+    }
+
     // Emit jump statement in case you need to skip over the body.
     int exitJump = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
@@ -1635,14 +2325,18 @@ static void statement() {
 
 /**
  * Given the source code, this function compiles it to an intermediate bytecode representation.
+ * @param vm VM to compile the code for.
  * @param source character array representing the source code
  * @param chunk Represents the current chunk being written. Acts like an output parameter.
  * @return true if compilation succeeds, false otherwise.
  */
-ObjFunction* compile(const char* source) {
-    initScanner(source);
+ObjFunction* compile(VM* vm, const char* source) {
+    parser.vm = vm;
+    // The functions left for later need the source when they get called, and the caller's copy may be gone by then.
+    parser.source = vm->lazyCompilation ? copyString(vm, source, (int) strlen(source)) : NULL;
+    initScanner(parser.source != NULL ? parser.source->chars : source);
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
     parser.hadError = false;
     parser.panicMode = false;
@@ -1655,20 +2349,63 @@ ObjFunction* compile(const char* source) {
 
     // Our compiler returns a reference to the function it just compiled.
     ObjFunction* function = endCompiler();
+    parser.source = NULL;
     // We return the function object if the code compiled properly, otherwise we return NULL.
     // This makes sure the VM doesn't try to execute a function that may contain invalid bytecode.
     return parser.hadError ? NULL : function;
 }
 
+/**
+ * Compiles the body of a function compile() left for later, the first time the function gets called.
+ * @param vm
+ * @param function function whose lazySource is set.
+ * @return false if the body doesn't compile, after reporting the errors. The function then stays uncompiled, and the
+ * next call reports them again.
+ */
+bool compileFunction(VM* vm, ObjFunction* function) {
+    parser.vm = vm;
+    parser.source = function->lazySource;
+    parser.hadError = false;
+    parser.panicMode = false;
+    initScannerAt(function->lazySource->chars + function->lazyStart, function->lazyLine);
+    // A method may use 'this', but not 'super', or it wouldn't have been left for later. So the class it is in doesn't
+    // matter anymore.
+    ClassCompiler classCompiler = {NULL, false};
+    currentClass = function->lazyType == TYPE_FUNCTION ? NULL : &classCompiler;
+
+    function->arity = 0;
+    Compiler compiler;
+    initCompiler(&compiler, (FunctionType) function->lazyType, function);
+    advance();
+    functionBody();
+    currentClass = NULL;
+    parser.source = NULL;
+
+    if (parser.hadError) {
+        freeChunk(vm, &function->chunk);
+        function->arity = -1;
+        return false;
+    }
+    function->lazySource = NULL;
+    return true;
+}
+
 /**
  * Collection can begin during any allocation. Those allocations don’t just happen while the user’s program is running.
  * The compiler itself periodically grabs memory from the heap for literals and the constant table.
  * If the GC runs while we’re in the middle of compiling, then any values the compiler directly accesses need to be treated as roots too.
+ * @param vm
  */
-void markCompilerRoots() {
+void markCompilerRoots(VM* vm) {
+    // The compiler state belongs to the thread, and only holds objects of the VM it is compiling for.
+    if (parser.vm != vm) return;
     Compiler* compiler = current;
     while (compiler != NULL) {
-        markObject((Obj*) compiler->function);
+        // A function being compiled gets its name and constants without going through the write barrier, so minor
+        // collections have to trace it even once it is old.
+        rememberObject(vm, (Obj*) compiler->function);
+        markObject(vm, (Obj*) compiler->function);
         compiler = compiler->enclosing;
     }
+    markObject(vm, (Obj*) parser.source);
 }
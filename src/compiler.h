@@ -9,8 +9,10 @@
 #include "object.h"
 #include "vm.h"
 
-ObjFunction* compile(const char* source);
+ObjFunction* compile(VM* vm, const char* source);
 
-void markCompilerRoots();
+bool compileFunction(VM* vm, ObjFunction* function);
+
+void markCompilerRoots(VM* vm);
 
 #endif //CTOK_COMPILER_H
@@ -7,17 +7,36 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "vm.h"
+
+/// Names of the opcodes, as the disassembler and the opcode statistics print them.
+static const char* const opcodeNames[] = {
+#define OPCODE_NAME(name, length) [name] = #name,
+    OPCODES(OPCODE_NAME)
+#undef OPCODE_NAME
+};
+
+/**
+ * Function to look up the name of an opcode.
+ * @param opcode
+ * @return the name, or NULL if there is no such opcode.
+ */
+const char* opcodeName(uint8_t opcode) {
+    if (opcode >= sizeof(opcodeNames) / sizeof(opcodeNames[0])) return NULL;
+    return opcodeNames[opcode];
+}
 
 /**
  * Function to disassemble instructions in a chunk.
+ * @param vm
  * @param chunk chunk being disassembled
  * @param name name of the instruction
  */
-void disassembleChunk(Chunk* chunk, const char* name) {
+void disassembleChunk(VM* vm, Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
 
     for (int offset = 0; offset < chunk->count;) {
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(vm, chunk, offset);
     }
 
 }
@@ -41,6 +60,40 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+/**
+ * Function to handle property access instructions, which take a constant for the property name and an inline cache.
+ * @param name name of the instruction
+ * @param chunk chunk being disassembled
+ * @param offset offset of the instruction in the chunk's code array.
+ * @return
+ */
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t) (chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 4;
+}
+
+/**
+ * Function to handle opcodes dealing with global variables, which take the two byte slot of the variable as operand.
+ * @param vm
+ * @param name name of the instruction
+ * @param chunk chunk being disassembled
+ * @param offset offset of the instruction in the chunk's code array.
+ * @return
+ */
+static int globalInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t) (chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm->globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
 /**
  * Function to disassemble an OP_INVOKE instruction.
  * @param name name of the method being called.
@@ -59,6 +112,25 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 3;
 }
 
+/**
+ * Function to disassemble an OP_INVOKE instruction, which on top of the operands printed by invokeInstruction() takes
+ * the index of an inline cache.
+ * @param name name of the instruction
+ * @param chunk chunk being disassembled.
+ * @param offset offset of the instruction in the chunk's code array.
+ * @return
+ */
+static int cachedInvokeInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint8_t argCount = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t) (chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 5;
+}
+
 /**
  * Function to output debug information for simple instructions - just the name of the instruction.
  * @param name name of the instruction
@@ -99,90 +171,150 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+/**
+ * Function to output the debug info for a superinstruction that reads a local slot and a constant.
+ * @param name name of the instruction
+ * @param chunk chunk being disassembled
+ * @param offset offset of the instruction in the chunk's code array.
+ * @return
+ */
+static int localConstantInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+/**
+ * Function to output the debug info for OP_GET_LOCAL_PROPERTY, which reads a local slot, a property name constant and an
+ * inline cache index.
+ * @param name name of the instruction
+ * @param chunk chunk being disassembled
+ * @param offset offset of the instruction in the chunk's code array.
+ * @return
+ */
+static int localPropertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t) (chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 5;
+}
+
+/**
+ * Function to output the debug info for a superinstruction that reads a local slot and a constant, then jumps forward.
+ * @param name name of the instruction
+ * @param chunk chunk being disassembled
+ * @param offset offset of the instruction in the chunk's code array.
+ * @return
+ */
+static int localConstantJumpInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t jump = (uint16_t) (chunk->code[offset + 3] << 8);
+    jump |= chunk->code[offset + 4];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' %4d -> %d\n", offset, offset + 5 + jump);
+    return offset + 5;
+}
+
 /**
  * Function to disassemble an instruction present inside a chunk at a given offset.
+ * @param vm
  * @param chunk chunk being disassembled
  * @param offset offset of the instruction in the chunk's code array.
  * @return
  */
-int disassembleInstruction(Chunk* chunk, int offset) {
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
+    const char* name = opcodeName(instruction);
     switch (instruction) {
         case OP_CONSTANT:
-            return constantInstruction("OP_CONSTANT", chunk, offset);
+            return constantInstruction(name, chunk, offset);
         case OP_NIL:
-            return simpleInstruction("OP_NIL", offset);
+            return simpleInstruction(name, offset);
         case OP_TRUE:
-            return simpleInstruction("OP_TRUE", offset);
+            return simpleInstruction(name, offset);
         case OP_FALSE:
-            return simpleInstruction("OP_FALSE", offset);
+            return simpleInstruction(name, offset);
         case OP_POP:
-            return simpleInstruction("OP_POP", offset);
+            return simpleInstruction(name, offset);
         case OP_GET_LOCAL:
-            return byteInstruction("OP_GET_LOCAL", chunk, offset);
+            return byteInstruction(name, chunk, offset);
         case OP_SET_LOCAL:
-            return byteInstruction("OP_SET_LOCAL", chunk, offset);
+            return byteInstruction(name, chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction(vm, name, chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction(vm, name, chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction(vm, name, chunk, offset);
         case OP_GET_UPVALUE:
-            return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+            return byteInstruction(name, chunk, offset);
         case OP_SET_UPVALUE:
-            return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+            return byteInstruction(name, chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction(name, chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction(name, chunk, offset);
         case OP_GET_SUPER:
-            return constantInstruction("OP_GET_SUPER", chunk, offset);
+            return constantInstruction(name, chunk, offset);
         case OP_EQUAL:
-            return simpleInstruction("OP_EQUAL", offset);
+            return simpleInstruction(name, offset);
         case OP_GREATER:
-            return simpleInstruction("OP_GREATER", offset);
+            return simpleInstruction(name, offset);
         case OP_LESS:
-            return simpleInstruction("OP_LESS", offset);
+            return simpleInstruction(name, offset);
         case OP_ADD:
-            return simpleInstruction("OP_ADD", offset);
+            return simpleInstruction(name, offset);
+        case OP_ADD_NUMBER:
+            return simpleInstruction(name, offset);
         case OP_SUBTRACT:
-            return simpleInstruction("OP_SUBTRACT", offset);
+            return simpleInstruction(name, offset);
         case OP_MULTIPLY:
-            return simpleInstruction("OP_MULTIPLY", offset);
+            return simpleInstruction(name, offset);
         case OP_DIVIDE:
-            return simpleInstruction("OP_DIVIDE", offset);
+            return simpleInstruction(name, offset);
         case OP_NOT:
-            return simpleInstruction("OP_NOT", offset);
+            return simpleInstruction(name, offset);
         case OP_NEGATE:
-            return simpleInstruction("OP_NEGATE", offset);
+            return simpleInstruction(name, offset);
         case OP_PRINT:
-            return simpleInstruction("OP_PRINT", offset);
+            return simpleInstruction(name, offset);
         case OP_JUMP:
-            return jumpInstruction("OP_JUMP", 1, chunk, offset);
+            return jumpInstruction(name, 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
-            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+            return jumpInstruction(name, 1, chunk, offset);
         case OP_LOOP:
-            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+            return jumpInstruction(name, -1, chunk, offset);
         case OP_CALL:
-            return byteInstruction("OP_CALL", chunk, offset);
+            return byteInstruction(name, chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction(name, chunk, offset);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return cachedInvokeInstruction(name, chunk, offset);
         case OP_SUPER_INVOKE:
-            return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+            return invokeInstruction(name, chunk, offset);
         case OP_CLOSURE: {
             // increase the offset to read the operand
             offset++;
             // the operand is the index in the constant table for the function representation.
             uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
+            printf("%-16s %4d ", name, constant);
             printValue(chunk->constants.values[constant]);
             printf("\n");
 
@@ -198,15 +330,35 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return offset;
         }
         case OP_CLOSE_UPVALUE:
-            return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+            return simpleInstruction(name, offset);
         case OP_RETURN:
-            return simpleInstruction("OP_RETURN", offset);
+            return simpleInstruction(name, offset);
         case OP_CLASS:
-            return constantInstruction("OP_CLASS", chunk, offset);
+            return constantInstruction(name, chunk, offset);
         case OP_INHERIT:
-            return simpleInstruction("OP_INHERIT", offset);
+            return simpleInstruction(name, offset);
         case OP_METHOD:
-            return constantInstruction("OP_METHOD", chunk, offset);
+            return constantInstruction(name, chunk, offset);
+        case OP_BUILD_LIST:
+            return byteInstruction(name, chunk, offset);
+        case OP_GET_INDEX:
+            return simpleInstruction(name, offset);
+        case OP_SET_INDEX:
+            return simpleInstruction(name, offset);
+        case OP_YIELD:
+            return simpleInstruction(name, offset);
+        case OP_RESUME:
+            return simpleInstruction(name, offset);
+        case OP_GET_LOCAL_PROPERTY:
+            return localPropertyInstruction(name, chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction(name, chunk, offset);
+        case OP_ADD_LOCAL_CONSTANT:
+            return localConstantInstruction(name, chunk, offset);
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            return localConstantInstruction(name, chunk, offset);
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return localConstantJumpInstruction(name, chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -0,0 +1,501 @@
+//
+// Fibers and the scheduler.
+//
+// The running fiber's frames, stack and open upvalues are the VM's own, so the interpreter runs a fiber like any other
+// code. Switching to another fiber swaps those with the ones kept in the fiber object.
+//
+// The scheduler is in charge of the fibers nobody resumed: the spawned ones, the ones that yielded without a caller to
+// yield to, and the ones waiting in sleep() or readLine(). It runs those that are ready one after the other, in the order
+// they got ready. Once none is, it waits for the next timer and for the standard input in a single epoll_wait(), or
+// poll() on systems without epoll, which is where the fibers waiting for input get their lines from.
+//
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "fiber.h"
+#include "memory.h"
+#include "vm.h"
+
+/// Number of bytes the scheduler reads from the standard input at a time.
+#define INPUT_CHUNK_SIZE 4096
+/// Longest the scheduler waits in one go, in milliseconds, which keeps far away timers from overflowing the timeout.
+#define WAIT_MAX_MSEC (24 * 60 * 60 * 1000)
+
+/**
+ * The fibers the scheduler runs, and what they wait for.
+ * The arrays aren't managed by the GC, like the gray stack: the scheduler must not trigger a collection while it moves
+ * fibers around. The fibers in them are roots, see markScheduler().
+ */
+struct Scheduler {
+    /// Fibers ready to run, in the order they got ready, in a ring buffer.
+    ObjFiber** ready;
+    int readyStart;
+    int readyCount;
+    int readyCapacity;
+    /// Fibers waiting in sleep(), in a binary heap ordered by the time they wake up at.
+    ObjFiber** sleepers;
+    int sleeperCount;
+    int sleeperCapacity;
+    /// Fibers waiting in readLine(), in the order they asked for a line.
+    ObjFiber** readers;
+    int readerCount;
+    int readerCapacity;
+    /// What was read from the standard input and doesn't make a whole line yet.
+    char* input;
+    int inputLength;
+    int inputCapacity;
+    /// Whether the standard input has reached its end.
+    bool inputClosed;
+#ifdef __linux__
+    /// epoll instance the scheduler waits in, -1 if there is none.
+    int epoll;
+    /// Whether the standard input is registered with the epoll instance. It only is while fibers wait for input,
+    /// otherwise unread input would cut every wait short.
+    bool watchingInput;
+#endif
+};
+
+/**
+ * Reads the clock the timers run on.
+ * @return time in seconds, from an arbitrary starting point.
+ */
+static double schedulerClock() {
+#ifdef _WIN32
+    return (double) GetTickCount64() / 1000.0;
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+#endif
+}
+
+/**
+ * Makes room for one more fiber in one of the scheduler's arrays.
+ * @param fibers
+ * @param count number of fibers in the array.
+ * @param capacity number of fibers the array can hold, updated if it grows.
+ * @return the array, which may have moved.
+ */
+static ObjFiber** reserveFiber(ObjFiber** fibers, int count, int* capacity) {
+    if (count < *capacity) return fibers;
+    *capacity = GROW_CAPACITY(*capacity);
+    fibers = (ObjFiber**) realloc(fibers, sizeof(ObjFiber*) * *capacity);
+    if (fibers == NULL) exit(1);
+    return fibers;
+}
+
+/**
+ * Returns the scheduler of the VM, which gets created the first time it's needed.
+ * @param vm
+ * @return
+ */
+static Scheduler* getScheduler(VM* vm) {
+    if (vm->scheduler != NULL) return vm->scheduler;
+    Scheduler* scheduler = (Scheduler*) calloc(1, sizeof(Scheduler));
+    if (scheduler == NULL) exit(1);
+#ifdef __linux__
+    scheduler->epoll = epoll_create1(EPOLL_CLOEXEC);
+#endif
+    vm->scheduler = scheduler;
+    return scheduler;
+}
+
+/**
+ * Makes another fiber the running one. The VM's frames, stack and open upvalues go back into the fiber that was running,
+ * and those of the other fiber take their place. The interpreter has to reload its state from the VM afterwards.
+ * A fiber that is done gives its stacks back right away.
+ * @param vm
+ * @param fiber
+ */
+void switchFiber(VM* vm, ObjFiber* fiber) {
+    ObjFiber* from = vm->fiber;
+    from->frames = vm->frames;
+    from->frameCount = vm->frameCount;
+    from->frameCapacity = vm->frameCapacity;
+    from->stack = vm->stack;
+    from->stackCapacity = vm->stackCapacity;
+    from->stackTop = vm->stackTop;
+    from->openUpvalues = vm->openUpvalues;
+    // The main fiber keeps its stacks for the next script, and open upvalues still point into the stack of a fiber
+    // that a runtime error stopped.
+    if (from->state == FIBER_DONE && from != vm->mainFiber && from->openUpvalues == NULL) {
+        free(from->frames);
+        free(from->stack);
+        from->frames = NULL;
+        from->frameCount = 0;
+        from->frameCapacity = 0;
+        from->stack = NULL;
+        from->stackCapacity = 0;
+        from->stackTop = NULL;
+    } else {
+        // The fiber got its stack without going through the write barrier.
+        rememberObject(vm, (Obj*) from);
+    }
+
+    vm->frames = fiber->frames;
+    vm->frameCount = fiber->frameCount;
+    vm->frameCapacity = fiber->frameCapacity;
+    vm->stack = fiber->stack;
+    vm->stackCapacity = fiber->stackCapacity;
+    vm->stackTop = fiber->stackTop;
+    vm->openUpvalues = fiber->openUpvalues;
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+    fiber->stack = NULL;
+    fiber->stackTop = NULL;
+    fiber->openUpvalues = NULL;
+    vm->fiber = fiber;
+}
+
+/**
+ * Hands a fiber over to the scheduler, which runs it once the fibers that got ready before it have had their turn.
+ * @param vm
+ * @param fiber
+ * @param value value the fiber carries on with.
+ */
+void scheduleFiber(VM* vm, ObjFiber* fiber, Value value) {
+    Scheduler* scheduler = getScheduler(vm);
+    fiber->state = FIBER_SCHEDULED;
+    fiber->transfer = value;
+    writeBarrier(vm, (Obj*) fiber, value);
+
+    if (scheduler->readyCount == scheduler->readyCapacity) {
+        // The ring buffer is unrolled into the new array, so the fibers stay in order.
+        int capacity = GROW_CAPACITY(scheduler->readyCapacity);
+        ObjFiber** ready = (ObjFiber**) malloc(sizeof(ObjFiber*) * capacity);
+        if (ready == NULL) exit(1);
+        for (int i = 0; i < scheduler->readyCount; i++) {
+            ready[i] = scheduler->ready[(scheduler->readyStart + i) % scheduler->readyCapacity];
+        }
+        free(scheduler->ready);
+        scheduler->ready = ready;
+        scheduler->readyStart = 0;
+        scheduler->readyCapacity = capacity;
+    }
+    int end = (scheduler->readyStart + scheduler->readyCount) % scheduler->readyCapacity;
+    scheduler->ready[end] = fiber;
+    scheduler->readyCount++;
+}
+
+/**
+ * Parks the running fiber until some time from now. It carries on with nil then.
+ * @param vm
+ * @param seconds
+ */
+void sleepFiber(VM* vm, double seconds) {
+    Scheduler* scheduler = getScheduler(vm);
+    ObjFiber* fiber = vm->fiber;
+    fiber->state = FIBER_SCHEDULED;
+    fiber->wakeTime = schedulerClock() + seconds;
+
+    scheduler->sleepers = reserveFiber(scheduler->sleepers, scheduler->sleeperCount, &scheduler->sleeperCapacity);
+    int index = scheduler->sleeperCount++;
+    // Sift up past the fibers that wake up later.
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (scheduler->sleepers[parent]->wakeTime <= fiber->wakeTime) break;
+        scheduler->sleepers[index] = scheduler->sleepers[parent];
+        index = parent;
+    }
+    scheduler->sleepers[index] = fiber;
+}
+
+/**
+ * Takes the fiber that wakes up first out of the heap of sleeping fibers.
+ * @param scheduler
+ * @return
+ */
+static ObjFiber* takeSleeper(Scheduler* scheduler) {
+    ObjFiber** sleepers = scheduler->sleepers;
+    ObjFiber* first = sleepers[0];
+    ObjFiber* last = sleepers[--scheduler->sleeperCount];
+    int count = scheduler->sleeperCount;
+    int index = 0;
+    // Sift the last fiber down from the top, past the fibers that wake up earlier.
+    for (;;) {
+        int child = 2 * index + 1;
+        if (child >= count) break;
+        if (child + 1 < count && sleepers[child + 1]->wakeTime < sleepers[child]->wakeTime) child++;
+        if (last->wakeTime <= sleepers[child]->wakeTime) break;
+        sleepers[index] = sleepers[child];
+        index = child;
+    }
+    if (count > 0) sleepers[index] = last;
+    return first;
+}
+
+#ifdef __linux__
+
+/**
+ * Registers the standard input with the epoll instance, or takes it out.
+ * @param scheduler
+ * @param watch
+ * @return false if the standard input can't be waited for, like when it is a regular file.
+ */
+static bool watchInput(Scheduler* scheduler, bool watch) {
+    if (watch == scheduler->watchingInput) return true;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    if (epoll_ctl(scheduler->epoll, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, STDIN_FILENO, &event) != 0) return false;
+    scheduler->watchingInput = watch;
+    return true;
+}
+
+#endif
+
+/**
+ * Waits until the standard input can be read from without blocking, or until the timeout is over.
+ * @param scheduler
+ * @param input whether to wait for the standard input, or just for the timeout.
+ * @param timeout in milliseconds, -1 to wait for as long as it takes.
+ * @return true if the standard input can be read from.
+ */
+static bool waitForInput(Scheduler* scheduler, bool input, int timeout) {
+#ifdef _WIN32
+    // The reads just block, there's nothing to wait for but the timeout.
+    if (input) return true;
+    if (timeout > 0) Sleep((DWORD) timeout);
+    return false;
+#else
+#ifdef __linux__
+    if (scheduler->epoll >= 0) {
+        // Reading a file that can't be waited for doesn't block either.
+        if (!watchInput(scheduler, input)) return true;
+        struct epoll_event event;
+        return epoll_wait(scheduler->epoll, &event, 1, timeout) > 0;
+    }
+#endif
+    (void) scheduler;
+    struct pollfd descriptor = {STDIN_FILENO, POLLIN, 0};
+    return poll(&descriptor, input ? 1 : 0, timeout) > 0 && input;
+#endif
+}
+
+/**
+ * Reads what the standard input has for the scheduler, which must not block.
+ * @param scheduler
+ */
+static void readInput(Scheduler* scheduler) {
+    if (scheduler->inputCapacity - scheduler->inputLength < INPUT_CHUNK_SIZE) {
+        scheduler->inputCapacity = scheduler->inputLength + 2 * INPUT_CHUNK_SIZE;
+        scheduler->input = (char*) realloc(scheduler->input, scheduler->inputCapacity);
+        if (scheduler->input == NULL) exit(1);
+    }
+    int count = (int) read(0, scheduler->input + scheduler->inputLength, INPUT_CHUNK_SIZE);
+    if (count > 0) {
+        scheduler->inputLength += count;
+    } else if (count == 0 || (errno != EINTR && errno != EAGAIN)) {
+        // Input that fails to be read is as good as over.
+        scheduler->inputClosed = true;
+    }
+}
+
+/**
+ * Takes the next line out of what was read from the standard input, without its line terminator.
+ * @param vm
+ * @param scheduler
+ * @param line set to the line as a string, or to nil once the input is over.
+ * @return false if there's no whole line yet.
+ */
+static bool takeLine(VM* vm, Scheduler* scheduler, Value* line) {
+    char* end = scheduler->inputLength > 0 ? memchr(scheduler->input, '\n', scheduler->inputLength) : NULL;
+    if (end == NULL && !scheduler->inputClosed) return false;
+    if (end == NULL && scheduler->inputLength == 0) {
+        *line = NIL_VAL;
+        return true;
+    }
+
+    // The last line may not have a terminator.
+    int length = end != NULL ? (int) (end - scheduler->input) : scheduler->inputLength;
+    int consumed = end != NULL ? length + 1 : length;
+    if (length > 0 && scheduler->input[length - 1] == '\r') length--;
+    *line = OBJ_VAL(copyString(vm, scheduler->input, length));
+    memmove(scheduler->input, scheduler->input + consumed, scheduler->inputLength - consumed);
+    scheduler->inputLength -= consumed;
+    return true;
+}
+
+/**
+ * Reads the standard input once it's readable, and hands the lines out to the fibers waiting for them.
+ * @param vm
+ * @param scheduler
+ */
+static void handOutInput(VM* vm, Scheduler* scheduler) {
+    readInput(scheduler);
+    while (scheduler->readerCount > 0) {
+        // The fiber stays a root until the line it gets is allocated.
+        Value line;
+        if (!takeLine(vm, scheduler, &line)) break;
+        ObjFiber* fiber = scheduler->readers[0];
+        scheduler->readerCount--;
+        memmove(scheduler->readers, scheduler->readers + 1, sizeof(ObjFiber*) * scheduler->readerCount);
+        scheduleFiber(vm, fiber, line);
+    }
+}
+
+/**
+ * Reads a line from the standard input for the running fiber, if there is one to be had without blocking. Otherwise
+ * the fiber gets parked until the scheduler has a line for it.
+ * @param vm
+ * @param line set to the line as a string, or to nil once the input is over.
+ * @return false if the fiber got parked.
+ */
+bool readLineNow(VM* vm, Value* line) {
+    Scheduler* scheduler = getScheduler(vm);
+    // The lines go to the fibers in the order they asked for them, so a fiber queues up behind those waiting already.
+    if (scheduler->readerCount == 0) {
+        for (;;) {
+            if (takeLine(vm, scheduler, line)) return true;
+            if (!waitForInput(scheduler, true, 0)) break;
+            readInput(scheduler);
+        }
+    }
+
+    ObjFiber* fiber = vm->fiber;
+    fiber->state = FIBER_SCHEDULED;
+    scheduler->readers = reserveFiber(scheduler->readers, scheduler->readerCount, &scheduler->readerCapacity);
+    scheduler->readers[scheduler->readerCount++] = fiber;
+    return false;
+}
+
+/**
+ * Picks the fiber to run next, once the running one is done or waits for something. If no fiber is ready, this waits
+ * for one of them to wake up or to get its input.
+ * The scheduler hands the fiber over, it is now up to the caller to switch to it with the value in its transfer field.
+ * @param vm
+ * @return the fiber, or NULL if the scheduler has no fiber left at all.
+ */
+ObjFiber* nextFiber(VM* vm) {
+    Scheduler* scheduler = vm->scheduler;
+    if (scheduler == NULL) return NULL;
+    for (;;) {
+        // The fibers waiting for input get a look in at every switch, so that busy fibers don't starve them.
+        if (scheduler->readerCount > 0 && waitForInput(scheduler, true, 0)) handOutInput(vm, scheduler);
+        double now = schedulerClock();
+        while (scheduler->sleeperCount > 0 && scheduler->sleepers[0]->wakeTime <= now) {
+            scheduleFiber(vm, takeSleeper(scheduler), NIL_VAL);
+        }
+
+        if (scheduler->readyCount > 0) {
+            ObjFiber* fiber = scheduler->ready[scheduler->readyStart];
+            scheduler->readyStart = (scheduler->readyStart + 1) % scheduler->readyCapacity;
+            scheduler->readyCount--;
+            return fiber;
+        }
+        if (scheduler->sleeperCount == 0 && scheduler->readerCount == 0) return NULL;
+
+        int timeout = -1;
+        if (scheduler->sleeperCount > 0) {
+            double wait = scheduler->sleepers[0]->wakeTime - now;
+            // Rounded up, so that the fiber doesn't wake up a little early only to wait once more.
+            timeout = wait * 1000 >= WAIT_MAX_MSEC ? WAIT_MAX_MSEC : (int) (wait * 1000) + 1;
+        }
+        if (waitForInput(scheduler, scheduler->readerCount > 0, timeout)) handOutInput(vm, scheduler);
+    }
+}
+
+/**
+ * Closes the open upvalues of a fiber that isn't running, whose stack is about to go.
+ * @param vm
+ * @param fiber
+ */
+static void closeFiberUpvalues(VM* vm, ObjFiber* fiber) {
+    for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        upvalue->fiber = NULL;
+        writeBarrier(vm, (Obj*) upvalue, upvalue->closed);
+    }
+    fiber->openUpvalues = NULL;
+}
+
+/**
+ * Stops a fiber that a runtime error leaves behind.
+ * @param vm
+ * @param fiber
+ */
+static void stopFiber(VM* vm, ObjFiber* fiber) {
+    closeFiberUpvalues(vm, fiber);
+    fiber->caller = NULL;
+    fiber->transfer = NIL_VAL;
+    if (fiber != vm->mainFiber) fiber->state = FIBER_DONE;
+}
+
+/**
+ * Stops every fiber after a runtime error: the one that failed, the ones that wait for it to yield, and the ones the
+ * scheduler has. The VM goes back to the main fiber, whose stack the error resets. The open upvalues of the running
+ * fiber have to be closed already.
+ * @param vm
+ */
+void abortFibers(VM* vm) {
+    ObjFiber* fiber = vm->fiber;
+    while (fiber != NULL) {
+        ObjFiber* caller = fiber->caller;
+        stopFiber(vm, fiber);
+        fiber = caller;
+    }
+
+    Scheduler* scheduler = vm->scheduler;
+    if (scheduler != NULL) {
+        for (int i = 0; i < scheduler->readyCount; i++) {
+            stopFiber(vm, scheduler->ready[(scheduler->readyStart + i) % scheduler->readyCapacity]);
+        }
+        for (int i = 0; i < scheduler->sleeperCount; i++) stopFiber(vm, scheduler->sleepers[i]);
+        for (int i = 0; i < scheduler->readerCount; i++) stopFiber(vm, scheduler->readers[i]);
+        scheduler->readyStart = 0;
+        scheduler->readyCount = 0;
+        scheduler->sleeperCount = 0;
+        scheduler->readerCount = 0;
+    }
+
+    if (vm->fiber != vm->mainFiber) switchFiber(vm, vm->mainFiber);
+    vm->mainFiber->state = FIBER_RUNNING;
+}
+
+/**
+ * Marks the fibers the scheduler has, which nothing else may reference.
+ * @param vm
+ */
+void markScheduler(VM* vm) {
+    Scheduler* scheduler = vm->scheduler;
+    if (scheduler == NULL) return;
+    for (int i = 0; i < scheduler->readyCount; i++) {
+        markObject(vm, (Obj*) scheduler->ready[(scheduler->readyStart + i) % scheduler->readyCapacity]);
+    }
+    for (int i = 0; i < scheduler->sleeperCount; i++) markObject(vm, (Obj*) scheduler->sleepers[i]);
+    for (int i = 0; i < scheduler->readerCount; i++) markObject(vm, (Obj*) scheduler->readers[i]);
+}
+
+/**
+ * Frees the scheduler of a VM, if it has one.
+ * @param vm
+ */
+void freeScheduler(VM* vm) {
+    Scheduler* scheduler = vm->scheduler;
+    if (scheduler == NULL) return;
+#ifdef __linux__
+    if (scheduler->epoll >= 0) close(scheduler->epoll);
+#endif
+    free(scheduler->ready);
+    free(scheduler->sleepers);
+    free(scheduler->readers);
+    free(scheduler->input);
+    free(scheduler);
+    vm->scheduler = NULL;
+}
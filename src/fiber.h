@@ -0,0 +1,29 @@
+//
+// Fibers, and the scheduler that runs the ones that wait for timers and input while the others carry on.
+//
+
+#ifndef CTOK_FIBER_H
+#define CTOK_FIBER_H
+
+#include "common.h"
+#include "object.h"
+
+typedef struct Scheduler Scheduler;
+
+void switchFiber(VM* vm, ObjFiber* fiber);
+
+void scheduleFiber(VM* vm, ObjFiber* fiber, Value value);
+
+void sleepFiber(VM* vm, double seconds);
+
+bool readLineNow(VM* vm, Value* line);
+
+ObjFiber* nextFiber(VM* vm);
+
+void abortFibers(VM* vm);
+
+void markScheduler(VM* vm);
+
+void freeScheduler(VM* vm);
+
+#endif //CTOK_FIBER_H
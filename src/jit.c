@@ -0,0 +1,810 @@
+//
+// Baseline JIT for x86-64, System V calling convention.
+//
+// Every bytecode instruction is translated on its own, by pasting in a fixed template of machine code. The templates
+// work on the same value stack and locals as the interpreter, with a few registers holding the interpreter's state:
+//   rbx  slots of the frame
+//   r12  top of the value stack
+//   r13  the JitFrame run() passed in
+//   r14  the QNAN bits, for the type guards
+// Calls from one compiled function to another, and the returns back, push and pop the CallFrames right in the machine
+// code, so recursive code doesn't have to go through the interpreter for every call. Instructions without a template,
+// and templates whose operands aren't of the type they handle, leave to the interpreter through an exit that stores
+// the stack top and the bytecode instruction to resume at in the JitFrame.
+//
+
+#include "jit.h"
+
+#ifdef JIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "chunk.h"
+#include "vm.h"
+
+/// x86-64 registers, by their number in the instruction encoding.
+enum {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R8 = 8, R9 = 9, R10 = 10, R12 = 12, R13 = 13, R14 = 14
+};
+
+/// Condition codes, as in the low nibble of the jcc and setcc opcodes.
+enum {
+    CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_NP = 0xb, CC_GE = 0xd, CC_LE = 0xe
+};
+
+/**
+ * A jump whose 32 bit displacement gets filled in once the machine code of its target is known.
+ */
+typedef struct {
+    // offset of the displacement in the code.
+    int patch;
+    // bytecode offset of the instruction it jumps to, or exits to for a guard.
+    int target;
+} Fixup;
+
+/**
+ * State of the compilation of a function.
+ */
+typedef struct {
+    Chunk* chunk;
+    uint8_t* code;
+    int count;
+    int capacity;
+    // Offset of the machine code of each bytecode instruction.
+    uint32_t* natives;
+    // Jumps to bytecode instructions.
+    Fixup* jumps;
+    int jumpCount;
+    int jumpCapacity;
+    // Jumps of failed guards, to an exit that resumes the interpreter at the instruction.
+    Fixup* exits;
+    int exitCount;
+    int exitCapacity;
+    // Offset of the code that leaves the machine code.
+    int exit;
+    bool failed;
+} Jit;
+
+static void emitByte(Jit* jit, uint8_t byte) {
+    if (jit->failed) return;
+    if (jit->count == jit->capacity) {
+        int capacity = jit->capacity < 256 ? 256 : jit->capacity * 2;
+        uint8_t* code = (uint8_t*) realloc(jit->code, capacity);
+        if (code == NULL) {
+            jit->failed = true;
+            return;
+        }
+        jit->code = code;
+        jit->capacity = capacity;
+    }
+    jit->code[jit->count++] = byte;
+}
+
+static void emitBytes(Jit* jit, const uint8_t* bytes, int count) {
+    for (int i = 0; i < count; i++) emitByte(jit, bytes[i]);
+}
+
+static void emit32(Jit* jit, uint32_t value) {
+    for (int i = 0; i < 4; i++) emitByte(jit, (uint8_t) (value >> (8 * i)));
+}
+
+static void patch32(Jit* jit, int offset, uint32_t value) {
+    if (jit->failed) return;
+    for (int i = 0; i < 4; i++) jit->code[offset + i] = (uint8_t) (value >> (8 * i));
+}
+
+/**
+ * Records a jump to a bytecode instruction, or to the exit of one.
+ */
+static void addFixup(Jit* jit, Fixup** fixups, int* count, int* capacity, int target) {
+    if (jit->failed) return;
+    if (*count == *capacity) {
+        int grownCapacity = *capacity < 16 ? 16 : *capacity * 2;
+        Fixup* grown = (Fixup*) realloc(*fixups, sizeof(Fixup) * grownCapacity);
+        if (grown == NULL) {
+            jit->failed = true;
+            return;
+        }
+        *fixups = grown;
+        *capacity = grownCapacity;
+    }
+    (*fixups)[(*count)++] = (Fixup) {jit->count - 4, target};
+}
+
+/**
+ * Emits a REX prefix with the W bit set, for an instruction on 64 bit operands.
+ */
+static void emitRex(Jit* jit, int reg, int rm) {
+    emitByte(jit, (uint8_t) (0x48 | ((reg >> 3) << 2) | (rm >> 3)));
+}
+
+/**
+ * Emits an instruction with a memory operand [base + disp]: the REX prefix if one is needed, the opcode, and the ModRM
+ * byte along with the SIB byte and displacement that go with it.
+ * @param jit
+ * @param wide whether the instruction works on 64 bit operands rather than 32 bit ones.
+ * @param opcode
+ * @param reg register operand, or the opcode extension of instructions that have one.
+ * @param base
+ * @param disp
+ */
+static void emitMemoryOp(Jit* jit, bool wide, uint8_t opcode, int reg, int base, int32_t disp) {
+    if (wide || reg >= 8 || base >= 8) {
+        emitByte(jit, (uint8_t) (0x40 | (wide ? 0x08 : 0) | ((reg >> 3) << 2) | (base >> 3)));
+    }
+    emitByte(jit, opcode);
+    emitByte(jit, (uint8_t) (0x80 | ((reg & 7) << 3) | (base & 7)));
+    // rsp and r12 can only be used as a base through a SIB byte.
+    if ((base & 7) == RSP) emitByte(jit, 0x24);
+    emit32(jit, (uint32_t) disp);
+}
+
+/// mov reg, [base + disp]
+static void emitLoad(Jit* jit, int reg, int base, int32_t disp) {
+    emitMemoryOp(jit, true, 0x8b, reg, base, disp);
+}
+
+/// mov [base + disp], reg
+static void emitStore(Jit* jit, int base, int32_t disp, int reg) {
+    emitMemoryOp(jit, true, 0x89, reg, base, disp);
+}
+
+/// lea reg, [base + disp]
+static void emitLea(Jit* jit, int reg, int base, int32_t disp) {
+    emitMemoryOp(jit, true, 0x8d, reg, base, disp);
+}
+
+/// mov reg32, dword [base + disp], which zero extends into the whole register.
+static void emitLoadInt(Jit* jit, int reg, int base, int32_t disp) {
+    emitMemoryOp(jit, false, 0x8b, reg, base, disp);
+}
+
+/// cmp reg32, dword [base + disp]
+static void emitCompareInt(Jit* jit, int reg, int base, int32_t disp) {
+    emitMemoryOp(jit, false, 0x3b, reg, base, disp);
+}
+
+/// cmp dword [base + disp], imm32
+static void emitCompareIntImmediate(Jit* jit, int base, int32_t disp, int32_t value) {
+    emitMemoryOp(jit, false, 0x81, 7, base, disp);
+    emit32(jit, (uint32_t) value);
+}
+
+/// add reg, [base + disp]
+static void emitAddMemory(Jit* jit, int reg, int base, int32_t disp) {
+    emitMemoryOp(jit, true, 0x03, reg, base, disp);
+}
+
+/// sub reg, [base + disp]
+static void emitSubMemory(Jit* jit, int reg, int base, int32_t disp) {
+    emitMemoryOp(jit, true, 0x2b, reg, base, disp);
+}
+
+/// add dword [base + disp], imm8
+static void emitAddIntImmediate(Jit* jit, int base, int32_t disp, int8_t value) {
+    emitMemoryOp(jit, false, 0x83, 0, base, disp);
+    emitByte(jit, (uint8_t) value);
+}
+
+/// Register to register instruction on 64 bit operands: op dst, src, where op is one of the r/m, reg forms.
+static void emitRegisters(Jit* jit, uint8_t opcode, int dst, int src) {
+    emitRex(jit, src, dst);
+    emitByte(jit, opcode);
+    emitByte(jit, (uint8_t) (0xc0 | ((src & 7) << 3) | (dst & 7)));
+}
+
+#define MOV 0x89
+#define AND 0x21
+#define CMP 0x39
+#define ADD 0x01
+#define SUB 0x29
+#define XOR 0x31
+#define TEST 0x85
+
+/// shl reg, imm8
+static void emitShiftLeft(Jit* jit, int reg, uint8_t bits) {
+    emitRex(jit, 0, reg);
+    emitByte(jit, 0xc1);
+    emitByte(jit, (uint8_t) (0xe0 | (reg & 7)));
+    emitByte(jit, bits);
+}
+
+/// imul dst, src, imm32
+static void emitMultiplyImmediate(Jit* jit, int dst, int src, int32_t value) {
+    emitRex(jit, dst, src);
+    emitByte(jit, 0x69);
+    emitByte(jit, (uint8_t) (0xc0 | ((dst & 7) << 3) | (src & 7)));
+    emit32(jit, (uint32_t) value);
+}
+
+/// jmp reg
+static void emitJumpRegister(Jit* jit, int reg) {
+    if (reg >= 8) emitByte(jit, 0x41);
+    emitByte(jit, 0xff);
+    emitByte(jit, (uint8_t) (0xe0 | (reg & 7)));
+}
+
+/// mov reg, imm64
+static void emitImmediate(Jit* jit, int reg, uint64_t value) {
+    emitRex(jit, 0, reg);
+    emitByte(jit, (uint8_t) (0xb8 | (reg & 7)));
+    for (int i = 0; i < 8; i++) emitByte(jit, (uint8_t) (value >> (8 * i)));
+}
+
+/// add or sub reg, imm8 on the stack top register.
+static void emitMoveStack(Jit* jit, int slots) {
+    if (slots == 0) return;
+    emitRex(jit, 0, R12);
+    emitByte(jit, 0x83);
+    emitByte(jit, (uint8_t) (slots > 0 ? 0xc4 : 0xec));
+    emitByte(jit, (uint8_t) ((slots > 0 ? slots : -slots) * (int) sizeof(Value)));
+}
+
+/// Loads the value the given number of slots below the stack top.
+static void emitPeek(Jit* jit, int reg, int distance) {
+    emitLoad(jit, reg, R12, -(int32_t) sizeof(Value) * (distance + 1));
+}
+
+/// Pushes the value in the register.
+static void emitPush(Jit* jit, int reg) {
+    emitStore(jit, R12, 0, reg);
+    emitMoveStack(jit, 1);
+}
+
+/**
+ * Emits a conditional jump to the exit of the given instruction, for a guard.
+ */
+static void emitExitIf(Jit* jit, int condition, int offset) {
+    emitByte(jit, 0x0f);
+    emitByte(jit, (uint8_t) (0x80 | condition));
+    emit32(jit, 0);
+    addFixup(jit, &jit->exits, &jit->exitCount, &jit->exitCapacity, offset);
+}
+
+/**
+ * Emits a jump to a bytecode instruction, conditional unless condition is -1.
+ */
+static void emitJump(Jit* jit, int condition, int target) {
+    if (condition == -1) {
+        emitByte(jit, 0xe9);
+    } else {
+        emitByte(jit, 0x0f);
+        emitByte(jit, (uint8_t) (0x80 | condition));
+    }
+    emit32(jit, 0);
+    addFixup(jit, &jit->jumps, &jit->jumpCount, &jit->jumpCapacity, target);
+}
+
+/**
+ * Leaves for the interpreter, to resume at the given instruction.
+ */
+static void emitExit(Jit* jit, int offset) {
+    emitImmediate(jit, RAX, (uint64_t) (uintptr_t) (jit->chunk->code + offset));
+    emitByte(jit, 0xe9);
+    emit32(jit, (uint32_t) (jit->exit - (jit->count + 4)));
+}
+
+/**
+ * Exits unless the value in the register is a number. rdx gets clobbered.
+ */
+static void emitGuardNumber(Jit* jit, int reg, int offset) {
+    emitRegisters(jit, MOV, RDX, reg);
+    emitRegisters(jit, AND, RDX, R14);
+    emitRegisters(jit, CMP, RDX, R14);
+    emitExitIf(jit, CC_E, offset);
+}
+
+/// movq xmm, reg
+static void emitToDouble(Jit* jit, int xmm, int reg) {
+    emitByte(jit, 0x66);
+    emitRex(jit, xmm, reg);
+    emitByte(jit, 0x0f);
+    emitByte(jit, 0x6e);
+    emitByte(jit, (uint8_t) (0xc0 | (xmm << 3) | (reg & 7)));
+}
+
+/// movq reg, xmm
+static void emitFromDouble(Jit* jit, int reg, int xmm) {
+    emitByte(jit, 0x66);
+    emitRex(jit, xmm, reg);
+    emitByte(jit, 0x0f);
+    emitByte(jit, 0x7e);
+    emitByte(jit, (uint8_t) (0xc0 | (xmm << 3) | (reg & 7)));
+}
+
+/// Scalar double instruction on xmm0 and xmm1: addsd, subsd, mulsd, divsd.
+static void emitDoubleOp(Jit* jit, uint8_t opcode) {
+    uint8_t bytes[] = {0xf2, 0x0f, opcode, 0xc1};
+    emitBytes(jit, bytes, 4);
+}
+
+/// ucomisd xmm<a>, xmm<b>
+static void emitCompareDoubles(Jit* jit, int a, int b) {
+    uint8_t bytes[] = {0x66, 0x0f, 0x2e, (uint8_t) (0xc0 | (a << 3) | b)};
+    emitBytes(jit, bytes, 4);
+}
+
+/// setcc on the low byte of reg, which has to be one of rax to rbx.
+static void emitSet(Jit* jit, int condition, int reg) {
+    uint8_t bytes[] = {0x0f, (uint8_t) (0x90 | condition), (uint8_t) (0xc0 | reg)};
+    emitBytes(jit, bytes, 3);
+}
+
+/**
+ * Turns the 0 or 1 in al into a Tok boolean in rax. rcx ends up holding FALSE_VAL.
+ */
+static void emitBoolean(Jit* jit) {
+    uint8_t movzx[] = {0x0f, 0xb6, 0xc0};
+    emitBytes(jit, movzx, 3);
+    emitImmediate(jit, RCX, FALSE_VAL);
+    // TRUE_VAL is FALSE_VAL + 1.
+    emitRegisters(jit, ADD, RAX, RCX);
+}
+
+/**
+ * Loads the two numbers on top of the stack into xmm0 and xmm1, leaving for the interpreter if they aren't numbers.
+ */
+static void emitNumberOperands(Jit* jit, int offset) {
+    emitPeek(jit, RAX, 1);
+    emitPeek(jit, RCX, 0);
+    emitGuardNumber(jit, RAX, offset);
+    emitGuardNumber(jit, RCX, offset);
+    emitToDouble(jit, 0, RAX);
+    emitToDouble(jit, 1, RCX);
+}
+
+/**
+ * Replaces the two operands on top of the stack with the result in rax.
+ */
+static void emitBinaryResult(Jit* jit) {
+    emitStore(jit, R12, -2 * (int32_t) sizeof(Value), RAX);
+    emitMoveStack(jit, -1);
+}
+
+/**
+ * Loads a number local into xmm0 and a number constant into xmm1, for the superinstructions that fuse them.
+ */
+static void emitLocalConstant(Jit* jit, int offset) {
+    uint8_t* code = jit->chunk->code;
+    emitLoad(jit, RAX, RBX, code[offset + 1] * (int32_t) sizeof(Value));
+    emitGuardNumber(jit, RAX, offset);
+    emitToDouble(jit, 0, RAX);
+    emitImmediate(jit, RCX, jit->chunk->constants.values[code[offset + 2]]);
+    emitToDouble(jit, 1, RCX);
+}
+
+/**
+ * Emits a conditional jump forward to somewhere within the same template, which patchHere() points at its target.
+ * @return offset of the displacement.
+ */
+static int emitForwardJump(Jit* jit, int condition) {
+    emitByte(jit, 0x0f);
+    emitByte(jit, (uint8_t) (0x80 | condition));
+    emit32(jit, 0);
+    return jit->count - 4;
+}
+
+static void patchHere(Jit* jit, int patch) {
+    patch32(jit, patch, (uint32_t) (jit->count - (patch + 4)));
+}
+
+/**
+ * Loads the entry of the machine code for the instruction at ip into rsi and the machine code into rdx, if the function in
+ * rax has some for it, and exits otherwise. The offset of the instruction has to be in rcx. rcx gets clobbered.
+ */
+static void emitEntry(Jit* jit, int offset) {
+    emitLoad(jit, RDX, RAX, (int32_t) offsetof(ObjFunction, jit));
+    emitRegisters(jit, TEST, RDX, RDX);
+    emitExitIf(jit, CC_E, offset);
+    emitShiftLeft(jit, RCX, 2);
+    emitLoad(jit, RSI, RDX, (int32_t) offsetof(JitCode, entries));
+    emitRegisters(jit, ADD, RSI, RCX);
+    emitLoadInt(jit, RSI, RSI, 0);
+    emitRegisters(jit, TEST, RSI, RSI);
+    emitExitIf(jit, CC_E, offset);
+}
+
+/**
+ * Jumps to the entry in rsi of the machine code in rdx.
+ */
+static void emitJumpToEntry(Jit* jit) {
+    emitLoad(jit, RDX, RDX, (int32_t) offsetof(JitCode, memory));
+    emitRegisters(jit, ADD, RDX, RSI);
+    emitJumpRegister(jit, RDX);
+}
+
+/**
+ * Template of OP_CALL. A call of a closure with the right number of arguments, whose function already has machine code,
+ * pushes the new CallFrame and jumps straight into the machine code. Every other call, and every call that would need
+ * the frames or the stack to grow, is made by the interpreter.
+ */
+static void emitCall(Jit* jit, VM* vm, int offset) {
+    int argCount = jit->chunk->code[offset + 1];
+    int32_t base = -(int32_t) sizeof(Value) * (argCount + 1);
+
+    // The callee has to be a closure.
+    emitLoad(jit, RAX, R12, base);
+    emitImmediate(jit, RCX, QNAN | SIGN_BIT);
+    emitRegisters(jit, MOV, RDX, RAX);
+    emitRegisters(jit, AND, RDX, RCX);
+    emitRegisters(jit, CMP, RDX, RCX);
+    emitExitIf(jit, CC_NE, offset);
+    emitRegisters(jit, XOR, RAX, RCX);
+    emitCompareIntImmediate(jit, RAX, (int32_t) offsetof(Obj, type), OBJ_CLOSURE);
+    emitExitIf(jit, CC_NE, offset);
+    emitLoad(jit, R8, RAX, (int32_t) offsetof(ObjClosure, function));
+    emitCompareIntImmediate(jit, R8, (int32_t) offsetof(ObjFunction, arity), argCount);
+    emitExitIf(jit, CC_NE, offset);
+    // with machine code for its first instruction.
+    emitRegisters(jit, MOV, R9, RAX);
+    emitRegisters(jit, MOV, RAX, R8);
+    emitRegisters(jit, XOR, RCX, RCX);
+    emitEntry(jit, offset);
+
+    // There has to be room for the frame, and for the stack slots call() would make sure of.
+    emitImmediate(jit, RDI, (uint64_t) (uintptr_t) vm);
+    emitLoadInt(jit, RCX, RDI, (int32_t) offsetof(VM, frameCount));
+    emitCompareInt(jit, RCX, RDI, (int32_t) offsetof(VM, frameCapacity));
+    emitExitIf(jit, CC_GE, offset);
+    emitCompareInt(jit, RCX, RDI, (int32_t) offsetof(VM, maxFrames));
+    emitExitIf(jit, CC_GE, offset);
+    emitLoadInt(jit, R10, RDI, (int32_t) offsetof(VM, stackCapacity));
+    emitShiftLeft(jit, R10, 3);
+    emitAddMemory(jit, R10, RDI, (int32_t) offsetof(VM, stack));
+    emitLoadInt(jit, RAX, R8, (int32_t) offsetof(ObjFunction, maxSlots));
+    emitShiftLeft(jit, RAX, 3);
+    emitRegisters(jit, ADD, RAX, R12);
+    emitLea(jit, RAX, RAX, base + (int32_t) sizeof(Value) * FRAME_STACK_SLOTS);
+    emitRegisters(jit, CMP, RAX, R10);
+    emitExitIf(jit, CC_A, offset);
+
+    // Push the frame. The caller's frame gets the instruction to return to, which the interpreter only stores in it
+    // when it makes a call itself.
+    emitLoad(jit, RAX, RDI, (int32_t) offsetof(VM, frames));
+    emitMultiplyImmediate(jit, R10, RCX, (int32_t) sizeof(CallFrame));
+    emitRegisters(jit, ADD, RAX, R10);
+    emitImmediate(jit, R10, (uint64_t) (uintptr_t) (jit->chunk->code + offset + 2));
+    emitStore(jit, RAX, (int32_t) (offsetof(CallFrame, ip) - sizeof(CallFrame)), R10);
+    emitStore(jit, RAX, (int32_t) offsetof(CallFrame, closure), R9);
+    emitLoad(jit, R10, R8, (int32_t) (offsetof(ObjFunction, chunk) + offsetof(Chunk, code)));
+    emitStore(jit, RAX, (int32_t) offsetof(CallFrame, ip), R10);
+    emitLea(jit, RBX, R12, base);
+    emitStore(jit, RAX, (int32_t) offsetof(CallFrame, slots), RBX);
+    emitAddIntImmediate(jit, RDI, (int32_t) offsetof(VM, frameCount), 1);
+    emitJumpToEntry(jit);
+}
+
+/**
+ * Template of OP_RETURN. When the caller has machine code for the instruction it returns to, the frame gets popped and
+ * the code carries on in the caller. The interpreter takes care of returns that have upvalues to close, of the return
+ * from the script, and of returns to callers that are interpreted.
+ */
+static void emitReturn(Jit* jit, VM* vm, int offset) {
+    emitImmediate(jit, RDI, (uint64_t) (uintptr_t) vm);
+    // No open upvalue may point into the frame.
+    emitLoad(jit, RAX, RDI, (int32_t) offsetof(VM, openUpvalues));
+    emitRegisters(jit, TEST, RAX, RAX);
+    int noUpvalues = emitForwardJump(jit, CC_E);
+    emitLoad(jit, RAX, RAX, (int32_t) offsetof(ObjUpvalue, location));
+    emitRegisters(jit, CMP, RAX, RBX);
+    emitExitIf(jit, CC_AE, offset);
+    patchHere(jit, noUpvalues);
+
+    // There has to be a caller, with machine code to return to.
+    emitLoadInt(jit, R8, RDI, (int32_t) offsetof(VM, frameCount));
+    uint8_t compareOne[] = {0x49, 0x83, 0xf8, 0x01}; // cmp r8, 1
+    emitBytes(jit, compareOne, sizeof(compareOne));
+    emitExitIf(jit, CC_LE, offset);
+    emitLoad(jit, R9, RDI, (int32_t) offsetof(VM, frames));
+    emitMultiplyImmediate(jit, R10, R8, (int32_t) sizeof(CallFrame));
+    emitRegisters(jit, ADD, R9, R10);
+    // r9 points just past the frame that returns, the caller's frame is the one before.
+    int32_t caller = -2 * (int32_t) sizeof(CallFrame);
+    emitLoad(jit, RAX, R9, caller + (int32_t) offsetof(CallFrame, closure));
+    emitLoad(jit, RAX, RAX, (int32_t) offsetof(ObjClosure, function));
+    emitLoad(jit, RCX, R9, caller + (int32_t) offsetof(CallFrame, ip));
+    emitSubMemory(jit, RCX, RAX, (int32_t) (offsetof(ObjFunction, chunk) + offsetof(Chunk, code)));
+    emitEntry(jit, offset);
+
+    // Pop the frame, and replace its stack window with the result.
+    emitPeek(jit, RAX, 0);
+    emitAddIntImmediate(jit, RDI, (int32_t) offsetof(VM, frameCount), -1);
+    emitStore(jit, RBX, 0, RAX);
+    emitLea(jit, R12, RBX, (int32_t) sizeof(Value));
+    emitLoad(jit, RBX, R9, caller + (int32_t) offsetof(CallFrame, slots));
+    emitJumpToEntry(jit);
+}
+
+/**
+ * Emits the template of an instruction.
+ * @param jit
+ * @param vm VM the function runs in, whose globals the code accesses.
+ * @param offset offset of the instruction.
+ * @return true if the instruction has a template, false if the interpreter runs it.
+ */
+static bool emitInstruction(Jit* jit, VM* vm, int offset) {
+    uint8_t* code = jit->chunk->code;
+    Value* constants = jit->chunk->constants.values;
+    int length = instructionLength(jit->chunk, offset);
+    int jumpOffset = length >= 3 ? (code[offset + length - 2] << 8) | code[offset + length - 1] : 0;
+
+    switch (code[offset]) {
+        case OP_CONSTANT:
+            emitImmediate(jit, RAX, constants[code[offset + 1]]);
+            emitPush(jit, RAX);
+            return true;
+        case OP_NIL:
+            emitImmediate(jit, RAX, NIL_VAL);
+            emitPush(jit, RAX);
+            return true;
+        case OP_TRUE:
+            emitImmediate(jit, RAX, TRUE_VAL);
+            emitPush(jit, RAX);
+            return true;
+        case OP_FALSE:
+            emitImmediate(jit, RAX, FALSE_VAL);
+            emitPush(jit, RAX);
+            return true;
+        case OP_POP:
+            emitMoveStack(jit, -1);
+            return true;
+        case OP_GET_LOCAL:
+            emitLoad(jit, RAX, RBX, code[offset + 1] * (int32_t) sizeof(Value));
+            emitPush(jit, RAX);
+            return true;
+        case OP_SET_LOCAL:
+            emitPeek(jit, RAX, 0);
+            emitStore(jit, RBX, code[offset + 1] * (int32_t) sizeof(Value), RAX);
+            return true;
+        case OP_SET_LOCAL_POP:
+            emitPeek(jit, RAX, 0);
+            emitStore(jit, RBX, code[offset + 1] * (int32_t) sizeof(Value), RAX);
+            emitMoveStack(jit, -1);
+            return true;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL: {
+            // The array of global values moves when it grows, so its address is loaded from the VM every time.
+            int32_t slot = ((code[offset + 1] << 8) | code[offset + 2]) * (int32_t) sizeof(Value);
+            emitImmediate(jit, RCX, (uint64_t) (uintptr_t) &vm->globalValues.values);
+            emitLoad(jit, RCX, RCX, 0);
+            emitLoad(jit, RAX, RCX, slot);
+            // An undefined variable is an error, which the interpreter reports. UNDEFINED_VAL is the QNAN bits alone.
+            emitRegisters(jit, CMP, RAX, R14);
+            emitExitIf(jit, CC_E, offset);
+            if (code[offset] == OP_GET_GLOBAL) {
+                emitPush(jit, RAX);
+            } else {
+                emitPeek(jit, RAX, 0);
+                emitStore(jit, RCX, slot, RAX);
+            }
+            return true;
+        }
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            // Concatenation, like every type error, is left to the interpreter.
+            static const uint8_t opcodes[] = {
+                    [OP_ADD] = 0x58, [OP_ADD_NUMBER] = 0x58, [OP_SUBTRACT] = 0x5c, [OP_MULTIPLY] = 0x59,
+                    [OP_DIVIDE] = 0x5e
+            };
+            emitNumberOperands(jit, offset);
+            emitDoubleOp(jit, opcodes[code[offset]]);
+            emitFromDouble(jit, RAX, 0);
+            emitBinaryResult(jit);
+            return true;
+        }
+        case OP_LESS:
+        case OP_GREATER:
+            emitNumberOperands(jit, offset);
+            // a < b is b > a. Comparisons with NaN are unordered, and "above" is false for those.
+            if (code[offset] == OP_LESS) {
+                emitCompareDoubles(jit, 1, 0);
+            } else {
+                emitCompareDoubles(jit, 0, 1);
+            }
+            emitSet(jit, CC_A, RAX);
+            emitBoolean(jit);
+            emitBinaryResult(jit);
+            return true;
+        case OP_EQUAL:
+            // Only numbers are compared here, everything else, ropes and bound methods included, by the interpreter.
+            emitNumberOperands(jit, offset);
+            emitCompareDoubles(jit, 0, 1);
+            emitSet(jit, CC_E, RAX);
+            emitSet(jit, CC_NP, RCX);
+            {
+                uint8_t andAlCl[] = {0x20, 0xc8};
+                emitBytes(jit, andAlCl, 2);
+            }
+            emitBoolean(jit);
+            emitBinaryResult(jit);
+            return true;
+        case OP_NOT: {
+            emitPeek(jit, RAX, 0);
+            emitImmediate(jit, RCX, NIL_VAL);
+            emitRegisters(jit, CMP, RAX, RCX);
+            emitSet(jit, CC_E, RCX);
+            emitImmediate(jit, RDX, FALSE_VAL);
+            emitRegisters(jit, CMP, RAX, RDX);
+            emitSet(jit, CC_E, RAX);
+            uint8_t orAlCl[] = {0x08, 0xc8};
+            emitBytes(jit, orAlCl, 2);
+            emitBoolean(jit);
+            emitStore(jit, R12, -(int32_t) sizeof(Value), RAX);
+            return true;
+        }
+        case OP_NEGATE: {
+            emitPeek(jit, RAX, 0);
+            emitGuardNumber(jit, RAX, offset);
+            // Negating a double flips its sign bit: btc rax, 63.
+            uint8_t btc[] = {0x48, 0x0f, 0xba, 0xf8, 0x3f};
+            emitBytes(jit, btc, 5);
+            emitStore(jit, R12, -(int32_t) sizeof(Value), RAX);
+            return true;
+        }
+        case OP_JUMP:
+            emitJump(jit, -1, offset + length + jumpOffset);
+            return true;
+        case OP_LOOP:
+            emitJump(jit, -1, offset + length - jumpOffset);
+            return true;
+        case OP_JUMP_IF_FALSE: {
+            // The condition stays on the stack, like in the interpreter.
+            int target = offset + length + jumpOffset;
+            emitPeek(jit, RAX, 0);
+            emitImmediate(jit, RCX, NIL_VAL);
+            emitRegisters(jit, CMP, RAX, RCX);
+            emitJump(jit, CC_E, target);
+            emitImmediate(jit, RCX, FALSE_VAL);
+            emitRegisters(jit, CMP, RAX, RCX);
+            emitJump(jit, CC_E, target);
+            return true;
+        }
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            emitLocalConstant(jit, offset);
+            emitDoubleOp(jit, code[offset] == OP_ADD_LOCAL_CONSTANT ? 0x58 : 0x5c);
+            emitFromDouble(jit, RAX, 0);
+            emitPush(jit, RAX);
+            return true;
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            emitLocalConstant(jit, offset);
+            emitCompareDoubles(jit, 1, 0);
+            emitSet(jit, CC_A, RAX);
+            emitBoolean(jit);
+            emitPush(jit, RAX);
+            emitRegisters(jit, CMP, RAX, RCX);
+            emitJump(jit, CC_E, offset + length + jumpOffset);
+            return true;
+        case OP_CALL:
+            emitCall(jit, vm, offset);
+            return true;
+        case OP_RETURN:
+            emitReturn(jit, vm, offset);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Emits the trampoline run() calls the code through, and the exit that returns to run().
+ */
+static void emitTrampoline(Jit* jit) {
+    // push rbx, r12, r13, r14, which the calling convention has us preserve.
+    uint8_t prologue[] = {0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56};
+    emitBytes(jit, prologue, sizeof(prologue));
+    emitRegisters(jit, MOV, R13, RDI);
+    emitLoad(jit, RBX, R13, (int32_t) offsetof(JitFrame, slots));
+    emitLoad(jit, R12, R13, (int32_t) offsetof(JitFrame, stackTop));
+    emitImmediate(jit, R14, QNAN);
+    // jmp rsi, to the instruction to start at.
+    uint8_t jump[] = {0xff, 0xe6};
+    emitBytes(jit, jump, sizeof(jump));
+
+    // The exits jump here with the instruction to resume at in rax.
+    jit->exit = jit->count;
+    emitStore(jit, R13, (int32_t) offsetof(JitFrame, stackTop), R12);
+    emitStore(jit, R13, (int32_t) offsetof(JitFrame, ip), RAX);
+    uint8_t epilogue[] = {0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3};
+    emitBytes(jit, epilogue, sizeof(epilogue));
+}
+
+/**
+ * Compiles a function to machine code. If that doesn't work out, the function just stays interpreted.
+ * @param vm
+ * @param function
+ * @return true if the function has machine code now.
+ */
+bool jitCompile(VM* vm, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    Jit jit = {0};
+    jit.chunk = chunk;
+    jit.natives = (uint32_t*) calloc((size_t) chunk->count + 1, sizeof(uint32_t));
+    uint32_t* entries = (uint32_t*) calloc((size_t) chunk->count + 1, sizeof(uint32_t));
+    if (jit.natives == NULL || entries == NULL) jit.failed = true;
+
+    if (!jit.failed) {
+        emitTrampoline(&jit);
+        for (int offset = 0; offset < chunk->count && !jit.failed; offset += instructionLength(chunk, offset)) {
+            jit.natives[offset] = (uint32_t) jit.count;
+            if (emitInstruction(&jit, vm, offset)) {
+                entries[offset] = jit.natives[offset];
+            } else {
+                // The code drops into the interpreter for this one, but doesn't get back in until the interpreter
+                // gets to a call, a return or a loop.
+                emitExit(&jit, offset);
+            }
+        }
+        // Every function ends in OP_RETURN, so nothing falls off the end, but a jump past the last instruction still
+        // lands on an exit.
+        jit.natives[chunk->count] = (uint32_t) jit.count;
+        emitExit(&jit, chunk->count);
+
+        for (int i = 0; i < jit.jumpCount; i++) {
+            Fixup* jump = &jit.jumps[i];
+            // Malformed code could jump into the middle of an instruction, which has no machine code to jump to.
+            if (jump->target < 0 || jump->target > chunk->count || jit.natives[jump->target] == 0) {
+                jit.failed = true;
+                break;
+            }
+            patch32(&jit, jump->patch, jit.natives[jump->target] - (uint32_t) (jump->patch + 4));
+        }
+        // The guards exit through stubs out of the way of the templates.
+        for (int i = 0; i < jit.exitCount; i++) {
+            Fixup* exit = &jit.exits[i];
+            patch32(&jit, exit->patch, (uint32_t) (jit.count - (exit->patch + 4)));
+            emitExit(&jit, exit->target);
+        }
+    }
+
+    uint8_t* memory = MAP_FAILED;
+    if (!jit.failed) {
+        // The code is written while the memory is writable, and only made executable afterwards.
+        memory = mmap(NULL, (size_t) jit.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED) {
+            memcpy(memory, jit.code, (size_t) jit.count);
+            if (mprotect(memory, (size_t) jit.count, PROT_READ | PROT_EXEC) != 0) {
+                munmap(memory, (size_t) jit.count);
+                memory = MAP_FAILED;
+            }
+        }
+    }
+
+    JitCode* code = memory != MAP_FAILED ? (JitCode*) malloc(sizeof(JitCode)) : NULL;
+    if (code != NULL) {
+        code->memory = memory;
+        code->size = (size_t) jit.count;
+        code->entries = entries;
+        function->jit = code;
+    } else {
+        if (memory != MAP_FAILED) munmap(memory, (size_t) jit.count);
+        free(entries);
+    }
+    free(jit.code);
+    free(jit.natives);
+    free(jit.jumps);
+    free(jit.exits);
+    return code != NULL;
+}
+
+/**
+ * Frees the machine code of a function, if it has any.
+ * @param function
+ */
+void jitFree(ObjFunction* function) {
+    JitCode* code = function->jit;
+    if (code == NULL) return;
+    munmap(code->memory, code->size);
+    free(code->entries);
+    free(code);
+    function->jit = NULL;
+}
+
+#endif
@@ -0,0 +1,66 @@
+//
+// Baseline JIT: compiles the bytecode of hot functions to x86-64 machine code, one template per instruction.
+//
+
+#ifndef CTOK_JIT_H
+#define CTOK_JIT_H
+
+#include "common.h"
+
+#ifdef JIT
+
+#include "object.h"
+
+/// Number of calls of a function, plus iterations of the loops in it, after which it gets compiled to machine code.
+#define JIT_THRESHOLD 1000
+
+/// Bytes of bytecode the machine code has to get through from an entry, when it leaves in the same frame, for the entry
+/// to be worth jumping in at again. Going in and out of the machine code costs more than interpreting a few instructions.
+#define JIT_MIN_PROGRESS 8
+
+/**
+ * The part of run()'s state the machine code works on. run() fills it in before jumping into the code, and the code
+ * updates it when it leaves, with the bytecode instruction the interpreter has to carry on with.
+ */
+typedef struct {
+    Value* slots;
+    Value* stackTop;
+    uint8_t* ip;
+} JitFrame;
+
+/**
+ * Machine code of a function.
+ * Only the instructions with a template of their own run as machine code. Every other instruction, and every template
+ * whose guard on the types of its operands fails, leaves the machine code and has the interpreter execute it, errors
+ * included. Nothing the machine code does allocates, so it never has to deal with the GC.
+ */
+typedef struct JitCode {
+    /// Executable memory holding the code.
+    uint8_t* memory;
+    /// Size of the memory, in bytes.
+    size_t size;
+    /// Offset into memory of the machine code of each bytecode instruction, by the offset of the instruction, or 0 for
+    /// the instructions the interpreter can't enter the machine code at, or no longer does since JIT_ENTER() found that
+    /// the code leaves again right away.
+    uint32_t* entries;
+} JitCode;
+
+bool jitCompile(VM* vm, ObjFunction* function);
+
+void jitFree(ObjFunction* function);
+
+/**
+ * Runs the machine code of a function from the given instruction on, until it gets to an instruction it leaves to the
+ * interpreter.
+ * @param jit machine code of the function.
+ * @param frame state of the frame running the function, updated to where the machine code left off.
+ * @param entry entry of the instruction to start at, which has to be nonzero.
+ */
+static inline void jitRun(JitCode* jit, JitFrame* frame, uint32_t entry) {
+    // The code starts with a trampoline that takes the frame and the address to start at.
+    ((void (*)(JitFrame*, uint8_t*)) (void*) jit->memory)(frame, jit->memory + entry);
+}
+
+#endif
+
+#endif //CTOK_JIT_H
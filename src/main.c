@@ -2,14 +2,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include "common.h"
+#include "bytecode.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "profiler.h"
 #include "vm.h"
 
 /**
  * Function to start up the REPL.
+ * @param vm
  */
-static void repl() {
+static void repl(VM* vm) {
     char line[1024];
     for (;;) {
         printf("> ");
@@ -18,7 +22,7 @@ static void repl() {
             printf("\n");
             break;
         }
-        interpret(line);
+        interpret(vm, line);
     }
 }
 
@@ -52,17 +56,80 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
+/**
+ * Function to check whether a path names a precompiled .tokc bytecode file rather than a script.
+ * @param path
+ * @return
+ */
+static bool isBytecodePath(const char* path) {
+    size_t length = strlen(path);
+    return length >= 5 && strcmp(path + length - 5, ".tokc") == 0;
+}
+
+/**
+ * Function to compile a script, going through its bytecode cache. The cache lives next to the script, with a 'c'
+ * appended to its name (script.tok is cached in script.tokc). It is used if it was compiled from the current version
+ * of the script, and (re)written otherwise.
+ * @param vm
+ * @param path path of the script.
+ * @param source source code of the script.
+ * @return the compiled top level function, or NULL if the script has a compile error.
+ */
+static ObjFunction* compileCached(VM* vm, const char* path, const char* source) {
+    size_t length = strlen(path);
+    char* cachePath = (char*) malloc(length + 2);
+    if (cachePath == NULL) {
+        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+        exit(74);
+    }
+    memcpy(cachePath, path, length);
+    cachePath[length] = 'c';
+    cachePath[length + 1] = '\0';
+
+    ObjFunction* function = loadBytecode(vm, cachePath, source);
+    if (function == NULL) {
+        function = compile(vm, source);
+        // A cache that can't be written just means the script gets compiled again next time.
+        if (function != NULL && !saveBytecode(vm, cachePath, function, source)) {
+            fprintf(stderr, "Could not write bytecode cache \"%s\".\n", cachePath);
+        }
+    }
+
+    free(cachePath);
+    return function;
+}
+
 /**
  * Function to run a file, given its path.
+ * A .tokc file is loaded as precompiled bytecode, whatever script it was compiled from.
+ * @param vm
  * @param path
+ * @param useCache whether to go through the script's bytecode cache instead of always compiling it.
+ * @return exit status of the program.
  */
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+static int runFile(VM* vm, const char* path, bool useCache) {
+    InterpretResult result;
+    if (isBytecodePath(path)) {
+        ObjFunction* function = loadBytecode(vm, path, NULL);
+        if (function == NULL) {
+            fprintf(stderr, "Could not load bytecode file \"%s\".\n", path);
+            exit(74);
+        }
+        result = interpretFunction(vm, function);
+    } else {
+        char* source = readFile(path);
+        if (useCache) {
+            ObjFunction* function = compileCached(vm, path, source);
+            result = function == NULL ? INTERPRET_COMPILE_ERROR : interpretFunction(vm, function);
+        } else {
+            result = interpret(vm, source);
+        }
+        free(source);
+    }
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
 }
 
 /**
@@ -72,17 +139,57 @@ static void runFile(const char* path) {
  * @return
  */
 int main(int argc, const char* argv[]) {
-    initVM();
+    bool useCache = false;
+    bool gcStats = false;
+    bool lazy = false;
+    const char* profilePath = NULL;
+    const char* path = NULL;
 
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cache") == 0) {
+            useCache = true;
+        } else if (strcmp(argv[i], "--gc-stats") == 0) {
+            gcStats = true;
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            lazy = true;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profilePath = "ctok.folded";
+        } else if (strncmp(argv[i], "--profile=", 10) == 0 && argv[i][10] != '\0') {
+            profilePath = argv[i] + 10;
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "Usage: ctok [--cache] [--gc-stats] [--lazy] [--profile[=file]] [path]\n");
+            exit(64);
+        }
+    }
+
+    VM* vm = newVM();
+    // Function bodies get compiled the first time they're called. The bytecode cache needs all of them up front, so it
+    // wins over --lazy.
+    vm->lazyCompilation = lazy && !useCache;
+    // The samples are written out in the collapsed stack format, the default file being ctok.folded.
+    if (profilePath != NULL && !startProfiler(vm)) {
+        fprintf(stderr, "Could not start the profiler.\n");
+        exit(71);
+    }
+
+    int status = 0;
+    if (path == NULL) {
+        repl(vm);
     } else {
-        fprintf(stderr, "Usage: ctok [path]\n");
-        exit(64);
+        status = runFile(vm, path, useCache);
     }
 
-    freeVM();
-    return 0;
+    if (gcStats) printGCStats(vm, stderr);
+    if (profilePath != NULL) {
+        FILE* file = fopen(profilePath, "w");
+        if (file == NULL || !writeProfile(vm, file)) {
+            fprintf(stderr, "Could not write profile \"%s\".\n", profilePath);
+            if (status == 0) status = 74;
+        }
+        if (file != NULL) fclose(file);
+    }
+    freeVM(vm);
+    return status;
 }
@@ -2,9 +2,18 @@
 // Created by Jyotinder Singh on 01/06/21.
 //
 
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(_WIN32) && !defined(__linux__)
+#include <sys/resource.h>
+#endif
 
 #include "compiler.h"
+#include "fiber.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -17,26 +26,121 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
+static void collectYoungGarbage(VM* vm);
+
+static void beginMajorCollection(VM* vm);
+
+static void collectStep(VM* vm, int budget);
+
+static void finishCollection(VM* vm);
+
+static void pushGray(VM* vm, Obj* object);
+
+static void freeObject(VM* vm, Obj* object);
+
+/**
+ * Reads the clock the GC pauses are timed with.
+ * @return time in seconds, from an arbitrary starting point.
+ */
+static double gcClock() {
+#ifdef _WIN32
+    return (double) clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+#endif
+}
+
+/**
+ * Checks whether the heap grew past one of the thresholds that make runCollector() do some work.
+ * @param vm
+ * @return
+ */
+static inline bool collectionDue(VM* vm) {
+#ifdef DEBUG_STRESS_GC
+    return true;
+#else
+    return vm->bytesAllocated > vm->nextGC ||
+           ((vm->gcPhase == GC_IDLE || vm->gcPhase == GC_SWEEPING) && vm->bytesAllocated > vm->nextMinorGC) ||
+           (vm->gcPhase != GC_IDLE && vm->bytesAllocated > vm->nextGCStep);
+#endif
+}
+
+/**
+ * Runs whatever collection work the thresholds the heap grew past call for.
+ */
+static void runCollector(VM* vm) {
+#ifdef DEBUG_STRESS_GC
+    // Collecting on every allocation: minor collections catch missing write barriers, the major ones everything
+    // else, and running a step of a major collection between each allocation gives the program every chance to
+    // mess with a collection in progress.
+    if (vm->gcPhase != GC_IDLE) {
+        collectStep(vm, vm->gcStepBudget);
+    } else if (++vm->stressCollections % 8 != 0) {
+        collectYoungGarbage(vm);
+    } else if (vm->gcStepBudget > 0) {
+        beginMajorCollection(vm);
+    } else {
+        collectGarbage(vm);
+    }
+#endif
+    // when we cross the threshold of the whole heap, we start a major collection, which is finished in one go if it
+    // isn't incremental, or if it can't keep up anymore. Minor collections collect the young objects once enough of
+    // them piled up, but can't run while a major collection is marking.
+    if (vm->bytesAllocated > vm->nextGC) {
+        if (vm->gcPhase == GC_IDLE && vm->gcStepBudget > 0) {
+            beginMajorCollection(vm);
+        } else if (vm->gcPhase == GC_IDLE) {
+            collectGarbage(vm);
+        } else {
+            finishCollection(vm);
+        }
+    } else if ((vm->gcPhase == GC_IDLE || vm->gcPhase == GC_SWEEPING) && vm->bytesAllocated > vm->nextMinorGC) {
+        collectYoungGarbage(vm);
+    }
+    if (vm->gcPhase != GC_IDLE && vm->bytesAllocated > vm->nextGCStep) {
+        collectStep(vm, vm->gcStepBudget);
+    }
+}
+
+/**
+ * Accounts for a change in the size of an allocation, and runs the GC if the heap grew past its threshold.
+ * @param vm
+ * @param oldSize
+ * @param newSize
+ */
+static void countAllocation(VM* vm, size_t oldSize, size_t newSize) {
+    // Every time we free/allocate some memory, we adjust the counter by that delta.
+    vm->bytesAllocated += newSize - oldSize;
+    if (newSize <= oldSize) {
+        vm->gcStats.bytesFreed += oldSize - newSize;
+        return;
+    }
+
+    vm->gcStats.bytesAllocated += newSize - oldSize;
+    if (!collectionDue(vm)) return;
+
+    // The pause is timed as a whole, however many collections and steps it runs.
+    double start = gcClock();
+    runCollector(vm);
+    double pause = gcClock() - start;
+    vm->gcStats.pauses++;
+    vm->gcStats.totalPauseTime += pause;
+    if (pause > vm->gcStats.maxPauseTime) vm->gcStats.maxPauseTime = pause;
+}
+
 /**
  * reallocate is a single function we use for all the dynamic memory management in ctok -
  * allocating memory, freeing memory, and changing the size of the existing allocation.
+ * @param vm
  * @param pointer
  * @param oldSize
  * @param newSize
  * @return
  */
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-    // Every time we free/allocate some memory, we adjust the counter by that delta.
-    vm.bytesAllocated += newSize - oldSize;
-    if (newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
-        collectGarbage();
-#endif
-        // when we cross the threshold, we run the GC.
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
-        }
-    }
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
+    countAllocation(vm, oldSize, newSize);
     if (newSize == 0) {
         free(pointer);
         return NULL;
@@ -47,65 +151,406 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+/**
+ * Finds the lowest bit set in a word of a bitmap.
+ * @param bits must not be 0.
+ * @return index of the bit.
+ */
+static inline int lowestBit(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(bits);
+#else
+    int index = 0;
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+/**
+ * Allocates the memory of a page, aligned to POOL_PAGE_SIZE when the pools are enabled so PAGE_OF() can find it.
+ * @param size
+ * @return
+ */
+static HeapPage* allocatePage(size_t size) {
+    void* page = NULL;
+#if defined(OBJECT_POOLS) && defined(_WIN32)
+    page = _aligned_malloc(size, POOL_PAGE_SIZE);
+#elif defined(OBJECT_POOLS)
+    if (posix_memalign(&page, POOL_PAGE_SIZE, size) != 0) page = NULL;
+#else
+    page = malloc(size);
+#endif
+    if (page == NULL) exit(1);
+    return (HeapPage*) page;
+}
+
+/**
+ * Releases the memory of a page.
+ * @param page
+ */
+static void freePage(HeapPage* page) {
+#if defined(OBJECT_POOLS) && defined(_WIN32)
+    _aligned_free(page);
+#else
+    free(page);
+#endif
+}
+
+/**
+ * Sets up the header of a fresh page, with every cell free, and links it into a list of pages.
+ * @param page
+ * @param list list of pages to add the page to.
+ * @param header size of the header, the cells start right after it.
+ * @param cellSize
+ * @param cellCount
+ * @param bitmapWords
+ */
+static void initPage(HeapPage* page, HeapPage** list, size_t header, size_t cellSize, int cellCount, int bitmapWords) {
+    page->prev = NULL;
+    page->next = *list;
+    if (*list != NULL) (*list)->prev = page;
+    *list = page;
+    page->nextAvailable = NULL;
+    page->nextYoung = NULL;
+    page->cells = (uint8_t*) page + header;
+    page->cellSize = (uint32_t) cellSize;
+    page->cellReciprocal = cellCount > 1 ? (uint32_t) (((1ull << 32) + cellSize - 1) / cellSize) : 0;
+    page->cellCount = cellCount;
+    page->liveCount = 0;
+    page->bitmapWords = bitmapWords;
+    page->isLarge = cellCount == 1;
+    page->needsSweep = false;
+    page->isAvailable = false;
+    page->isYoung = false;
+    memset(page->bitmaps, 0, 2 * sizeof(uint64_t) * bitmapWords);
+}
+
+/**
+ * Adds a page to the list of pages that had objects allocated in them since the last collection.
+ * @param vm
+ * @param page
+ */
+static void markYoung(VM* vm, HeapPage* page) {
+    if (page->isYoung) return;
+    page->isYoung = true;
+    page->nextYoung = vm->youngPages;
+    vm->youngPages = page;
+}
+
+/**
+ * Sweeps a page: the objects that are allocated but not marked are unreachable, and get freed. Only the bitmaps are
+ * scanned, the surviving objects aren't touched.
+ * @param vm
+ * @param page
+ * @return false if the page was a large object page whose object got freed, which frees the page along with it.
+ */
+static bool sweepPage(VM* vm, HeapPage* page) {
+    page->needsSweep = false;
+    uint64_t* marks = page->bitmaps;
+    uint64_t* allocated = page->bitmaps + page->bitmapWords;
+
+    if (page->isLarge) {
+        if (marks[0] != 0) return true;
+        freeObject(vm, (Obj*) page->cells);
+        return false;
+    }
+
+    for (int word = 0; word < page->bitmapWords; word++) {
+        uint64_t dead = allocated[word] & ~marks[word];
+        while (dead != 0) {
+            int index = word * 64 + lowestBit(dead);
+            dead &= dead - 1;
+            // This clears the bit of the cell in the allocation bitmap.
+            freeObject(vm, (Obj*) (page->cells + (size_t) index * page->cellSize));
+        }
+    }
+    return true;
+}
+
+#ifdef OBJECT_POOLS
+
+/**
+ * Pushes a page onto the stack of pages its pool allocates from, unless it already is in there.
+ * @param vm
+ * @param page
+ */
+static void pushAvailable(VM* vm, HeapPage* page) {
+    if (page->isAvailable) return;
+    ObjectPool* pool = &vm->pools[page->cellSize / POOL_GRANULE - 1];
+    page->isAvailable = true;
+    page->nextAvailable = pool->available;
+    pool->available = page;
+}
+
+/**
+ * Adds a fresh page to a pool.
+ * @param pool
+ * @param cellSize
+ * @return the new page.
+ */
+static HeapPage* addPoolPage(ObjectPool* pool, size_t cellSize) {
+    HeapPage* page = allocatePage(POOL_PAGE_SIZE);
+    // The bitmaps get sized for as many cells as would fit in the page without them, which leaves them a little slack.
+    int bitmapWords = (int) ((POOL_PAGE_SIZE / cellSize + 63) / 64);
+    size_t header = (sizeof(HeapPage) + 2 * sizeof(uint64_t) * bitmapWords + POOL_GRANULE - 1) / POOL_GRANULE * POOL_GRANULE;
+    initPage(page, &pool->pages, header, cellSize, (int) ((POOL_PAGE_SIZE - header) / cellSize), bitmapWords);
+    return page;
+}
+
+/**
+ * Finds the first free cell of a page, starting from a given cell.
+ * @param page
+ * @param from
+ * @return index of the free cell, or -1 if there is none.
+ */
+static int findFreeCell(HeapPage* page, int from) {
+    uint64_t* allocated = page->bitmaps + page->bitmapWords;
+    for (int word = from / 64; word < page->bitmapWords; word++) {
+        uint64_t free = ~allocated[word];
+        if (word == from / 64) free &= ~(uint64_t) 0 << (from % 64);
+        if (free != 0) {
+            // The bits past the last cell are free as well, hitting one of those means the page is full.
+            int index = word * 64 + lowestBit(free);
+            return index < page->cellCount ? index : -1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Picks the next page of a pool to allocate from, once the current one is full.
+ * This is where the pages get swept after a collection: lazily, right before cells are allocated from them. Pages with no
+ * free cells left are dropped from the stack, until a collection frees some of their cells.
+ * @param vm
+ * @param pool
+ * @param cellSize
+ * @return
+ */
+static HeapPage* nextPoolPage(VM* vm, ObjectPool* pool, size_t cellSize) {
+    while (pool->available != NULL) {
+        HeapPage* page = pool->available;
+        pool->available = page->nextAvailable;
+        page->isAvailable = false;
+        if (page->needsSweep) sweepPage(vm, page);
+        if (page->liveCount < page->cellCount) return page;
+    }
+    return addPoolPage(pool, cellSize);
+}
+
+/**
+ * Takes a free cell from a pool.
+ * @param vm
+ * @param pool
+ * @param cellSize
+ * @return
+ */
+static void* takeCell(VM* vm, ObjectPool* pool, size_t cellSize) {
+    for (;;) {
+        HeapPage* page = pool->current;
+        if (page != NULL) {
+            int index = findFreeCell(page, pool->cursor);
+            if (index >= 0) {
+                pool->cursor = index + 1;
+                page->bitmaps[page->bitmapWords + index / 64] |= (uint64_t) 1 << (index % 64);
+                page->liveCount++;
+                return page->cells + (size_t) index * cellSize;
+            }
+        }
+
+        pool->current = nextPoolPage(vm, pool, cellSize);
+        pool->cursor = 0;
+        markYoung(vm, pool->current);
+    }
+}
+
+#endif
+
+/**
+ * Allocates the memory for an object. Small objects get a cell from the pool of their size class, which is a lot
+ * cheaper than going through malloc, and keeps objects of the same size packed together. Larger ones get a page of their
+ * own. Either way the memory counts towards the heap size that triggers the GC.
+ * @param vm
+ * @param size size of the object in bytes.
+ * @return
+ */
+void* allocateCell(VM* vm, size_t size) {
+#ifdef OBJECT_POOLS
+    if (size <= POOL_MAX_CELL_SIZE) {
+        size_t cellSize = (size + POOL_GRANULE - 1) / POOL_GRANULE * POOL_GRANULE;
+        // The GC has to run before we take a cell, since it may hand cells back to the pool.
+        countAllocation(vm, 0, cellSize);
+        return takeCell(vm, &vm->pools[cellSize / POOL_GRANULE - 1], cellSize);
+    }
+#endif
+    countAllocation(vm, 0, size);
+    HeapPage* page = allocatePage(LARGE_PAGE_HEADER_SIZE + size);
+    initPage(page, &vm->largePages, LARGE_PAGE_HEADER_SIZE, size, 1, 1);
+    page->bitmaps[1] = 1;
+    page->liveCount = 1;
+    markYoung(vm, page);
+    return page->cells;
+}
+
+/**
+ * Frees the memory of an object allocated with allocateCell(). A cell is simply cleared in the allocation bitmap of its
+ * page, to be reused by the next object of the same size class. The memory of the pools is only released when the VM
+ * shuts down. Large object pages are released right away.
+ * @param vm
+ * @param pointer
+ * @param size size of the object in bytes, as passed to allocateCell().
+ */
+void freeCell(VM* vm, void* pointer, size_t size) {
+    ObjType type = ((Obj*) pointer)->type;
+    vm->gcStats.objectCounts[type]--;
+    vm->gcStats.objectBytes[type] -= size;
+
+    HeapPage* page = PAGE_OF(pointer);
+    if (page->isLarge) {
+        countAllocation(vm, size, 0);
+        if (page->prev != NULL) {
+            page->prev->next = page->next;
+        } else {
+            vm->largePages = page->next;
+        }
+        if (page->next != NULL) page->next->prev = page->prev;
+        freePage(page);
+        return;
+    }
+
+    countAllocation(vm, page->cellSize, 0);
+    int index = cellIndex(page, (Obj*) pointer);
+    page->bitmaps[page->bitmapWords + index / 64] &= ~((uint64_t) 1 << (index % 64));
+    page->liveCount--;
+}
+
 /**
  * Utility function to mark an object as referenced. Required for GC.
+ * @param vm
  * @param object
  */
-void markObject(Obj* object) {
+void markObject(VM* vm, Obj* object) {
     if (object == NULL) return;
     // prevent the GC from getting stuck in a loop, check if the current object has already been visited.
-    if (object->isMarked) return;
+    if (isMarked(object)) return;
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*) object);
     printValue(OBJ_VAL(object));
     printf("\n");
 #endif
 
-    object->isMarked = true;
+    HeapPage* page = PAGE_OF(object);
+    int index = cellIndex(page, object);
+    page->bitmaps[index / 64] |= (uint64_t) 1 << (index % 64);
+    pushGray(vm, object);
+}
 
-    if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+/**
+ * Adds an object to the GC's grayStack, the worklist of objects whose references still have to be traced.
+ * @param vm
+ * @param object
+ */
+static void pushGray(VM* vm, Obj* object) {
+    if (vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
         // NOTE: we use raw realloc rather than our own memory management wrapper functions. The memory for the gray stack
         // is not managed by the garbage collector. We don't want to grow the stack during a GC to cause the GC to recursively
         // start a new GC. That could tear a hole in the space-time continuum.
-        vm.grayStack = (Obj**) realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+        vm->grayStack = (Obj**) realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
 
         // In case we fail to grow the grayStack capacity (which is rarer than a new ASOIAF book coming out), we gracefully exit.
         // This must have meant we ran out of memory.
-        if (vm.grayStack == NULL) exit(1);
+        if (vm->grayStack == NULL) exit(1);
     }
 
     // Add the object to reference to the grayStack.
-    vm.grayStack[vm.grayCount++] = object;
+    vm->grayStack[vm->grayCount++] = object;
+}
+
+/**
+ * Adds an old object to the remembered set, so the next minor collection traces its references. Does nothing for young
+ * objects, minor collections trace those anyway when they are reachable.
+ * @param vm
+ * @param object
+ */
+void rememberObject(VM* vm, Obj* object) {
+    if (!isMarked(object) || object->isRemembered) return;
+    object->isRemembered = true;
+
+    if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+        vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+        // Like the gray stack, the remembered set is not managed by the GC: a write barrier must never trigger a collection.
+        vm->rememberedSet = (Obj**) realloc(vm->rememberedSet, sizeof(Obj*) * vm->rememberedCapacity);
+        if (vm->rememberedSet == NULL) exit(1);
+    }
+    vm->rememberedSet[vm->rememberedCount++] = object;
+}
+
+/**
+ * Records a newly allocated string. If it dies young, the minor collection that finds out has to remove it from the
+ * string table itself, as its page may only get swept much later.
+ * @param vm
+ * @param string
+ */
+void trackYoungString(VM* vm, ObjString* string) {
+    if (vm->youngStringCapacity < vm->youngStringCount + 1) {
+        vm->youngStringCapacity = GROW_CAPACITY(vm->youngStringCapacity);
+        // Not managed by the GC either, growing it while a string is being allocated must not trigger a collection.
+        vm->youngStrings = (ObjString**) realloc(vm->youngStrings, sizeof(ObjString*) * vm->youngStringCapacity);
+        if (vm->youngStrings == NULL) exit(1);
+    }
+    vm->youngStrings[vm->youngStringCount++] = string;
+}
+
+/**
+ * Empties the remembered set.
+ * @param vm
+ * @param trace whether the remembered objects should be traced, by moving them to the gray stack.
+ */
+static void flushRememberedSet(VM* vm, bool trace) {
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        Obj* object = vm->rememberedSet[i];
+        object->isRemembered = false;
+        if (!trace) continue;
+
+        // The object is already marked, so markObject() would skip it. We push it to the gray stack directly.
+        pushGray(vm, object);
+    }
+    vm->rememberedCount = 0;
 }
 
 /**
  * Function to mark a value as referenced, for the GC.
+ * @param vm
  * @param value
  */
-void markValue(Value value) {
+void markValue(VM* vm, Value value) {
     // We only care about marking objects. Because Tok values such as numbers, booleans, and nil -
     // are stored directly inline in Value and require no heap allocation. So, the GC doesn't need to worry about them.
-    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+    if (IS_OBJ(value)) markObject(vm, AS_OBJ(value));
 }
 
 /**
  * Mark all the values present in a ValueArray for the GC process.
+ * @param vm
  * @param array
  */
-static void markArray(ValueArray* array) {
+static void markArray(VM* vm, ValueArray* array) {
     for (int i = 0; i < array->count; i++) {
-        markValue(array->values[i]);
+        markValue(vm, array->values[i]);
     }
 }
 
 /**
  * Utility function to traverse all the references from a given object for the graph coloring process during GC.
- * NOTE: there is no direct encoding of "black" ino the object's state. A black object is any object whose <code>isMarked</code>
- * field is set and that is no longer in the gray stack.
+ * NOTE: there is no direct encoding of "black" ino the object's state. A black object is any object whose mark bit
+ * is set and that is no longer in the gray stack.
+ * @param vm
  * @param object
  */
-static void blackenObject(Obj* object) {
+static void blackenObject(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*) object);
     printValue(OBJ_VAL(object));
@@ -116,51 +561,109 @@ static void blackenObject(Obj* object) {
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod* bound = (ObjBoundMethod*) object;
             /// mark the receiving instance, so that <code>this</code> can still find the object when the handler is invoked later.
-            markValue(bound->receiver);
+            markValue(vm, bound->receiver);
             // mark the method being bound to the receiver.
-            markObject((Obj*) bound->method);
+            markObject(vm, (Obj*) bound->method);
             break;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*) object;
             // mark the class's name to keep the string alive.
-            markObject((Obj*) klass->name);
+            markObject(vm, (Obj*) klass->name);
             // mark all the methods present on the class.
-            markTable(&klass->methods);
+            markTable(vm, &klass->methods);
+            // the root shape keeps the whole tree of shapes for the class's instances alive.
+            markObject(vm, (Obj*) klass->rootShape);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*) object;
             // Each closure has a reference to the bare function it wraps
-            markObject((Obj*) closure->function);
+            markObject(vm, (Obj*) closure->function);
             // Each closure has an array of pointers to the upvalues is captures.
             for (int i = 0; i < closure->upvalueCount; i++) {
                 // Mark each upvalue present in the upvalue array.
-                markObject((Obj*) closure->upvalues[i]);
+                markObject(vm, (Obj*) closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*) object;
+            // A fiber that isn't running keeps its stack, and the closures of its frames, to itself. The running fiber's
+            // are the VM's, which markRoots() takes care of.
+            for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) {
+                markValue(vm, *slot);
+            }
+            for (int i = 0; i < fiber->frameCount; i++) {
+                markObject(vm, (Obj*) fiber->frames[i].closure);
             }
+            for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+                markObject(vm, (Obj*) upvalue);
+            }
+            // The fiber that resumed it has to be kept around for it to yield to.
+            markObject(vm, (Obj*) fiber->caller);
+            markValue(vm, fiber->transfer);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*) object;
             // Each function has a reference to an ObjString containing the function's name.
-            markObject((Obj*) function->name);
+            markObject(vm, (Obj*) function->name);
+            // and to its shared closure, if it has one.
+            markObject(vm, (Obj*) function->closure);
+            // A function that hasn't been compiled yet keeps the source of its body around.
+            markObject(vm, (Obj*) function->lazySource);
             // Each function has a constant table full of references to other objects.
-            markArray(&function->chunk.constants);
+            markArray(vm, &function->chunk.constants);
+            // The inline caches hold on to the shapes and methods they remember. If a cached shape could be freed, a
+            // new shape allocated at the same address would be mistaken for it.
+            for (int i = 0; i < function->chunk.cacheCount; i++) {
+                markObject(vm, function->chunk.caches[i].shape);
+                markObject(vm, function->chunk.caches[i].transition);
+                markValue(vm, function->chunk.caches[i].method);
+            }
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*) object;
             // if the instance is alive, we need to keep its class around.
-            markObject((Obj*) instance->klass);
+            markObject(vm, (Obj*) instance->klass);
+            markObject(vm, (Obj*) instance->shape);
             // we need to keep every object referenced by the instance's fields around as well.
-            markTable(&instance->fields);
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                markValue(vm, instance->fields[i]);
+            }
             break;
         }
-        case OBJ_UPVALUE:
+        case OBJ_LIST:
+            markArray(vm, &((ObjList*) object)->items);
+            break;
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*) object;
+            // a rope needs its pieces until it gets flattened, and the flat string after that.
+            markObject(vm, rope->left);
+            markObject(vm, rope->right);
+            markObject(vm, (Obj*) rope->flat);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*) object;
+            // keeps the field names, and the shapes reachable through transitions, alive.
+            markTable(vm, &shape->slots);
+            markTable(vm, &shape->transitions);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*) object;
             // When an upvalue is closed, it contains a reference to the closed-over value.
             // Since the value is no longer on the stack, we need to trace the reference to it from the upvalue.
-            markValue(((ObjUpvalue*) object)->closed);
+            // An open upvalue may point into the stack of a fiber that isn't running, where a store through the upvalue
+            // only goes through the upvalue's write barrier. Tracing the value it points at covers both cases.
+            markValue(vm, *upvalue->location);
+            // The stack an open upvalue points into must not go before the upvalue gets closed.
+            markObject(vm, (Obj*) upvalue->fiber);
             break;
+        }
         case OBJ_NATIVE:
         case OBJ_STRING:
             // string and native function objects contain no outgoing references so there's nothing to traverse.
@@ -171,9 +674,10 @@ static void blackenObject(Obj* object) {
 
 /**
  * Utility function to free up particular objects in the memory given their references.
+ * @param vm
  * @param object
  */
-static void freeObject(Obj* object) {
+static void freeObject(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*) object, object->type);
 #endif
@@ -181,49 +685,74 @@ static void freeObject(Obj* object) {
     switch (object->type) {
         case OBJ_BOUND_METHOD:
             // Note: While the bound method contains a couple of references, it doesn't own them - so it frees nothing but itself.
-            FREE(ObjBoundMethod, object);
+            FREE(vm, ObjBoundMethod, object);
             break;
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*) object;
             // The ObjClass struct owns the memory for the methods hash table.
-            freeTable(&klass->methods);
-            FREE(ObjClass, object);
+            freeTable(vm, &klass->methods);
+            FREE(vm, ObjClass, object);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*) object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            freeCell(vm, object, sizeof(ObjClosure) + sizeof(ObjUpvalue*) * closure->upvalueCount);
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*) object;
+            // The stacks aren't accounted to the heap, like the VM's.
+            free(fiber->frames);
+            free(fiber->stack);
+            FREE(vm, ObjFiber, object);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*) object;
             // Free the chunk present inside the function first.
-            freeChunk(&function->chunk);
+            freeChunk(vm, &function->chunk);
+#ifdef JIT
+            jitFree(function);
+#endif
             // Free the function object itself.
-            FREE(ObjFunction, object);
+            FREE(vm, ObjFunction, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*) object;
-            // The instance owns its field table, so we free the table when freeing the instance.
-            // We don't explicity free the entries in the table, because there may be other references to those objects.
-            // The GC will take care of those for us. Here we only free the entry array of the table itself.
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            // If the instance outgrew its inline storage, the fields live in an array of their own which the instance owns.
+            // We don't explicity free the field values, because there may be other references to those objects.
+            // The GC will take care of those for us.
+            if (instance->fields != instance->inlineFields) {
+                FREE_ARRAY(vm, Value, instance->fields, instance->capacity);
+            }
+            freeCell(vm, object, sizeof(ObjInstance) + sizeof(Value) * instance->inlineCapacity);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*) object;
+            freeTable(vm, &shape->slots);
+            freeTable(vm, &shape->transitions);
+            FREE(vm, ObjShape, object);
             break;
         }
+        case OBJ_LIST:
+            // Like an instance's fields, the items may be referenced from elsewhere, only the array is the list's own.
+            freeValueArray(vm, &((ObjList*) object)->items);
+            FREE(vm, ObjList, object);
+            break;
         case OBJ_NATIVE:
-            FREE(ObjNative, object);
+            FREE(vm, ObjNative, object);
             break;
-        case OBJ_STRING: {
-            ObjString* string = (ObjString*) object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+        case OBJ_ROPE:
+            FREE(vm, ObjRope, object);
+            break;
+        case OBJ_STRING:
+            // The characters are part of the string's own allocation.
+            freeCell(vm, object, sizeof(ObjString) + ((ObjString*) object)->length + 1);
             break;
-        }
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
+            FREE(vm, ObjUpvalue, object);
             break;
     }
 }
@@ -231,31 +760,49 @@ static void freeObject(Obj* object) {
 /**
  * Marks all the roots for memory references in the heap.
  */
-static void markRoots() {
+static void markRoots(VM* vm) {
     // Most roots are local variables or temporaries sitting right in the VM's stack, so we start by walking that.
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-        markValue(*slot);
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        markValue(vm, *slot);
     }
 
     // VM maintains a separate stack of CallFrames. Each CallFrame contains a pointer to the closure being called.
     // The VM uses those pointers to access constants and upvalues, so they need to be kept around too.
-    for (int i = 0; i < vm.frameCount; i++) {
-        markObject((Obj*) vm.frames[i].closure);
+    for (int i = 0; i < vm->frameCount; i++) {
+        markObject(vm, (Obj*) vm->frames[i].closure);
     }
 
     // The open upvalue list is also a set of values that the VM can directly reach.
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
-        markObject((Obj*) upvalue);
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        markObject(vm, (Obj*) upvalue);
     }
 
     // Mark the roots which originate from global variables.
-    markTable(&vm.globals);
+    markTable(vm, &vm->globalSlots);
+    markArray(vm, &vm->globalNames);
+    markArray(vm, &vm->globalValues);
 
     // Collection can begin during any kind of allocation, and not just when the user's program is running.
     // The compiler itself periodically grabs memory from the heap for literals and constant table. If the GC runs
     // while we're in the middle of compiling, then any values the compiler directly accesses need to be treated as roots too.
-    markCompilerRoots();
-    markObject((Obj*) vm.initString);
+    markCompilerRoots(vm);
+    markObject(vm, (Obj*) vm->initString);
+
+    // The fibers that aren't running are only reachable from the one that is, from the scheduler, and from the values
+    // that reference them.
+    markObject(vm, (Obj*) vm->fiber);
+    markObject(vm, (Obj*) vm->mainFiber);
+    markScheduler(vm);
+}
+
+/**
+ * Clears the entries of the bound method cache whose bound methods are white, and are about to be swept. The cache
+ * references them weakly, like the string table does the strings.
+ */
+static void removeWhiteBoundMethods(VM* vm) {
+    for (int i = 0; i < BOUND_METHOD_CACHE_SIZE; i++) {
+        if (vm->boundMethods[i] != NULL && !isMarked((Obj*) vm->boundMethods[i])) vm->boundMethods[i] = NULL;
+    }
 }
 
 /**
@@ -263,46 +810,154 @@ static void markRoots() {
  * Until the stack empties, we keep pulling out gray objects, traversing their references, then marking them black.
  * Traversing an object's references may turn up new white objects that get marked gray and added to the stack.
  */
-static void traceReferences() {
-    while (vm.grayCount > 0) {
-        Obj* object = vm.grayStack[--vm.grayCount];
+static void traceReferences(VM* vm) {
+    while (vm->grayCount > 0) {
+        Obj* object = vm->grayStack[--vm->grayCount];
         // traverse the currently picked gray object's references.
-        blackenObject(object);
+        blackenObject(vm, object);
     }
 }
 
+/// Number of lists the pages of the heap are kept in: one for each size class, followed by the one of large objects.
+#ifdef OBJECT_POOLS
+#define PAGE_LIST_COUNT (POOL_CLASS_COUNT + 1)
+#else
+#define PAGE_LIST_COUNT 1
+#endif
+
 /**
- * Sweeps the memory to collect the garbage; all the objects that are not marked - and hence unreachable.
- * This function walks through a list of all the objects checking their mark bits. If an object is marked (black),
- * we leave it alone and continue past it. If it is unmarked (white), we unlink it from the list and free it using the
- * <code>freeObject()</code> function.
- */
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        if (object->isMarked) {
-            // after sweep completes, only live black objects remain with their mark bits set. We need to unset these bits
-            // once we've been through them so that when the next collection cycle starts, every object is white.
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
+ * Returns the first page of one of the lists of pages of the heap.
+ * @param vm
+ * @param list index of the list, up to PAGE_LIST_COUNT.
+ * @return
+ */
+static HeapPage* firstPage(VM* vm, int list) {
+#ifdef OBJECT_POOLS
+    if (list < POOL_CLASS_COUNT) return vm->pools[list].pages;
+#endif
+    return vm->largePages;
+}
+
+/**
+ * Points the cursor the major collection walks the heap with at the first page.
+ */
+static void resetCursor(VM* vm) {
+    vm->gcCursorList = 0;
+    vm->gcCursor = firstPage(vm, 0);
+}
+
+/**
+ * Advances the cursor the major collection walks the heap with, going through each list of pages in turn. Pages added
+ * since the cursor was reset are skipped, as they are added to the front of their list.
+ * @param vm
+ * @return the page the cursor was at, or NULL once it went past the last page.
+ */
+static HeapPage* nextCursorPage(VM* vm) {
+    while (vm->gcCursor == NULL && vm->gcCursorList < PAGE_LIST_COUNT - 1) {
+        vm->gcCursor = firstPage(vm, ++vm->gcCursorList);
+    }
+    HeapPage* page = vm->gcCursor;
+    if (page != NULL) vm->gcCursor = page->next;
+    return page;
+}
+
+/**
+ * Wraps up the collection of the young objects, once they are marked. The ones that got marked survived, and are
+ * promoted to the old generation simply by leaving their mark bits set. The others are freed when their pages are swept,
+ * which for the pages of the pools happens lazily when the pool gets to allocate from them again.
+ */
+static void sweepYoung(VM* vm) {
+    // Until then, the strings that died are still in their pages, and copyString() could find them in the string table.
+    for (int i = 0; i < vm->youngStringCount; i++) {
+        ObjString* string = vm->youngStrings[i];
+        if (!isMarked((Obj*) string)) tableDelete(&vm->strings, string);
+    }
+    vm->youngStringCount = 0;
+
+    HeapPage* page = vm->youngPages;
+    vm->youngPages = NULL;
+    while (page != NULL) {
+        HeapPage* next = page->nextYoung;
+        page->nextYoung = NULL;
+        page->isYoung = false;
+        if (page->isLarge) {
+            sweepPage(vm, page);
         } else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
-            }
+#ifdef OBJECT_POOLS
+            page->needsSweep = true;
+            pushAvailable(vm, page);
+#endif
+        }
+        page = next;
+    }
 
-            freeObject(unreached);
+#ifdef OBJECT_POOLS
+    // The current pages of the pools were young too, they have to be swept before being allocated from any further.
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        vm->pools[i].current = NULL;
+    }
+#endif
+}
+
+/**
+ * Sweeps the memory to collect the garbage; all the objects that are not marked - and hence unreachable.
+ * This function walks through every page of the heap, and sweeps those that weren't swept yet by an allocation. Sweeping
+ * only looks at the bitmaps of the page, and at the objects being freed.
+ * The mark bits of the survivors are left set, that's what tells old objects apart from young ones until the next major
+ * collection.
+ * The sweep is incremental: it stops after looking at about the given number of cells, and picks up where it left off
+ * the next time around.
+ * @param vm
+ * @param budget maximum number of cells to look at.
+ * @return true once every page has been swept.
+ */
+static bool sweep(VM* vm, int budget) {
+    while (budget > 0) {
+        HeapPage* page = nextCursorPage(vm);
+        if (page == NULL) return true;
+        if (page->needsSweep) {
+            budget -= page->cellCount;
+            sweepPage(vm, page);
+        } else {
+            budget--;
         }
     }
+    return false;
 }
 
 /**
- * Function to handle the Mark-Sweep Garbage Collection.
+ * Minor collection: collects the young objects only. Most objects die young, so this reclaims most of the garbage
+ * while only tracing the objects that survive it.
+ * Old objects all have their mark bits set, so the trace stops at them and never goes through the old generation, apart
+ * from the remembered objects that may reference young ones. For the same reason, the sweep only needs to look at the
+ * pages young objects were allocated in.
+ */
+static void collectYoungGarbage(VM* vm) {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm->bytesAllocated;
+#endif
+
+    markRoots(vm);
+    flushRememberedSet(vm, true);
+    traceReferences(vm);
+    removeWhiteBoundMethods(vm);
+    sweepYoung(vm);
+
+    vm->nextMinorGC = vm->bytesAllocated + GC_NURSERY_SIZE;
+    vm->gcStats.minorCollections++;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+           before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextMinorGC);
+#endif
+}
+
+/**
+ * Starts a major collection, which collects the whole heap, young and old objects alike. Unless the collection is
+ * finished right away, it then proceeds in small steps run in between allocations, so the program never has to wait
+ * for the whole heap to be traced.
  * We use a tricolor abstraction to keep track of where we are in the GC process.
  * Each object has a conceptual color that tracks what state the object is in, and what work is left to do:
  * - White: At the beginning of a garbage collection, every object is white. This color means we have not reached or processed the object at all.
@@ -311,18 +966,76 @@ static void sweep() {
  *   This is the worklist—the set of objects we know about but haven’t processed yet.
  * - Black: When we take a gray object and mark all of the objects it references, we then turn the gray object black.
  *   This color means the mark phase is done processing that object.
+ * A major collection starts over with every object white, but the old objects carry their mark bits from the previous
+ * collection. So the first phase clears the mark bitmaps of every page.
  */
-void collectGarbage() {
+static void beginMajorCollection(VM* vm) {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
 #endif
+    vm->gcPhase = GC_CLEARING;
+    resetCursor(vm);
+    vm->nextGCStep = vm->bytesAllocated + GC_STEP_SIZE;
+    // If the program allocates faster than the collection makes progress, the collection gets finished right away
+    // once the heap has grown that far.
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+}
+
+/**
+ * Clears the mark bitmaps of some of the pages. Pages that still have to be swept, after a minor collection, get swept
+ * first, their unmarked objects would be impossible to tell apart from the live ones afterwards.
+ * @param vm
+ * @param budget maximum number of cells to clear.
+ * @return true once every page has been cleared.
+ */
+static bool clearMarks(VM* vm, int budget) {
+    while (budget > 0) {
+        HeapPage* page = nextCursorPage(vm);
+        if (page == NULL) return true;
+        budget -= page->cellCount;
+        if (page->needsSweep && !sweepPage(vm, page)) continue;
+        memset(page->bitmaps, 0, sizeof(uint64_t) * page->bitmapWords);
+    }
+    return false;
+}
 
-    // Mark the roots
-    markRoots();
+/**
+ * Starts the marking, once every object is white.
+ * Minor collections don't run until the major collection is done, so the remembered set isn't needed anymore. From
+ * now on, the write barrier uses it to record the black objects that get a reference to a white one. Those get grayed
+ * again, otherwise the white object could be missed by the marking.
+ */
+static void beginMarking(VM* vm) {
+    flushRememberedSet(vm, false);
+    markRoots(vm);
+    vm->gcPhase = GC_MARKING;
+}
 
-    // Process all the gray marked objects.
-    traceReferences();
+/**
+ * Blackens some of the gray objects.
+ * @param vm
+ * @param budget maximum number of objects to blacken.
+ * @return true once there are no gray objects left.
+ */
+static bool markSome(VM* vm, int budget) {
+    flushRememberedSet(vm, true);
+    while (budget > 0 && vm->grayCount > 0) {
+        Obj* object = vm->grayStack[--vm->grayCount];
+        blackenObject(vm, object);
+        budget--;
+    }
+    return vm->grayCount == 0;
+}
+
+/**
+ * Finishes the marking, and sets up the sweep.
+ * The stack and the other roots change all the time without going through the write barrier, so they have to be
+ * marked once more at the very end, along with whatever they lead to that is still white.
+ */
+static void finishMarking(VM* vm) {
+    markRoots(vm);
+    flushRememberedSet(vm, true);
+    traceReferences(vm);
 
     /**
      * Ctok interns all strings. That means the VM has a hash table containing a pointer to every single string in the heap.
@@ -337,36 +1050,179 @@ void collectGarbage() {
      * after the mark phase has completed. But we can't wait until after the sweep phase is done, because by then the
      * objects and their mark bits are no longer around to check. So we do it exactly between marking and sweeping phases.
      */
-    tableRemoveWhite(&vm.strings);
+    tableRemoveWhite(&vm->strings);
+    removeWhiteBoundMethods(vm);
 
     // At this point we have processed all objects we could get our hands on. The grayStack is empty, and every object
     // in the heap is either black or white. The black objects are reachable, and we want to hang on to them. Anything
     // that's still white never got touched by the trace and is thus garbage. We just need to reclaim it.
-    sweep();
+    // Every page may hold some of it, so they all have to be swept before being allocated from again. Objects allocated
+    // from here on are young again, the ones allocated during the marking get swept with the old ones.
+    vm->youngStringCount = 0;
+    vm->youngPages = NULL;
+    for (int list = 0; list < PAGE_LIST_COUNT; list++) {
+        for (HeapPage* page = firstPage(vm, list); page != NULL; page = page->next) {
+            page->needsSweep = true;
+            page->isYoung = false;
+            page->nextYoung = NULL;
+#ifdef OBJECT_POOLS
+            if (!page->isLarge) pushAvailable(vm, page);
+#endif
+        }
+    }
+#ifdef OBJECT_POOLS
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        vm->pools[i].current = NULL;
+    }
+#endif
+    resetCursor(vm);
+    vm->gcPhase = GC_SWEEPING;
+}
+
+/**
+ * Wraps up a major collection once everything has been swept.
+ */
+static void finishMajorCollection(VM* vm) {
+    vm->gcPhase = GC_IDLE;
+    vm->gcStats.majorCollections++;
 
     // After the collection completes, we adjust the threshold of the next GC based on the number of live bytes that remain.
     // The threshold is a multiple of the heap size. This way, as the amount of memory the program uses grows,
     // the threshold moves farther out to limit the total time spent re-traversing the larger live set
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm->nextMinorGC = vm->bytesAllocated + GC_NURSERY_SIZE;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+    printf("   heap at %zu bytes, next at %zu\n", vm->bytesAllocated, vm->nextGC);
 #endif
+}
+
+/**
+ * Does a bounded amount of work on the major collection in progress.
+ * @param vm
+ * @param budget maximum number of objects to process.
+ */
+static void collectStep(VM* vm, int budget) {
+    switch (vm->gcPhase) {
+        case GC_IDLE:
+            break;
+        case GC_CLEARING:
+            if (clearMarks(vm, budget)) beginMarking(vm);
+            break;
+        case GC_MARKING:
+            if (markSome(vm, budget)) finishMarking(vm);
+            break;
+        case GC_SWEEPING:
+            if (sweep(vm, budget)) finishMajorCollection(vm);
+            break;
+    }
+    vm->nextGCStep = vm->bytesAllocated + GC_STEP_SIZE;
+}
 
+/**
+ * Finishes the major collection in progress, if there is one, in one go.
+ */
+static void finishCollection(VM* vm) {
+    while (vm->gcPhase != GC_IDLE) collectStep(vm, INT_MAX);
+}
+
+/**
+ * Runs a major collection from start to finish in one go, after finishing the one in progress, if there is one.
+ */
+void collectGarbage(VM* vm) {
+    finishCollection(vm);
+    beginMajorCollection(vm);
+    finishCollection(vm);
 }
 
 /**
  * Function to help cleanup memory references after the VM has completed its operations.
  */
-void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+void freeObjects(VM* vm) {
+    for (int list = 0; list < PAGE_LIST_COUNT; list++) {
+        HeapPage* page = firstPage(vm, list);
+        while (page != NULL) {
+            HeapPage* next = page->next;
+            bool isLarge = page->isLarge;
+            uint64_t* allocated = page->bitmaps + page->bitmapWords;
+            for (int word = 0; word < page->bitmapWords; word++) {
+                while (allocated[word] != 0) {
+                    int index = word * 64 + lowestBit(allocated[word]);
+                    // Freeing a large object releases its page as well, so the loop ends right after.
+                    freeObject(vm, (Obj*) (page->cells + (size_t) index * page->cellSize));
+                    if (isLarge) break;
+                }
+                if (isLarge) break;
+            }
+            if (!isLarge) freePage(page);
+            page = next;
+        }
+    }
+    vm->largePages = NULL;
+    vm->youngPages = NULL;
+#ifdef OBJECT_POOLS
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        vm->pools[i] = (ObjectPool) {NULL, NULL, 0, NULL};
     }
+#endif
     // free the GC resources when the VM shuts down.
-    free(vm.grayStack);
-}
\ No newline at end of file
+    free(vm->grayStack);
+    free(vm->rememberedSet);
+    free(vm->youngStrings);
+}
+
+/**
+ * Reads the peak resident set size of the process.
+ * @return the size in bytes, or 0 where it isn't known.
+ */
+static size_t peakResidentSize() {
+#if defined(__linux__)
+    // VmHWM only counts the memory of this program. getrusage() counts that of the program that ran before the exec()
+    // that started it too, which for a benchmark harness can be more than ctok itself uses.
+    FILE* status = fopen("/proc/self/status", "r");
+    if (status == NULL) return 0;
+    char line[128];
+    size_t kilobytes = 0;
+    while (fgets(line, sizeof(line), status) != NULL) {
+        if (sscanf(line, "VmHWM: %zu kB", &kilobytes) == 1) break;
+    }
+    fclose(status);
+    return kilobytes * 1024;
+#elif defined(_WIN32)
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return (size_t) usage.ru_maxrss;
+#else
+    return (size_t) usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+/**
+ * Prints a summary of the GC statistics.
+ * @param vm
+ * @param file
+ */
+void printGCStats(VM* vm, FILE* file) {
+    GCStats* stats = &vm->gcStats;
+    fprintf(file, "-- gc stats\n");
+    fprintf(file, "collections:   %zu minor, %zu major, in %zu pauses\n",
+            stats->minorCollections, stats->majorCollections, stats->pauses);
+    fprintf(file, "pause time:    %.3f ms total, %.3f ms max\n",
+            stats->totalPauseTime * 1000, stats->maxPauseTime * 1000);
+    fprintf(file, "memory:        %zu bytes allocated, %zu freed, %zu in use, next gc at %zu\n",
+            stats->bytesAllocated, stats->bytesFreed, vm->bytesAllocated, vm->nextGC);
+    size_t peak = peakResidentSize();
+    if (peak != 0) fprintf(file, "peak rss:      %zu bytes\n", peak);
+    fprintf(file, "string table:  %d strings, %d deleted, capacity %d\n",
+            vm->strings.count, vm->strings.tombstones, vm->strings.capacity);
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        if (stats->objectCounts[type] == 0) continue;
+        fprintf(file, "  %-12s %10zu objects %12zu bytes\n",
+                objTypeName((ObjType) type), stats->objectCounts[type], stats->objectBytes[type]);
+    }
+}
@@ -5,19 +5,21 @@
 #ifndef CTOK_MEMORY_H
 #define CTOK_MEMORY_H
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object.h"
 
 /**
- * Macro to allocate an array with a given element type and count.
+ * Macro to allocate an array with a given element type and count, accounted to the heap of the given VM.
  */
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
 /**
  * Macro to free an Obj's allocated memory on the heap.
  */
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) freeCell(vm, pointer, sizeof(type))
 
 /**
  * Macro that calculates the new capacity based on a given current capacity.
@@ -28,26 +30,184 @@
 /**
  * Macro to help create/grow an array to the required size.
  */
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-        (type*)reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount) \
+        (type*)reallocate(vm, pointer, sizeof(type) * (oldCount), \
         sizeof(type) * (newCount))
 
 /**
  * Macro used to clear an array and free up the memory.
  */
-#define FREE_ARRAY(type, pointer, oldCount) \
-        reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+        reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
+
+/// Object sizes are rounded up to a multiple of this, each multiple being a size class with a pool of its own.
+#define POOL_GRANULE 16
+/// Objects larger than this get a page of their own.
+#define POOL_MAX_CELL_SIZE 256
+#define POOL_CLASS_COUNT (POOL_MAX_CELL_SIZE / POOL_GRANULE)
+/// Size of the pages the pools carve their cells out of. Pages are aligned to their size, so the page of an object can
+/// be found by masking its address.
+#define POOL_PAGE_SIZE (64 * 1024)
+
+/**
+ * Header at the start of each page of the heap. A page either holds the cells of a size class, or a single large object.
+ * The mark bits of the objects are kept in a bitmap in the header, rather than in the objects themselves: the GC can
+ * then check and set them, and sweep the page, without touching the objects that survive.
+ */
+typedef struct HeapPage {
+    // neighbours in the list of pages of the same size class, or in the list of large object pages.
+    struct HeapPage* prev;
+    struct HeapPage* next;
+    // next page in the stack of pages its pool allocates from.
+    struct HeapPage* nextAvailable;
+    // next page in the list of pages holding young objects.
+    struct HeapPage* nextYoung;
+    // first cell of the page.
+    uint8_t* cells;
+    // size of each cell in bytes, for a large object page the size of the object.
+    uint32_t cellSize;
+    // 2^32 / cellSize rounded up, which turns the offset of a cell into its index with a multiplication.
+    uint32_t cellReciprocal;
+    int cellCount;
+    // number of allocated cells.
+    int liveCount;
+    // number of 64 bit words in each of the bitmaps.
+    int bitmapWords;
+    bool isLarge;
+    // true when the page has to be swept before cells can be allocated from it, or the GC moves on to the next phase.
+    bool needsSweep;
+    // true while the page is in the stack of pages its pool allocates from.
+    bool isAvailable;
+    // true while the page is in the list of pages holding young objects.
+    bool isYoung;
+    // The mark bitmap, followed by the bitmap of the allocated cells.
+    uint64_t bitmaps[];
+} HeapPage;
+
+/// Size of the header of a large object page, rounded up so that the object stays aligned.
+#define LARGE_PAGE_HEADER_SIZE \
+    ((sizeof(HeapPage) + 2 * sizeof(uint64_t) + POOL_GRANULE - 1) / POOL_GRANULE * POOL_GRANULE)
+
+#ifdef OBJECT_POOLS
+
+/// Finds the header of the page an object lives in.
+#define PAGE_OF(object) ((HeapPage*) ((uintptr_t) (object) & ~(uintptr_t) (POOL_PAGE_SIZE - 1)))
+
+/**
+ * All the pages of a size class. Cells are handed out from the current page, by scanning its bitmap of allocated cells
+ * for the next free one. Once it is full, the pool moves on to the next page of the available stack, which holds the
+ * pages that had cells freed since, or that need to be swept first to find out.
+ */
+typedef struct {
+    HeapPage* pages;
+    HeapPage* current;
+    // index of the cell of the current page to continue the scan from.
+    int cursor;
+    HeapPage* available;
+} ObjectPool;
+
+#else
+
+// Without the pools every object is a large object, in a page malloc'd for it alone.
+#define PAGE_OF(object) ((HeapPage*) ((uint8_t*) (object) - LARGE_PAGE_HEADER_SIZE))
+
+#endif
+
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize);
+
+void* allocateCell(VM* vm, size_t size);
+
+void freeCell(VM* vm, void* pointer, size_t size);
+
+/// Net number of bytes that can be allocated between two minor collections.
+#define GC_NURSERY_SIZE (256 * 1024)
+/// Net number of bytes that can be allocated between two steps of an incremental major collection.
+#define GC_STEP_SIZE (64 * 1024)
+/// Default number of objects a step of an incremental major collection processes, see VM.gcStepBudget.
+#define GC_STEP_BUDGET 4096
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+/**
+ * Phases of a major collection. Major collections run incrementally, interleaved with the program.
+ */
+typedef enum {
+    GC_IDLE,
+    // clearing the mark bits the old objects kept from the previous collection.
+    GC_CLEARING,
+    GC_MARKING,
+    GC_SWEEPING
+} GCPhase;
+
+/**
+ * Finds the index of an object's cell in its page.
+ * @param page
+ * @param object
+ * @return
+ */
+static inline int cellIndex(HeapPage* page, Obj* object) {
+    return (int) (((uint64_t) ((uint8_t*) object - page->cells) * page->cellReciprocal) >> 32);
+}
+
+/**
+ * Checks the mark bit of an object. Between collections, it tells old objects, which survived a collection, apart from
+ * the young ones allocated since.
+ * @param object
+ * @return
+ */
+static inline bool isMarked(Obj* object) {
+    HeapPage* page = PAGE_OF(object);
+    int index = cellIndex(page, object);
+    return (page->bitmaps[index / 64] >> (index % 64)) & 1;
+}
+
+/**
+ * Counters kept by the GC, so its behaviour can be looked into without a debug build. See gcStats() and --gc-stats.
+ */
+typedef struct {
+    // number of minor collections run.
+    size_t minorCollections;
+    // number of major collections finished.
+    size_t majorCollections;
+    // number of times the program was paused to run the GC, a step of an incremental collection being one pause.
+    size_t pauses;
+    // total and longest time spent in those pauses, in seconds.
+    double totalPauseTime;
+    double maxPauseTime;
+    // total number of bytes allocated and freed since the VM started.
+    size_t bytesAllocated;
+    size_t bytesFreed;
+    // number of objects of each ObjType in the heap, and the bytes they take up, not counting the arrays and tables they
+    // own. Unreachable objects count until they are swept.
+    size_t objectCounts[OBJ_TYPE_COUNT];
+    size_t objectBytes[OBJ_TYPE_COUNT];
+} GCStats;
+
+void markObject(VM* vm, Obj* object);
+
+void trackYoungString(VM* vm, ObjString* string);
+
+void rememberObject(VM* vm, Obj* object);
+
+/**
+ * Write barrier, to be run after storing a reference to a value inside an object, if the value could be younger than
+ * the object. Minor collections don't trace through old objects, so an old object that gets a reference to a young
+ * one has to be remembered for the next minor collection to find that reference.
+ * Roots, like the stack and the global variables, are traced by every collection and need no write barrier.
+ * @param vm
+ * @param object object the reference was stored in.
+ * @param value value that was stored.
+ */
+static inline void writeBarrier(VM* vm, Obj* object, Value value) {
+    if (isMarked(object) && IS_OBJ(value) && !isMarked(AS_OBJ(value))) rememberObject(vm, object);
+}
 
-void markObject(Obj* object);
+void markValue(VM* vm, Value value);
 
-void markValue(Value value);
+void freeObjects(VM* vm);
 
-void freeObjects();
+void printGCStats(VM* vm, FILE* file);
 
 // Pull yourself together,
 // you piece of trash
-void collectGarbage();
+void collectGarbage(VM* vm);
 
 #endif //CTOK_MEMORY_H
@@ -3,6 +3,7 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -12,25 +13,25 @@
 #include "vm.h"
 
 // This macro is used as a wrapper to help get the pointer back in the required Object type.
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocateObject(vm, sizeof(type), objectType)
 
 /**
  * Helper function that allocates an object of the given size on the heap. The size is not just the size of the Obj itself.
  * Teh caller passes in the number of bytes so that there is room for the extra payload fields needed by the specific
  * object type being created.
  * It then initializes the Obj state.
+ * @param vm
  * @param size
  * @param type
  * @return
  */
-static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*) reallocate(NULL, 0, size);
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+    Obj* object = (Obj*) allocateCell(vm, size);
     object->type = type;
-    object->isMarked = false;
-
-    object->next = vm.objects;
-    vm.objects = object;
+    object->isRemembered = false;
+    vm->gcStats.objectCounts[type]++;
+    vm->gcStats.objectBytes[type] += size;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d", (void*) object, size, type);
@@ -40,12 +41,13 @@ static Obj* allocateObject(size_t size, ObjType type) {
 
 /**
  * Utility function to create a new <code>ObjBoundMethod</code>.
+ * @param vm
  * @param receiver instance to which the method closure is to be bound
  * @param method method closure which needs to be bound.
  * @return Pointer to an ObjMethod containing the method closure bound to the provided receiver.
  */
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
-    ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method) {
+    ObjBoundMethod* bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
     bound->method = method;
     return bound;
@@ -53,128 +55,235 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
 
 /**
  * Utility function to create a new ObjClass.
+ * @param vm
  * @param name name of the class to be created.
  * @return
  */
-ObjClass* newClass(ObjString* name) {
-    ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+ObjClass* newClass(VM* vm, ObjString* name) {
+    ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
+    klass->rootShape = NULL;
+    klass->fieldCountHint = 0;
+
+    // keep the class safe from the GC while we allocate its root shape.
+    push(vm, OBJ_VAL(klass));
+    klass->rootShape = newShape(vm);
+    writeBarrier(vm, (Obj*) klass, OBJ_VAL(klass->rootShape));
+    pop(vm);
     return klass;
 }
 
 /**
  * Utility function to create a new ObjClosure instance.
+ * @param vm
  * @param function
  * @return
  */
-ObjClosure* newClosure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+ObjClosure* newClosure(VM* vm, ObjFunction* function) {
+    ObjClosure* closure = (ObjClosure*) allocateObject(vm, sizeof(ObjClosure) + sizeof(ObjUpvalue*) * function->upvalueCount,
+                                                       OBJ_CLOSURE);
+    closure->function = function;
+    closure->upvalueCount = function->upvalueCount;
     // We initialize each piece of allocated memory to make sure the GC won't see any uninitialized piece of memory.
     for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
+        closure->upvalues[i] = NULL;
     }
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure->function = function;
-    closure->upvalues = upvalues;
-    closure->upvalueCount = function->upvalueCount;
     return closure;
 }
 
 /**
  * Utility function to create a new Tok Function.
  * Unlike strings, we create this object in a blank state. We populate the properties later when function gets created.
+ * @param vm
  * @return
  */
-ObjFunction* newFunction() {
+ObjFunction* newFunction(VM* vm) {
     // Allocate memory on the heap for a new Tok function, and return a pointer to it.
-    ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+    ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxSlots = 0;
     function->name = NULL;
+    function->closure = NULL;
+    function->lazySource = NULL;
+    function->lazyStart = 0;
+    function->lazyLine = 0;
+    function->lazyType = 0;
+#ifdef JIT
+    function->jit = NULL;
+    function->hotness = 0;
+#endif
     initChunk(&function->chunk);
     return function;
 }
 
 /**
  * Utility function to create a new instance of a Tok class.
+ * @param vm
  * @param klass pointer to the CTok class whose instance is to be created
  * @return
  */
-ObjInstance* newInstance(ObjClass* klass) {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+ObjInstance* newInstance(VM* vm, ObjClass* klass) {
+    // We make room for as many fields as the class's instances have had so far, right inside the instance. Most
+    // instances of a class end up with the same fields, so this is usually all the storage the instance ever needs.
+    int capacity = klass->fieldCountHint;
+    ObjInstance* instance = (ObjInstance*) allocateObject(vm, sizeof(ObjInstance) + sizeof(Value) * capacity,
+                                                          OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = klass->rootShape;
+    instance->capacity = capacity;
+    instance->inlineCapacity = capacity;
+    instance->fields = instance->inlineFields;
     return instance;
 }
 
+/**
+ * Utility function to create a new, empty ObjList.
+ * @param vm
+ * @return
+ */
+ObjList* newList(VM* vm) {
+    ObjList* list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+    initValueArray(&list->items);
+    return list;
+}
+
 /**
  * Utility function to create a new Native Function.
  * Takes a C function pointer to wrap in an ObjNative. It sets up the object header and stores the function.
+ * @param vm
  * @param function pointer to the native C function.
  * @return
  */
-ObjNative* newNative(NativeFn function) {
-    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjNative* newNative(VM* vm, NativeFn function) {
+    ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
+/**
+ * Utility function to create a new, empty shape.
+ * @param vm
+ * @return
+ */
+ObjShape* newShape(VM* vm) {
+    ObjShape* shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+    shape->fieldCount = 0;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+    return shape;
+}
+
+/**
+ * Finds where a field lives in the field array of instances with the given shape.
+ * @param shape
+ * @param name name of the field.
+ * @return index of the field, or -1 if instances with this shape don't have it.
+ */
+int shapeFieldIndex(ObjShape* shape, ObjString* name) {
+    Value index;
+    if (!tableGet(&shape->slots, name, &index)) return -1;
+    return (int) AS_NUMBER(index);
+}
+
+/**
+ * Gives the shape an instance ends up with once the given field is added to an instance with the given shape.
+ * The new field goes at the end of the field array. Transitions are created the first time they are taken and then
+ * remembered, so every instance that gets the same fields in the same order ends up with the same shape.
+ * @param vm
+ * @param shape current shape of the instance, must not have a field with the given name.
+ * @param name name of the field being added.
+ * @return
+ */
+ObjShape* shapeTransition(VM* vm, ObjShape* shape, ObjString* name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) return AS_SHAPE(next);
+
+    ObjShape* child = newShape(vm);
+    // keep the new shape safe from the GC while its tables get allocated.
+    push(vm, OBJ_VAL(child));
+    tableAddAll(vm, &shape->slots, &child->slots);
+    tableSet(vm, &child->slots, name, NUMBER_VAL(shape->fieldCount));
+    // the child may have survived a collection while its tables were allocated.
+    writeBarrier(vm, (Obj*) child, OBJ_VAL(name));
+    child->fieldCount = shape->fieldCount + 1;
+    tableSet(vm, &shape->transitions, name, OBJ_VAL(child));
+    writeBarrier(vm, (Obj*) shape, OBJ_VAL(child));
+    pop(vm);
+    return child;
+}
+
 /**
  * Performs the heavy lifting for defining a new string. It acts like a constructor in an OOP language.
+ * The characters are copied into the string object itself.
+ * @param vm
  * @param chars
  * @param length
  * @return
  */
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+static ObjString* allocateString(VM* vm, const char* chars, int length, uint32_t hash) {
+    ObjString* string = (ObjString*) allocateObject(vm, sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
     string->hash = hash;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    trackYoungString(vm, string);
 
     // push the ObjString on the stack to keep it safe from the GC's while we add it to the intern table.
     // This ensures the string is safe while the table is being resized.
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
+    // The intern table is a set, the value of each entry holds the hash of the string instead, see tableFindString().
+    push(vm, OBJ_VAL(string));
+    tableSet(vm, &vm->strings, string, NUMBER_VAL(hash));
     // Now that the ObjString is in the table and reachable by the GC - we can pop it off the VM's stack.
-    pop();
+    pop(vm);
 
     return string;
 }
 
 /**
- * Utility function to hash a given string using FNV-1a algorithm.
+ * Utility function to hash a given string.
+ * The characters are read a word (8 bytes) at a time, and each word gets mixed into the hash with a multiplication. That
+ * takes a fraction of the time of a byte at a time hash like FNV-1a on anything but the shortest strings. A final round
+ * of mixing makes sure the low bits of the hash, which pick the buckets of the hash tables, depend on every character.
+ * The hash depends on the byte order of the machine, which is fine since hashes never leave the VM.
  */
 static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t) key[i];
-        hash *= 16777619;
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ (uint64_t) length;
+    int remaining = length;
+    while (remaining >= 8) {
+        uint64_t word;
+        memcpy(&word, key, sizeof(word));
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+        key += 8;
+        remaining -= 8;
     }
-    return hash;
+    if (remaining > 0) {
+        uint64_t word = 0;
+        memcpy(&word, key, remaining);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return (uint32_t) hash;
 }
 
 /**
  * Utility function to allocate a ObjString in the heap, given a char array and it's length.
- * This function takes ownership of the string and passes it into the heap. Because we've already dynamically allocated
- * a character array on the heap, and making a copy of it would be redundant.
+ * This function takes ownership of the array, which has to be allocated with ALLOCATE(), and frees it once the
+ * characters are copied into the string.
+ * @param vm
  * @param chars
  * @param length
  * @return
  */
-ObjString* takeString(char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-
-    // String interning.
-    ObjString* interned = tableFindString(&vm.strings, chars, length,
-                                          hash);
-    if (interned != NULL) {
-        // If we found this string in the table, it means we need to free the newly allocated memory for it (which was passed to this function) - since,
-        // we would be using the interned reference to it anyway.
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
-    }
-    return allocateString(chars, length, hash);
+ObjString* takeString(VM* vm, char* chars, int length) {
+    ObjString* string = copyString(vm, chars, length);
+    FREE_ARRAY(vm, char, chars, length + 1);
+    return string;
 }
 
 /**
@@ -182,33 +291,167 @@ ObjString* takeString(char* chars, int length) {
  * This function assumes that it cannot take ownership of the characters you pass in. Instead, it conservatively creates
  * a copy of the characters on the heap that the ObjString can own.
  * This is the right approach for string literals where the passed-in characters are in the middle of the source string.
+ * @param vm
  * @param chars character array pointing to the string.
  * @param length length of the string.
  * @return ObjString* pointing to a newly allocated string object on the heap.
  */
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM* vm, const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
 
     // String interning.
-    ObjString* interned = tableFindString(&vm.strings, chars, length,
+    ObjString* interned = tableFindString(&vm->strings, chars, length,
                                           hash);
     if (interned != NULL) return interned;
+    return allocateString(vm, chars, length, hash);
+}
 
-    // First we allocate a new array on the heap, just big enough for the string's characters and the trailing terminator
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+/**
+ * Creates a rope, the concatenation of two strings.
+ * @param vm
+ * @param left an ObjString or an ObjRope.
+ * @param right an ObjString or an ObjRope.
+ * @param length sum of the lengths of both.
+ * @return
+ */
+ObjRope* newRope(VM* vm, Obj* left, Obj* right, int length) {
+    ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return rope;
 }
 
-ObjUpvalue* newUpvalue(Value* slot) {
-    ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+/**
+ * A piece of a rope still to be copied, and where its characters go.
+ */
+typedef struct {
+    Obj* piece;
+    int offset;
+} RopePiece;
+
+/**
+ * Copies the characters of a rope into a buffer. Strings built in a loop make ropes as deep as the number of pieces, so
+ * rather than recursing, this follows one of the pieces of each rope and only stacks the other one when both are ropes.
+ * Nothing gets allocated through the GC.
+ * @param rope
+ * @param buffer room for the length of the rope, no terminator gets written.
+ */
+void gatherRope(ObjRope* rope, char* buffer) {
+    RopePiece* stack = NULL;
+    int count = 0;
+    int capacity = 0;
+
+    Obj* piece = (Obj*) rope;
+    int offset = 0;
+    for (;;) {
+        if (piece->type == OBJ_ROPE && ((ObjRope*) piece)->flat != NULL) piece = (Obj*) ((ObjRope*) piece)->flat;
+
+        if (piece->type == OBJ_STRING) {
+            ObjString* string = (ObjString*) piece;
+            memcpy(buffer + offset, string->chars, string->length);
+            if (count == 0) break;
+            piece = stack[--count].piece;
+            offset = stack[count].offset;
+            continue;
+        }
+
+        ObjRope* node = (ObjRope*) piece;
+        int rightOffset = offset + stringLength(node->left);
+        if (node->right->type == OBJ_ROPE && node->left->type == OBJ_ROPE) {
+            if (capacity < count + 1) {
+                capacity = GROW_CAPACITY(capacity);
+                stack = (RopePiece*) realloc(stack, sizeof(RopePiece) * capacity);
+                if (stack == NULL) exit(1);
+            }
+            stack[count++] = (RopePiece) {node->right, rightOffset};
+            piece = node->left;
+        } else if (node->right->type == OBJ_ROPE) {
+            ObjString* left = (ObjString*) node->left;
+            memcpy(buffer + offset, left->chars, left->length);
+            piece = node->right;
+            offset = rightOffset;
+        } else {
+            ObjString* right = (ObjString*) node->right;
+            memcpy(buffer + rightOffset, right->chars, right->length);
+            piece = node->left;
+        }
+    }
+    free(stack);
+}
+
+/**
+ * Flattens a rope: gathers its characters into an interned string, which the rope then stands for. The pieces aren't
+ * needed anymore after that, so the rope lets go of them.
+ * The rope has to be reachable by the GC, since interning the string allocates.
+ * @param vm
+ * @param rope
+ * @return the interned string.
+ */
+ObjString* flattenRope(VM* vm, ObjRope* rope) {
+    if (rope->flat != NULL) return rope->flat;
+
+    // The buffer isn't managed by the GC, it is gone before anything could see it.
+    char* chars = (char*) malloc(rope->length);
+    if (chars == NULL) exit(1);
+    gatherRope(rope, chars);
+    ObjString* string = copyString(vm, chars, rope->length);
+    free(chars);
+
+    rope->flat = string;
+    rope->left = NULL;
+    rope->right = NULL;
+    writeBarrier(vm, (Obj*) rope, OBJ_VAL(string));
+    return string;
+}
+
+ObjUpvalue* newUpvalue(VM* vm, Value* slot) {
+    ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
     upvalue->next = NULL;
+    // The slot is in the stack of the running fiber, which must not go away while the upvalue points there.
+    upvalue->fiber = vm->fiber;
+    writeBarrier(vm, (Obj*) upvalue, OBJ_VAL(vm->fiber));
     return upvalue;
 }
 
+/**
+ * Creates a fiber that calls the given closure the first time it runs. Without a closure, creates the main fiber of a
+ * VM, whose stacks are the ones the VM starts out with.
+ * @param vm
+ * @param closure
+ * @return
+ */
+ObjFiber* newFiber(VM* vm, ObjClosure* closure) {
+    ObjFiber* fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+    fiber->state = closure != NULL ? FIBER_NEW : FIBER_RUNNING;
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = 0;
+    fiber->stack = NULL;
+    fiber->stackCapacity = 0;
+    fiber->stackTop = NULL;
+    fiber->openUpvalues = NULL;
+    fiber->caller = NULL;
+    fiber->transfer = NIL_VAL;
+    fiber->wakeTime = 0;
+    if (closure == NULL) return fiber;
+
+    // Like the VM's own, the stacks aren't managed by the GC: they move between the VM and the fiber at every switch.
+    // The value stack has room for the first call, and the closure sits in its slot zero until then.
+    fiber->frames = (CallFrame*) malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+    fiber->stack = (Value*) malloc(sizeof(Value) * FRAME_STACK_SLOTS);
+    if (fiber->frames == NULL || fiber->stack == NULL) exit(1);
+    fiber->frameCapacity = FRAMES_INITIAL;
+    fiber->stackCapacity = FRAME_STACK_SLOTS;
+    fiber->stack[0] = OBJ_VAL(closure);
+    fiber->stackTop = fiber->stack + 1;
+    writeBarrier(vm, (Obj*) fiber, OBJ_VAL(closure));
+    return fiber;
+}
+
 /**
  * Utility function to print out a function.
  * @param function function object to be printed.
@@ -221,6 +464,52 @@ static void printFunction(ObjFunction* function) {
     printf("<fn %s>", function->name->chars);
 }
 
+/// Deepest nesting of lists printObject() prints. Anything nested deeper is elided, so a deep list can't overflow the C
+/// stack.
+#define PRINT_LIST_DEPTH_MAX 256
+
+/**
+ * A list that is being printed, linked to the list it is an item of. A chain of them lives on the C stack of the
+ * nested printList() calls.
+ */
+typedef struct OpenList {
+    ObjList* list;
+    const struct OpenList* outer;
+    int depth;
+} OpenList;
+
+/**
+ * Prints a list and, recursively, the lists in it. A list that is already being printed further out, one that contains
+ * itself, is printed as "[...]" instead of recursing forever.
+ * @param list
+ * @param outer the lists being printed that this one is nested in, NULL if none.
+ */
+static void printList(ObjList* list, const OpenList* outer) {
+    for (const OpenList* open = outer; open != NULL; open = open->outer) {
+        if (open->list == list) {
+            printf("[...]");
+            return;
+        }
+    }
+    OpenList open = {list, outer, outer == NULL ? 1 : outer->depth + 1};
+    if (open.depth > PRINT_LIST_DEPTH_MAX) {
+        printf("[...]");
+        return;
+    }
+
+    printf("[");
+    for (int i = 0; i < list->items.count; i++) {
+        if (i > 0) printf(", ");
+        Value item = list->items.values[i];
+        if (IS_LIST(item)) {
+            printList(AS_LIST(item), &open);
+        } else {
+            printValue(item);
+        }
+    }
+    printf("]");
+}
+
 /**
  * Utility function to print the value of an Object.
  * @param value
@@ -237,15 +526,38 @@ void printObject(Value value) {
         case OBJ_CLOSURE:
             printFunction(AS_CLOSURE(value)->function);
             break;
+        case OBJ_FIBER:
+            printf("<fiber>");
+            break;
         case OBJ_FUNCTION:
             printFunction(AS_FUNCTION(value));
             break;
         case OBJ_INSTANCE:
             printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
             break;
+        case OBJ_LIST:
+            printList(AS_LIST(value), NULL);
+            break;
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
+        case OBJ_ROPE: {
+            ObjRope* rope = AS_ROPE(value);
+            if (rope->flat != NULL) {
+                printf("%s", rope->flat->chars);
+                break;
+            }
+            // Printing must not trigger a collection, the value being printed may not be reachable anymore.
+            char* chars = (char*) malloc(rope->length);
+            if (chars == NULL) exit(1);
+            gatherRope(rope, chars);
+            fwrite(chars, 1, rope->length, stdout);
+            free(chars);
+            break;
+        }
+        case OBJ_SHAPE:
+            printf("shape");
+            break;
         case OBJ_STRING:
             printf("%s", AS_CSTRING(value));
             break;
@@ -253,4 +565,38 @@ void printObject(Value value) {
             printf("upvalue");
             break;
     }
-}
\ No newline at end of file
+}
+/**
+ * Returns the name of a kind of object, as used by the GC statistics.
+ * @param type
+ * @return
+ */
+const char* objTypeName(ObjType type) {
+    switch (type) {
+        case OBJ_BOUND_METHOD:
+            return "boundMethod";
+        case OBJ_CLASS:
+            return "class";
+        case OBJ_CLOSURE:
+            return "closure";
+        case OBJ_FIBER:
+            return "fiber";
+        case OBJ_FUNCTION:
+            return "function";
+        case OBJ_INSTANCE:
+            return "instance";
+        case OBJ_LIST:
+            return "list";
+        case OBJ_NATIVE:
+            return "native";
+        case OBJ_ROPE:
+            return "rope";
+        case OBJ_SHAPE:
+            return "shape";
+        case OBJ_STRING:
+            return "string";
+        case OBJ_UPVALUE:
+            return "upvalue";
+    }
+    return "unknown";
+}
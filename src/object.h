@@ -23,9 +23,13 @@
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value)     isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)   isObjType(value, OBJ_CLOSURE)
+#define IS_FIBER(value)     isObjType(value, OBJ_FIBER)
 #define IS_FUNCTION(value)  isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value)      isObjType(value, OBJ_LIST)
 #define IS_NATIVE(value)    isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value)      isObjType(value, OBJ_ROPE)
+#define IS_SHAPE(value)     isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)    isObjType(value, OBJ_STRING)
 
 /**
@@ -34,9 +38,13 @@
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
+#define AS_FIBER(value)        ((ObjFiber*)AS_OBJ(value))
 #define AS_FUNCTION(value)  ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
+#define AS_LIST(value)      ((ObjList*)AS_OBJ(value))
 #define AS_NATIVE(value)    (((ObjNative*)AS_OBJ(value))->function)
+#define AS_ROPE(value)      ((ObjRope*)AS_OBJ(value))
+#define AS_SHAPE(value)     ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value)    ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)   (((ObjString*)AS_OBJ(value))->chars)
 /**
@@ -46,23 +54,29 @@ typedef enum {
     OBJ_BOUND_METHOD,
     OBJ_CLASS,
     OBJ_CLOSURE,
+    OBJ_FIBER,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
+    OBJ_LIST,
     OBJ_NATIVE,
+    OBJ_ROPE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE
 } ObjType;
 
+/// Number of different kinds of objects, has to follow the last of the ObjType enums.
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
 /**
  * This struct acts sort of like a base class for the different kinds of objects that are supported in Tok.
  */
 struct Obj {
     // Type of Object.
     ObjType type;
-    // field to denote if the Object still has a reference in the code. True if references are present, false otherwise.
-    bool isMarked;
-    // Pointer to the next object in the chain.
-    struct Obj* next;
+    // true while the object is in the GC's remembered set.
+    // The mark bit lives in a bitmap of the page the object was allocated in, see HeapPage.
+    bool isRemembered;
 };
 
 /**
@@ -73,17 +87,37 @@ typedef struct {
     // number of parameters a function expects.
     int arity;
     int upvalueCount;
+    // largest number of value stack slots the code of the function uses, counting from the callee in the frame's first
+    // slot, as worked out by stackDepth(). call() makes sure the stack has that much room.
+    int maxSlots;
     Chunk chunk;
     // we store the function name as well, handy for reporting errors.
     ObjString* name;
+    // A function without upvalues gets the same closure every time its declaration runs, since all such closures would
+    // be alike. It's created the first time it's needed, NULL until then.
+    struct ObjClosure* closure;
+    // Source of a function whose body is compiled the first time it's called, NULL once it has been compiled. Such a
+    // function has an arity of -1 until then, so the arity check sends its first call to the compiler.
+    ObjString* lazySource;
+    // offset in lazySource of the '(' the parameter list starts at, and the line it is on.
+    int lazyStart;
+    int lazyLine;
+    // kind of function the body gets compiled as, one of the compiler's FunctionType.
+    uint8_t lazyType;
+#ifdef JIT
+    // machine code of the function, or NULL while it is interpreted.
+    struct JitCode* jit;
+    // number of calls and loop iterations so far, which tells when the function is worth compiling.
+    int hotness;
+#endif
 } ObjFunction;
 
 /**
- * Defines NativeFn as a type, which takes two arguments(int, Value*) and returns a Value.
- * NativeFn takes an argument count, and a pointer to the first argument on the stack.
+ * Defines NativeFn as a type, which takes three arguments(VM*, int, Value*) and returns a Value.
+ * NativeFn takes the VM calling it, an argument count, and a pointer to the first argument on the stack.
  * It accesses the arguments through this pointer. Once done, it returns the result value.
  */
-typedef Value (* NativeFn)(int argCount, Value* args);
+typedef Value (* NativeFn)(VM* vm, int argCount, Value* args);
 
 /**
  * Struct to handle native functions
@@ -96,7 +130,8 @@ typedef struct {
 
 /**
  * Defines a String object, that internally makes use of the Obj struct to define object related information.
- * A string object contains an array of characters. Those are stored in a separate, heap allocated array.
+ * A string object contains an array of characters. Those are stored inline, right after the other fields, in the same
+ * allocation as the object itself.
  * We also store the number of bytes in the array - it isn't strictly necessary but it lets us tell how much memory is
  * allocated for the string without walking the array to find the null terminator.
  * Also caches the hash for the string, helps in optimizing hash table lookups. Since strings are immutable in Tok,
@@ -112,10 +147,34 @@ typedef struct {
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
     uint32_t hash;
+    char chars[];
 };
 
+/// Concatenations shorter than this are flattened right away. Copying a few bytes is cheaper than a rope, and the
+/// result gets interned like any other string.
+#define ROPE_MIN_LENGTH 64
+
+/**
+ * A string made by concatenating two others, either of which may be a rope itself. Building a string piece by piece
+ * would copy all of it on every concatenation otherwise. The rope only gathers the characters of its pieces, and interns
+ * the result, once the string is compared or its characters are needed.
+ * Every string with the same characters is still the same interned ObjString, the ropes are the exception: code that
+ * relies on that has to flatten them first.
+ */
+typedef struct {
+    Obj obj;
+    int length;
+    // the two pieces, each either an ObjString or an ObjRope. They are let go once the rope is flattened.
+    Obj* left;
+    Obj* right;
+    // the interned string with the characters of the rope, once it has been flattened.
+    ObjString* flat;
+} ObjRope;
+
+/// Checks whether a value is a string, in either representation.
+#define IS_STRING_OR_ROPE(value) (IS_STRING(value) || IS_ROPE(value))
+
 /**
  * Runtime representation of an Upvalue.
  */
@@ -128,21 +187,85 @@ typedef struct ObjUpvalue {
     Value closed;
     // pointer to the next upvalue in the list of upvalues.
     struct ObjUpvalue* next;
+    // fiber whose stack the upvalue points into while it is open, which the upvalue keeps alive. NULL once closed.
+    struct ObjFiber* fiber;
 } ObjUpvalue;
 
 /**
  * Every ObjFunction is wrapped in an ObjClosure, even if the function doesn't actually close over and capture any surrounding
- * local variables.
+ * local variables. Those that don't all share one closure, see ObjFunction.closure.
  */
-typedef struct {
+typedef struct ObjClosure {
     Obj obj;
     ObjFunction* function;
-    // pointer to a dynamically allocated array of pointers to upvalues. We also store the number of elements in the array.
-    ObjUpvalue** upvalues;
     // number of elements in the upvalues array.
     int upvalueCount;
+    // pointers to the upvalues the closure captures. They're stored right inside the closure, so creating one takes a
+    // single allocation.
+    ObjUpvalue* upvalues[];
 } ObjClosure;
 
+/**
+ * What a fiber is up to.
+ */
+typedef enum {
+    // created, its function hasn't been called yet.
+    FIBER_NEW,
+    // running, or waiting for the fiber it resumed to yield.
+    FIBER_RUNNING,
+    // stopped at a yield, until it gets resumed.
+    FIBER_SUSPENDED,
+    // in the hands of the scheduler, ready to run or waiting for a timer or for input.
+    FIBER_SCHEDULED,
+    // its function returned, or a runtime error stopped it.
+    FIBER_DONE
+} FiberState;
+
+/**
+ * A fiber runs a function with a call stack and a value stack of its own, so that it can stop in the middle of it and
+ * carry on later, while other fibers run. Only one fiber runs at a time: the VM's frames and stack are those of the
+ * running fiber, and switching to another one swaps them, see switchFiber(). The code of the script runs in the VM's
+ * main fiber.
+ */
+typedef struct ObjFiber {
+    Obj obj;
+    FiberState state;
+    // call stack, value stack and open upvalues of the fiber while it isn't running. The VM holds on to them while it
+    // is, and these are NULL then.
+    struct CallFrame* frames;
+    int frameCount;
+    int frameCapacity;
+    Value* stack;
+    int stackCapacity;
+    Value* stackTop;
+    ObjUpvalue* openUpvalues;
+    // fiber that resumed this one, which gets the control back when this one yields or returns. NULL for the fibers
+    // the scheduler runs.
+    struct ObjFiber* caller;
+    // value the fiber carries on with once the scheduler runs it again, the result of the native it waited in.
+    Value transfer;
+    // time the fiber wakes up at, while it sleeps.
+    double wakeTime;
+} ObjFiber;
+
+/**
+ * A shape (also known as a hidden class) describes the layout of an instance's fields: which fields it has, and where in
+ * the instance's field array each of them lives.
+ * Instances that got the same fields added in the same order share a single shape, so the field names and their hash
+ * table are stored once per shape rather than once per instance. Each shape also knows the shapes that adding one more
+ * field leads to. Starting from the empty root shape of a class, these transitions form a tree covering every layout
+ * the instances of that class have had.
+ */
+typedef struct ObjShape {
+    Obj obj;
+    // number of fields an instance with this shape has.
+    int fieldCount;
+    // maps each field name to its index in the instance's field array.
+    Table slots;
+    // maps a field name to the shape an instance ends up with when that field is added to it.
+    Table transitions;
+} ObjShape;
+
 /**
  * Runtime representation of a Ctok Class.
  */
@@ -152,6 +275,10 @@ typedef struct {
     ObjString* name;
     // Hash table of methods on the object. Keys are the method names, and each value is an ObjClosure for the body of the method.
     Table methods;
+    // Shape of a freshly created instance, with no fields. Root of the class's shape tree.
+    ObjShape* rootShape;
+    // Largest number of fields an instance of this class has had, used to size the storage of new instances.
+    int fieldCountHint;
 } ObjClass;
 
 /**
@@ -161,10 +288,25 @@ typedef struct {
     Obj obj;
     // Pointer to the class that the instance is an instance of
     ObjClass* klass;
-    // Hash table to store the fields on an instance.
-    Table fields;
+    // Describes which fields the instance has and where they are stored.
+    ObjShape* shape;
+    // Number of values the fields array has room for.
+    int capacity;
+    // Number of values allocated inline, right after the instance itself.
+    int inlineCapacity;
+    // The field values, in the order given by the shape. Points at inlineFields unless the instance outgrew them.
+    Value* fields;
+    Value inlineFields[];
 } ObjInstance;
 
+/**
+ * Runtime representation of a list, the values of which are stored next to each other in a growable array.
+ */
+typedef struct {
+    Obj obj;
+    ValueArray items;
+} ObjList;
+
 /**
  * Runtime type to wrap a receiver (class instance) and a method closure together.
  */
@@ -176,28 +318,55 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method);
+
+ObjClass* newClass(VM* vm, ObjString* name);
+
+ObjClosure* newClosure(VM* vm, ObjFunction* function);
+
+ObjFunction* newFunction(VM* vm);
 
-ObjClass* newClass(ObjString* name);
+ObjInstance* newInstance(VM* vm, ObjClass* klass);
 
-ObjClosure* newClosure(ObjFunction* function);
+ObjList* newList(VM* vm);
 
-ObjFunction* newFunction();
+ObjNative* newNative(VM* vm, NativeFn function);
 
-ObjInstance* newInstance(ObjClass* klass);
+ObjShape* newShape(VM* vm);
 
-ObjNative* newNative(NativeFn function);
+int shapeFieldIndex(ObjShape* shape, ObjString* name);
 
-ObjString* takeString(char* chars, int length);
+ObjShape* shapeTransition(VM* vm, ObjShape* shape, ObjString* name);
 
-ObjString* copyString(const char* chars, int length);
+ObjString* takeString(VM* vm, char* chars, int length);
 
-ObjUpvalue* newUpvalue(Value* slot);
+ObjString* copyString(VM* vm, const char* chars, int length);
+
+ObjRope* newRope(VM* vm, Obj* left, Obj* right, int length);
+
+void gatherRope(ObjRope* rope, char* buffer);
+
+ObjString* flattenRope(VM* vm, ObjRope* rope);
+
+ObjUpvalue* newUpvalue(VM* vm, Value* slot);
+
+ObjFiber* newFiber(VM* vm, ObjClosure* closure);
 
 void printObject(Value value);
 
+const char* objTypeName(ObjType type);
+
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+/**
+ * Returns the length of a string, in either representation.
+ * @param string an ObjString or an ObjRope.
+ * @return
+ */
+static inline int stringLength(Obj* string) {
+    return string->type == OBJ_STRING ? ((ObjString*) string)->length : ((ObjRope*) string)->length;
+}
+
 #endif //CTOK_OBJECT_H
@@ -0,0 +1,250 @@
+//
+// Sampling profiler.
+//
+// A timer on the CPU time of the process sets profilerTick, and the interpreter takes a sample the next time it gets to
+// a call, a return or a loop iteration. A sample is the stack of the frames that are running, from the script on in,
+// each as the name of its function and the line it is at. Identical stacks are counted together, and the profile is
+// written in the collapsed stack format flame graph tools read: one stack per line, the frames separated by ';' and
+// followed by the number of samples, as in "script:12;outer:3;inner:7 42".
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
+#include "object.h"
+#include "profiler.h"
+#include "vm.h"
+
+volatile sig_atomic_t profilerTick = 0;
+
+/// The VM the timer takes samples for.
+static VM* profiledVM = NULL;
+
+/**
+ * A distinct call stack, and the number of samples that found the program in it.
+ */
+typedef struct {
+    char* stack;
+    uint32_t hash;
+    size_t samples;
+} ProfileEntry;
+
+/**
+ * State of the profiler of a VM.
+ */
+struct Profiler {
+    /// Hash table of the stacks sampled so far, with open addressing and linear probing.
+    ProfileEntry* entries;
+    int count;
+    int capacity;
+    /// The stack of the sample being taken.
+    char* buffer;
+    size_t length;
+    size_t bufferCapacity;
+    /// Whether the buffer couldn't grow for the sample being taken, which drops it.
+    bool failed;
+};
+
+#ifndef _WIN32
+
+static void onProfilerTimer(int signal) {
+    (void) signal;
+    profilerTick = 1;
+}
+
+#endif
+
+/**
+ * Starts profiling the given VM until stopProfiler().
+ * @param vm
+ * @return false if profiling isn't supported here, or another VM is being profiled already.
+ */
+bool startProfiler(VM* vm) {
+#ifdef _WIN32
+    (void) vm;
+    return false;
+#else
+    if (profiledVM != NULL) return false;
+    Profiler* profiler = (Profiler*) calloc(1, sizeof(Profiler));
+    if (profiler == NULL) return false;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onProfilerTimer;
+    sigemptyset(&action.sa_mask);
+    // Natives blocked in a system call when the timer goes off carry on as if nothing happened.
+    action.sa_flags = SA_RESTART;
+    struct itimerval timer = {{0, PROFILE_INTERVAL_USEC}, {0, PROFILE_INTERVAL_USEC}};
+    if (sigaction(SIGPROF, &action, NULL) != 0 || setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        free(profiler);
+        return false;
+    }
+
+    profilerTick = 0;
+    vm->profiler = profiler;
+    profiledVM = vm;
+    return true;
+#endif
+}
+
+/**
+ * Appends some characters to the stack of the sample being taken.
+ */
+static void appendStack(Profiler* profiler, const char* chars, size_t length) {
+    if (profiler->failed) return;
+    if (profiler->length + length + 1 > profiler->bufferCapacity) {
+        size_t capacity = profiler->bufferCapacity < 256 ? 256 : profiler->bufferCapacity;
+        while (capacity < profiler->length + length + 1) capacity *= 2;
+        char* buffer = (char*) realloc(profiler->buffer, capacity);
+        if (buffer == NULL) {
+            profiler->failed = true;
+            return;
+        }
+        profiler->buffer = buffer;
+        profiler->bufferCapacity = capacity;
+    }
+    memcpy(profiler->buffer + profiler->length, chars, length);
+    profiler->length += length;
+    profiler->buffer[profiler->length] = '\0';
+}
+
+/**
+ * Utility function to hash a stack, with FNV-1a.
+ */
+static uint32_t hashStack(const char* stack, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t) stack[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/**
+ * Finds the entry of a stack, or the empty entry it would go in.
+ */
+static ProfileEntry* findEntry(ProfileEntry* entries, int capacity, const char* stack, uint32_t hash) {
+    uint32_t index = hash & (uint32_t) (capacity - 1);
+    for (;;) {
+        ProfileEntry* entry = &entries[index];
+        if (entry->stack == NULL || (entry->hash == hash && strcmp(entry->stack, stack) == 0)) return entry;
+        index = (index + 1) & (uint32_t) (capacity - 1);
+    }
+}
+
+/**
+ * Counts a sample of the stack in the profiler's buffer.
+ */
+static void countSample(Profiler* profiler) {
+    if (profiler->count + 1 > profiler->capacity * 3 / 4) {
+        int capacity = profiler->capacity < 64 ? 64 : profiler->capacity * 2;
+        ProfileEntry* entries = (ProfileEntry*) calloc((size_t) capacity, sizeof(ProfileEntry));
+        if (entries == NULL) return;
+        for (int i = 0; i < profiler->capacity; i++) {
+            ProfileEntry* entry = &profiler->entries[i];
+            if (entry->stack != NULL) *findEntry(entries, capacity, entry->stack, entry->hash) = *entry;
+        }
+        free(profiler->entries);
+        profiler->entries = entries;
+        profiler->capacity = capacity;
+    }
+
+    uint32_t hash = hashStack(profiler->buffer, profiler->length);
+    ProfileEntry* entry = findEntry(profiler->entries, profiler->capacity, profiler->buffer, hash);
+    if (entry->stack == NULL) {
+        char* stack = (char*) malloc(profiler->length + 1);
+        if (stack == NULL) return;
+        memcpy(stack, profiler->buffer, profiler->length + 1);
+        entry->stack = stack;
+        entry->hash = hash;
+        entry->samples = 0;
+        profiler->count++;
+    }
+    entry->samples++;
+}
+
+/**
+ * Takes a sample of the call stack of the VM. The ip of every frame has to be up to date, pointing past the instruction
+ * the frame is at.
+ * @param vm
+ */
+void sampleProfile(VM* vm) {
+    // The tick may be for another VM, which is the one to take the sample then.
+    Profiler* profiler = vm->profiler;
+    if (profiler == NULL) return;
+    profilerTick = 0;
+    profiler->length = 0;
+    profiler->failed = false;
+
+    int first = 0;
+    if (vm->frameCount > PROFILE_FRAMES_MAX) {
+        first = vm->frameCount - PROFILE_FRAMES_MAX;
+        appendStack(profiler, "[...];", 6);
+    }
+    for (int i = first; i < vm->frameCount; i++) {
+        ObjFunction* function = vm->frames[i].closure->function;
+        int line = getLine(&function->chunk, (int) (vm->frames[i].ip - function->chunk.code - 1));
+        if (function->name == NULL) {
+            appendStack(profiler, "script", 6);
+        } else {
+            appendStack(profiler, function->name->chars, (size_t) function->name->length);
+        }
+        char location[16];
+        int length = snprintf(location, sizeof(location), i == vm->frameCount - 1 ? ":%d" : ":%d;", line);
+        appendStack(profiler, location, (size_t) length);
+    }
+    // A sample that doesn't fit in memory is dropped.
+    if (!profiler->failed && profiler->length > 0) countSample(profiler);
+}
+
+static int compareEntries(const void* a, const void* b) {
+    return strcmp((*(const ProfileEntry* const*) a)->stack, (*(const ProfileEntry* const*) b)->stack);
+}
+
+/**
+ * Writes the samples taken so far in the collapsed stack format, sorted by stack.
+ * @param vm
+ * @param file
+ * @return false if the profile couldn't be written.
+ */
+bool writeProfile(VM* vm, FILE* file) {
+    Profiler* profiler = vm->profiler;
+    if (profiler == NULL) return false;
+    ProfileEntry** sorted = (ProfileEntry**) malloc(sizeof(ProfileEntry*) * (size_t) (profiler->count + 1));
+    if (sorted == NULL) return false;
+    int count = 0;
+    for (int i = 0; i < profiler->capacity; i++) {
+        if (profiler->entries[i].stack != NULL) sorted[count++] = &profiler->entries[i];
+    }
+    qsort(sorted, (size_t) count, sizeof(ProfileEntry*), compareEntries);
+    for (int i = 0; i < count; i++) fprintf(file, "%s %zu\n", sorted[i]->stack, sorted[i]->samples);
+    free(sorted);
+    return !ferror(file);
+}
+
+/**
+ * Stops profiling the VM, if it is being profiled, and throws away the samples.
+ * @param vm
+ */
+void stopProfiler(VM* vm) {
+    Profiler* profiler = vm->profiler;
+    if (profiler == NULL) return;
+#ifndef _WIN32
+    struct itimerval timer = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    // A signal that is still pending would terminate the process otherwise.
+    signal(SIGPROF, SIG_IGN);
+#endif
+    profilerTick = 0;
+    profiledVM = NULL;
+
+    for (int i = 0; i < profiler->capacity; i++) free(profiler->entries[i].stack);
+    free(profiler->entries);
+    free(profiler->buffer);
+    free(profiler);
+    vm->profiler = NULL;
+}
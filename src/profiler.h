@@ -0,0 +1,36 @@
+//
+// Sampling profiler: records the call stack of the running program every so often, for --profile.
+//
+
+#ifndef CTOK_PROFILER_H
+#define CTOK_PROFILER_H
+
+#include <signal.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "value.h"
+
+/// Interval of the profiler's timer, in microseconds of CPU time. The system may round it up to its clock tick.
+#define PROFILE_INTERVAL_USEC 1000
+/// Maximum number of frames a sample records. Deeper stacks keep their innermost frames.
+#define PROFILE_FRAMES_MAX 128
+
+/**
+ * Set by the profiler's timer whenever it's time to take a sample. The interpreter checks it at calls, returns and loop
+ * iterations, which keeps the cost of profiling to a load and a branch there, and samples at the next such point.
+ * There is only one timer per process, so only one VM can be profiled at a time.
+ */
+extern volatile sig_atomic_t profilerTick;
+
+typedef struct Profiler Profiler;
+
+bool startProfiler(VM* vm);
+
+void sampleProfile(VM* vm);
+
+bool writeProfile(VM* vm, FILE* file);
+
+void stopProfiler(VM* vm);
+
+#endif //CTOK_PROFILER_H
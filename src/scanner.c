@@ -17,12 +17,21 @@ typedef struct {
     int line;
 } Scanner;
 
-Scanner scanner;
+static THREAD_LOCAL Scanner scanner;
 
 void initScanner(const char* source) {
+    initScannerAt(source, 1);
+}
+
+/**
+ * Starts scanning somewhere in the middle of a source, as for the body of a function that gets compiled lazily.
+ * @param source first character to scan.
+ * @param line line that character is on.
+ */
+void initScannerAt(const char* source, int line) {
     scanner.start = source;
     scanner.current = source;
-    scanner.line = 1;
+    scanner.line = line;
 }
 
 /**
@@ -195,7 +204,16 @@ static TokenType identifierType() {
         case 'p':
             return checkKeyword(1, 4, "rint", TOKEN_PRINT);
         case 'r':
-            return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+            // "return" and "resume" only part ways at the third character.
+            if (scanner.current - scanner.start > 2 && scanner.start[1] == 'e') {
+                switch (scanner.start[2]) {
+                    case 't':
+                        return checkKeyword(3, 3, "urn", TOKEN_RETURN);
+                    case 's':
+                        return checkKeyword(3, 3, "ume", TOKEN_RESUME);
+                }
+            }
+            break;
         case 's':
             return checkKeyword(1, 4, "uper", TOKEN_SUPER);
         case 't':
@@ -212,6 +230,8 @@ static TokenType identifierType() {
             return checkKeyword(1, 2, "ar", TOKEN_VAR);
         case 'w':
             return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+        case 'y':
+            return checkKeyword(1, 4, "ield", TOKEN_YIELD);
     }
     return TOKEN_IDENTIFIER;
 }
@@ -287,6 +307,10 @@ Token scanToken() {
             return makeToken(TOKEN_LEFT_BRACE);
         case '}':
             return makeToken(TOKEN_RIGHT_BRACE);
+        case '[':
+            return makeToken(TOKEN_LEFT_BRACKET);
+        case ']':
+            return makeToken(TOKEN_RIGHT_BRACKET);
         case ';':
             return makeToken(TOKEN_SEMICOLON);
         case ',':
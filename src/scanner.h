@@ -12,6 +12,7 @@ typedef enum {
     // Single-character tokens.
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+    TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
     TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
     TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
     // One or two character tokens.
@@ -26,6 +27,7 @@ typedef enum {
     TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
     TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
     TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
+    TOKEN_YIELD, TOKEN_RESUME,
 
     TOKEN_ERROR, TOKEN_EOF
 } TokenType;
@@ -48,6 +50,8 @@ typedef struct {
 
 void initScanner(const char* source);
 
+void initScannerAt(const char* source, int line);
+
 Token scanToken();
 
 #endif //CTOK_SCANNER_H
@@ -10,8 +10,148 @@
 #include "table.h"
 #include "value.h"
 
-// Defines the load factor for the hash table.
-#define TABLE_MAX_LOAD 0.75
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+/// Control byte of an empty slot.
+#define CONTROL_EMPTY 0x80
+/// Control byte of a slot holding a deleted entry. Full slots have the high bit clear, the other two have it set.
+#define CONTROL_DELETED 0xfe
+
+/**
+ * A group of control bytes is scanned in one go, with SSE2 where we have it, and as a 64 bit word otherwise. Matching a
+ * group gives a mask with a bit for each matching control byte.
+ */
+#if defined(__SSE2__) || defined(_M_X64)
+
+#define GROUP_WIDTH 16
+
+typedef uint32_t GroupMask;
+
+/**
+ * Finds the control bytes of a group that are equal to a given byte.
+ * @param group
+ * @param byte
+ * @return
+ */
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*) group);
+    return (GroupMask) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char) byte)));
+}
+
+/**
+ * Finds the empty slots of a group.
+ * @param group
+ * @return
+ */
+static inline GroupMask matchEmpty(const uint8_t* group) {
+    return matchByte(group, CONTROL_EMPTY);
+}
+
+/**
+ * Finds the slots of a group that are empty or hold a deleted entry.
+ * @param group
+ * @return
+ */
+static inline GroupMask matchFree(const uint8_t* group) {
+    return (GroupMask) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) group));
+}
+
+#else
+
+#define GROUP_WIDTH 8
+
+typedef uint64_t GroupMask;
+
+#define LOW_BITS 0x0101010101010101ull
+#define HIGH_BITS 0x8080808080808080ull
+
+/**
+ * Loads a group of control bytes as a word, with the first one in the lowest byte.
+ * @param group
+ * @return
+ */
+static inline uint64_t loadGroup(const uint8_t* group) {
+    uint64_t word;
+    memcpy(&word, group, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/**
+ * Finds the control bytes of a group that are equal to a given byte. This can also report a byte right after a
+ * matching one, the keys are compared anyway.
+ * @param group
+ * @param byte
+ * @return
+ */
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+    uint64_t word = loadGroup(group) ^ (LOW_BITS * byte);
+    return (word - LOW_BITS) & ~word & HIGH_BITS;
+}
+
+/**
+ * Finds the empty slots of a group. Unlike matchByte() this is exact: an empty byte is the only one with the high bit
+ * set and the second lowest bit clear.
+ * @param group
+ * @return
+ */
+static inline GroupMask matchEmpty(const uint8_t* group) {
+    uint64_t word = loadGroup(group);
+    return word & ~(word << 6) & HIGH_BITS;
+}
+
+/**
+ * Finds the slots of a group that are empty or hold a deleted entry.
+ * @param group
+ * @return
+ */
+static inline GroupMask matchFree(const uint8_t* group) {
+    return loadGroup(group) & HIGH_BITS;
+}
+
+#endif
+
+/**
+ * Returns the offset in its group of the slot of the lowest bit in a mask.
+ * @param mask must not be 0.
+ * @return
+ */
+static inline int maskIndex(GroupMask mask) {
+    int bit = 0;
+#if defined(__GNUC__) || defined(__clang__)
+    bit = (int) __builtin_ctzll((unsigned long long) mask);
+#else
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        bit++;
+    }
+#endif
+    // The word at a time version has a bit per byte, the high one.
+    return GROUP_WIDTH == 16 ? bit : bit / 8;
+}
+
+/**
+ * Returns the maximum number of slots that can be full or deleted in a table of the given capacity. At least one slot
+ * stays empty, so every probe sequence comes to an end.
+ * @param capacity
+ * @return
+ */
+static inline int maxLoad(int capacity) {
+    return capacity - capacity / 8;
+}
+
+/**
+ * Returns the size of the single allocation holding the values, keys and control bytes of a table.
+ * @param capacity
+ * @return
+ */
+static inline size_t tableSize(int capacity) {
+    return (sizeof(Value) + sizeof(ObjString*)) * capacity + capacity + GROUP_WIDTH;
+}
 
 /**
  * Utility function to initialize an empty hash table.
@@ -19,61 +159,80 @@
  */
 void initTable(Table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
-    table->entries = NULL;
+    table->control = NULL;
+    table->keys = NULL;
+    table->values = NULL;
 }
 
 /**
  * Utility function to free up the hash table from the memory.
- * We mainly only need to free up the entries array, the rest of the data structure is just re-initialized to default state.
+ * All the arrays of the table are part of a single allocation, which starts with the values. The rest of the data
+ * structure is just re-initialized to default state.
+ * @param vm
  * @param table
  */
-void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM* vm, Table* table) {
+    if (table->capacity > 0) FREE_ARRAY(vm, uint8_t, (uint8_t*) table->values, tableSize(table->capacity));
     initTable(table);
 }
 
 /**
- * Utility function to fetch the corresponding bucket to a given key in the hashmap.
- * Uses linear probing to handle collisions.
- *
- * Design Note (Handling Tombstones):
- * If we reach a truly empty entry, then the key isn’t present.
- * In that case, if we have passed a tombstone, we return its bucket instead of the later empty one.
- * If we’re calling findEntry() in order to insert a node, that lets us treat the tombstone bucket as empty and
- * reuse it for the new entry. Reusing tombstone slots automatically like this helps reduce the number of tombstones wasting space in the bucket array.
- * @param entries
- * @param capacity
+ * Sets the control byte of a slot. The copies of the first control bytes, past the end of the array, are kept in sync.
+ * In a table smaller than a group a slot has several of those.
+ * @param table
+ * @param index
+ * @param control
+ */
+static inline void setControl(Table* table, int index, uint8_t control) {
+    table->control[index] = control;
+    for (int copy = index + table->capacity; copy < table->capacity + GROUP_WIDTH; copy += table->capacity) {
+        table->control[copy] = control;
+    }
+}
+
+/**
+ * Utility function to find the slot of a given key in a table.
+ * The probe sequence starts at the slot the hash of the key points to, and goes through the table a group at a time,
+ * jumping one group further each time, which visits every group once. Only the slots whose control byte matches the
+ * 7 bits of the hash get their key compared. Reaching a group with an empty slot means the key isn't present, since
+ * it would have been put in that slot otherwise.
+ * @param table
  * @param key
- * @return
+ * @return index of the slot, -1 if the key isn't in the table.
  */
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    // uint32_t index = key->hash % capacity;
-    // Optimized way to get the mod. We know our table's capacity is always a power of 2 - so we rather than using %
-    // we can simply do a bitwise AND of the number and the (divisor - 1), where divisor is the table capacity.
-    uint32_t index = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
-
-    for (;;) {
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone.
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // We found the key.
-            return entry;
-        }
+static int findSlot(Table* table, ObjString* key) {
+    uint32_t mask = (uint32_t) table->capacity - 1;
+    uint32_t position = (key->hash >> 7) & mask;
+    uint8_t fragment = key->hash & 0x7f;
 
-        // index = (index + 1) % capacity;
-        // Optimization (same as above)
-        index = (index + 1) & (capacity - 1);
+    for (uint32_t stride = GROUP_WIDTH;; stride += GROUP_WIDTH) {
+        const uint8_t* group = table->control + position;
+        for (GroupMask match = matchByte(group, fragment); match != 0; match &= match - 1) {
+            uint32_t index = (position + maskIndex(match)) & mask;
+            if (table->keys[index] == key) return (int) index;
+        }
+        if (matchEmpty(group) != 0) return -1;
+        position = (position + stride) & mask;
     }
+}
+
+/**
+ * Finds the first slot along the probe sequence of a hash that is empty or holds a deleted entry, for a new entry to go in.
+ * @param table
+ * @param hash
+ * @return
+ */
+static int findFreeSlot(Table* table, uint32_t hash) {
+    uint32_t mask = (uint32_t) table->capacity - 1;
+    uint32_t position = (hash >> 7) & mask;
 
+    for (uint32_t stride = GROUP_WIDTH;; stride += GROUP_WIDTH) {
+        GroupMask match = matchFree(table->control + position);
+        if (match != 0) return (int) ((position + maskIndex(match)) & mask);
+        position = (position + stride) & mask;
+    }
 }
 
 /**
@@ -87,74 +246,96 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int index = findSlot(table, key);
+    if (index == -1) return false;
 
-    *value = entry->value;
+    *value = table->values[index];
     return true;
 }
 
 /**
- * Utility function to allocate a fresh entries array for a new hash table, and also to adjust entries in an existing
- * hash table when growing its size.
+ * Utility function to allocate fresh arrays for a new hash table, and also to move the entries of an existing hash table
+ * over into them when growing its size. The deleted entries are left behind.
+ * @param vm
  * @param table
  * @param capacity
  */
-static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; ++i) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
-
-    table->count = 0;
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
+    Table resized;
+    resized.count = 0;
+    resized.tombstones = 0;
+    resized.capacity = capacity;
+    resized.values = (Value*) ALLOCATE(vm, uint8_t, tableSize(capacity));
+    resized.keys = (ObjString**) (resized.values + capacity);
+    resized.control = (uint8_t*) (resized.keys + capacity);
+    memset(resized.control, CONTROL_EMPTY, capacity + GROUP_WIDTH);
 
-    // Rehashing the non-null entries in the old hash table to adjust them into the new table.
+    // Rehashing the entries of the old hash table into the new one.
     for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
-
-        // we pass the new array into findEntry to store the values into this newly allocated array.
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
-    }
+        if (table->control[i] & 0x80) continue;
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+        ObjString* key = table->keys[i];
+        int index = findFreeSlot(&resized, key->hash);
+        setControl(&resized, index, key->hash & 0x7f);
+        resized.keys[index] = key;
+        resized.values[index] = table->values[i];
+        resized.count++;
+    }
 
-    table->entries = entries;
-    table->capacity = capacity;
+    freeTable(vm, table);
+    *table = resized;
 }
 
 /**
  * Utility function to set add/replace a key/value pair in a hash table.
+ * @param vm
  * @param table pointer to the table instance.
  * @param key key of the key/value pair to be stored.
  * @param value value to be stored at the given key.
  * @return Returns true if a new entry was added, returns false if the key already existed and only the value was replaced.
  */
-bool tableSet(Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
+    if (table->count > 0) {
+        int index = findSlot(table, key);
+        if (index != -1) {
+            table->values[index] = value;
+            return false;
+        }
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
+    // The deleted entries count towards the load, since they keep probe sequences just as long. If they are what makes
+    // the table full, rehashing it at the same size gets rid of them.
+    if (table->count + table->tombstones + 1 > maxLoad(table->capacity)) {
+        int capacity = table->count + 1 > maxLoad(table->capacity) / 2 ? GROW_CAPACITY(table->capacity)
+                                                                        : table->capacity;
+        adjustCapacity(vm, table, capacity);
+    }
 
-    // We increment the count during insertion only if the new entry goes into an entirely empty bucket.
-    // If we are replacing a tombstone with a new entry, the bucket has already been accounted for and the count doesn't change.
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    int index = findFreeSlot(table, key->hash);
+    if (table->control[index] == CONTROL_DELETED) table->tombstones--;
+    setControl(table, index, key->hash & 0x7f);
+    table->keys[index] = key;
+    table->values[index] = value;
+    table->count++;
+    return true;
+}
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+/**
+ * Deletes the entry in a slot of the table.
+ * Places a tombstone in its place, the probe sequences of other keys may go through the slot.
+ * @param table
+ * @param index
+ */
+static void deleteSlot(Table* table, int index) {
+    setControl(table, index, CONTROL_DELETED);
+    table->keys[index] = NULL;
+    table->values[index] = NIL_VAL;
+    table->count--;
+    table->tombstones++;
 }
 
 /**
  * Deletes an entry from the table.
- * Places a tombstone in its place to prevent lookup errors in case of colliding keys.
  * @param table
  * @param key
  * @return true if deletion was successful, false if element did not exist.
@@ -163,31 +344,31 @@ bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
 
     // Find the entry.
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int index = findSlot(table, key);
+    if (index == -1) return false;
 
-    // Place tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    deleteSlot(table, index);
     return true;
 }
 
 /**
  * Utility function to copy all the entries of one hash table to another.
+ * @param vm
  * @param from table from which elements are to be copied from
  * @param to table to which elements are to be copied into
  */
-void tableAddAll(Table* from, Table* to) {
+void tableAddAll(VM* vm, Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i++) {
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
-        }
+        if (from->control[i] & 0x80) continue;
+        tableSet(vm, to, from->keys[i], from->values[i]);
     }
 }
 
 /**
  * Utility function we use for string interning.
+ * The value of each entry has to be the hash of its key as a number, like the string table has it. The control bytes
+ * only hold 7 bits of the hash, comparing the whole hash next rejects nearly every other string in the way without
+ * loading it. The key only gets compared to the characters once the hashes match.
  * @param table
  * @param chars
  * @param length
@@ -197,24 +378,25 @@ void tableAddAll(Table* from, Table* to) {
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    // uint32_t index = hash % table->capacity;
-    // optimization for modulo with divisor which is a power of 2
-    uint32_t index = hash & (table->capacity - 1);
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length &&
-                   entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-            // We found it.
-            return entry->key;
-        }
+    uint32_t mask = (uint32_t) table->capacity - 1;
+    uint32_t position = (hash >> 7) & mask;
+    uint8_t fragment = hash & 0x7f;
 
-        // index = (index + 1) % table->capacity;
-        // same optimization as above.
-        index = (index + 1) & (table->capacity - 1);
+    for (uint32_t stride = GROUP_WIDTH;; stride += GROUP_WIDTH) {
+        const uint8_t* group = table->control + position;
+        for (GroupMask match = matchByte(group, fragment); match != 0; match &= match - 1) {
+            uint32_t index = (position + maskIndex(match)) & mask;
+            ObjString* key = table->keys[index];
+            if (AS_NUMBER(table->values[index]) == hash &&
+                key->length == length &&
+                memcmp(key->chars, chars, length) == 0) {
+                // We found it.
+                return key;
+            }
+        }
+        // Stop if we find an empty group.
+        if (matchEmpty(group) != 0) return NULL;
+        position = (position + stride) & mask;
     }
 }
 
@@ -225,26 +407,26 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
 void tableRemoveWhite(Table* table) {
     // We walk every entry in the table.
     for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
         // The string intern table uses only the key of each entry - it's basically a hash set, and not a hash map.
         // If the key string object's mark bit is not set, then it is a white object that is moments away from being swept away.
         // We delete it from the hash table first, and thus ensure we won't see any dangling pointers.
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+        if (!(table->control[i] & 0x80) && !isMarked((Obj*) table->keys[i])) {
+            deleteSlot(table, i);
         }
     }
 }
 
 /**
  * Utility function for the GC to mark the globals presents in the table.
+ * @param vm
  * @param table
  */
-void markTable(Table* table) {
-    // Walk the entry array, and for each entry - mark its value.
+void markTable(VM* vm, Table* table) {
+    // Walk the slots, and for each entry - mark its key and value.
     for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
+        if (table->control[i] & 0x80) continue;
         // mark the key string as well, since the GC manages those as well.
-        markObject((Obj*) entry->key);
-        markValue(entry->value);
+        markObject(vm, (Obj*) table->keys[i]);
+        markValue(vm, table->values[i]);
     }
-}
\ No newline at end of file
+}
@@ -8,39 +8,39 @@
 #include "common.h"
 #include "value.h"
 
-/**
- * Data structure that backs the key/value implementation in the hash table.
- */
-typedef struct {
-    ObjString* key;
-    Value value;
-} Entry;
-
 /**
  * This is the Hash Table data structure used by Tok to achieve various functionalities.
+ * It is laid out like a Swiss table: the keys and the values live in arrays of their own, and next to them there is an
+ * array with one control byte per slot. The control byte tells whether the slot is empty, holds a deleted entry, or is
+ * full, in which case it holds 7 bits of the hash of the key. Lookups scan the control bytes a group at a time, and only
+ * look at the keys whose hash bits match.
  */
 typedef struct {
     int count;      // Number of key/value pairs stored in the table.
-    int capacity;   // Capacity of the table / allocated size of the underlying array.
-    Entry* entries;
+    int tombstones; // Number of slots holding a deleted entry, they keep probe sequences going until the table is rehashed.
+    int capacity;   // Number of slots in the table, 0 or a power of 2.
+    // The control bytes, followed by a copy of the first ones so that a group can be loaded from any slot.
+    uint8_t* control;
+    ObjString** keys;
+    Value* values;
 } Table;
 
 void initTable(Table* table);
 
-void freeTable(Table* table);
+void freeTable(VM* vm, Table* table);
 
 bool tableGet(Table* table, ObjString* key, Value* value);
 
-bool tableSet(Table* table, ObjString* key, Value value);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
 
 bool tableDelete(Table* table, ObjString* key);
 
-void tableAddAll(Table* from, Table* to);
+void tableAddAll(VM* vm, Table* from, Table* to);
 
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
 void tableRemoveWhite(Table* table);
 
-void markTable(Table* table);
+void markTable(VM* vm, Table* table);
 
 #endif //CTOK_TABLE_H
@@ -21,14 +21,15 @@ void initValueArray(ValueArray* array) {
 
 /**
  * Function to insert a value into the ValueArray's values field.
+ * @param vm
  * @param array
  * @param value
  */
-void writeValueArray(ValueArray* array, Value value) {
+void writeValueArray(VM* vm, ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        array->values = GROW_ARRAY(vm, Value, array->values, oldCapacity, array->capacity);
     }
 
     array->values[array->count] = value;
@@ -37,10 +38,11 @@ void writeValueArray(ValueArray* array, Value value) {
 
 /**
  * Function to free up memory from the ValueArray and re-initialize into a stable state.
+ * @param vm
  * @param array
  */
-void freeValueArray(ValueArray* array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM* vm, ValueArray* array) {
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     initValueArray(array);
 }
 
@@ -73,17 +75,33 @@ void printValue(Value value) {
         case VAL_OBJ:
             printObject(value);
             break;
+        case VAL_UNDEFINED:
+            break;
     }
 #endif
 }
 
+/**
+ * Checks whether two values are bound methods binding the same method to the same receiver. Those are equal even when
+ * they're different objects, otherwise whether they compare equal would depend on whether the VM's bound method cache
+ * still had the first one around when the second was bound.
+ * @param a
+ * @param b
+ * @return
+ */
+static bool boundMethodsEqual(Value a, Value b) {
+    return IS_BOUND_METHOD(a) && IS_BOUND_METHOD(b) &&
+           AS_BOUND_METHOD(a)->method == AS_BOUND_METHOD(b)->method &&
+           valuesEqual(AS_BOUND_METHOD(a)->receiver, AS_BOUND_METHOD(b)->receiver);
+}
+
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
     // NaN shouldn't be equal to NaN - we do this explicit number conversion for IEEE 754 compliance in case of decimals.
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    return a == b || boundMethodsEqual(a, b);
 #else
     if (a.type != b.type) return false;
     switch (a.type) {
@@ -94,7 +112,7 @@ bool valuesEqual(Value a, Value b) {
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ:
-            return AS_OBJ(a) == AS_OBJ(b);
+            return AS_OBJ(a) == AS_OBJ(b) || boundMethodsEqual(a, b);
         default:
             return false;   // unreachable.
     }
@@ -11,6 +11,7 @@
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct VM VM;
 
 #ifdef NAN_BOXING
 
@@ -25,8 +26,10 @@ typedef struct ObjString ObjString;
 
 /**
  * We use two (provides total 4 unique values) of the lowest bits of the mantissa space as a "type tag" to determine which
- * of the three singleton values (Nil, false, true) we're looking at.
+ * of the three singleton values (Nil, false, true) we're looking at. The fourth one is taken by the internal "undefined"
+ * marker, which never shows up as a user-visible value.
  */
+#define TAG_UNDEFINED 0 // 00.
 #define TAG_NIL   1 // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE  3 // 11.
@@ -38,6 +41,7 @@ typedef uint64_t Value;
 /// Macro to make check if a value is a pure Tok Boolean.
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 // Every Value that is not a number will use a special quiet NaN representation.
 #define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
 #define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
@@ -58,6 +62,8 @@ typedef uint64_t Value;
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 /// Macro to define a NIL_VAL, simply bitwise OR the quiet NaN bits and the type tag.
 #define NIL_VAL     ((Value)(uint64_t)(QNAN | TAG_NIL))
+/// Macro to define the marker stored in the slot of a global variable that hasn't been defined (yet).
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 /// Macro to pun a number to a Tok Value
 #define NUMBER_VAL(num) numToValue(num)
 /// Macro to convert an object pointer to a Tok Value.
@@ -92,7 +98,9 @@ typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_OBJ,
+    // marker stored in the slot of a global variable that hasn't been defined (yet), never a user-visible value.
+    VAL_UNDEFINED
 } ValueType;
 
 /**
@@ -120,6 +128,7 @@ typedef struct {
 #define IS_NIL(value)       ((value).type == VAL_NIL)
 #define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)       ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_OBJ(value)      ((value).as.obj)
 #define AS_BOOL(value)      ((value).as.boolean)
@@ -129,6 +138,7 @@ typedef struct {
 #define NIL_VAL             ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value)   ((Value){VAL_NUMBER, {.number = (value)}})
 #define OBJ_VAL(object)      ((Value){VAL_OBJ, {.obj = (Obj*)(object)}})
+#define UNDEFINED_VAL       ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #endif
 
@@ -157,16 +167,18 @@ void initValueArray(ValueArray* array);
 
 /**
  * Function to write a constant to a the ValueArray.
+ * @param vm VM the array's memory is accounted to.
  * @param array
  * @param value
  */
-void writeValueArray(ValueArray* array, Value value);
+void writeValueArray(VM* vm, ValueArray* array, Value value);
 
 /**
  * Function to un-initialize a ValueArray.
+ * @param vm
  * @param array
  */
-void freeValueArray(ValueArray* array);
+void freeValueArray(VM* vm, ValueArray* array);
 
 /**
  * Function to print a Value object.
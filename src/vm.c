@@ -4,48 +4,145 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "bytecode.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "fiber.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
+#include "profiler.h"
 #include "vm.h"
 
-// Static vm instance for now. Might implement a more dynamic solution later.
-VM vm;
+#if defined(DEBUG_OPCODE_STATS) && (defined(__x86_64__) || defined(__i386__))
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+/// Maximum number of calls a stack trace prints.
+#define TRACE_FRAMES_MAX 64
 
 /**
  * Native clock function that returns the elapsed time since the program started running, in seconds.
  * Handy for benchmarking.
+ * @param vm
  * @param argCount
  * @param args
  * @return elapsed time since the program started running, in seconds
  */
-static Value clockNative(int argCount, Value* args) {
+static Value clockNative(VM* vm, int argCount, Value* args) {
     return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
 }
 
+static void addField(VM* vm, ObjInstance* instance, ObjShape* shape, Value value);
+
+static void closeUpvalues(VM* vm, Value* last);
+
+static bool compileLazyFunction(VM* vm, ObjFunction* function);
+
+/**
+ * Adds a number field to an instance.
+ * @param vm
+ * @param instance instance, which has to be reachable by the GC.
+ * @param name
+ * @param value
+ */
+static void addNumberField(VM* vm, ObjInstance* instance, const char* name, double value) {
+    push(vm, OBJ_VAL(copyString(vm, name, (int) strlen(name))));
+    addField(vm, instance, shapeTransition(vm, instance->shape, AS_STRING(vm->stackTop[-1])), NUMBER_VAL(value));
+    pop(vm);
+}
+
+/**
+ * Native gcStats function that returns the statistics of the GC, as the fields of a GCStats instance. Times are in
+ * seconds, sizes in bytes. The number of objects of each type, and the bytes they take up without the arrays and tables
+ * they own, are in the <code>&lt;type&gt;Objects</code> and <code>&lt;type&gt;Bytes</code> fields.
+ * @param vm
+ * @param argCount
+ * @param args
+ * @return a fresh GCStats instance.
+ */
+static Value gcStatsNative(VM* vm, int argCount, Value* args) {
+    // The counters are read up front, so the allocations below don't show up in them.
+    GCStats stats = vm->gcStats;
+    size_t heapBytes = vm->bytesAllocated;
+    size_t nextGC = vm->nextGC;
+    int stringTableCount = vm->strings.count;
+    int stringTableCapacity = vm->strings.capacity;
+
+    push(vm, OBJ_VAL(copyString(vm, "GCStats", 7)));
+    push(vm, OBJ_VAL(newClass(vm, AS_STRING(vm->stackTop[-1]))));
+    ObjInstance* instance = newInstance(vm, AS_CLASS(vm->stackTop[-1]));
+    push(vm, OBJ_VAL(instance));
+
+    addNumberField(vm, instance, "minorCollections", (double) stats.minorCollections);
+    addNumberField(vm, instance, "majorCollections", (double) stats.majorCollections);
+    addNumberField(vm, instance, "collections", (double) (stats.minorCollections + stats.majorCollections));
+    addNumberField(vm, instance, "pauses", (double) stats.pauses);
+    addNumberField(vm, instance, "totalPauseTime", stats.totalPauseTime);
+    addNumberField(vm, instance, "maxPauseTime", stats.maxPauseTime);
+    addNumberField(vm, instance, "bytesAllocated", (double) stats.bytesAllocated);
+    addNumberField(vm, instance, "bytesFreed", (double) stats.bytesFreed);
+    addNumberField(vm, instance, "heapBytes", (double) heapBytes);
+    addNumberField(vm, instance, "nextGC", (double) nextGC);
+    addNumberField(vm, instance, "stringTableCount", stringTableCount);
+    addNumberField(vm, instance, "stringTableCapacity", stringTableCapacity);
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%sObjects", objTypeName((ObjType) type));
+        addNumberField(vm, instance, name, (double) stats.objectCounts[type]);
+        snprintf(name, sizeof(name), "%sBytes", objTypeName((ObjType) type));
+        addNumberField(vm, instance, name, (double) stats.objectBytes[type]);
+    }
+
+    Value result = pop(vm);
+    pop(vm);
+    pop(vm);
+    return result;
+}
+
+#ifdef JIT
+
+/**
+ * Counts a call of a function, or an iteration of one of its loops, and compiles the function to machine code once
+ * that happened often enough.
+ * @param vm
+ * @param function
+ */
+static inline void countHotness(VM* vm, ObjFunction* function) {
+    // Machine code doesn't take samples, so a program that's being profiled stays interpreted.
+    if (function->jit == NULL && vm->profiler == NULL && ++function->hotness == JIT_THRESHOLD) jitCompile(vm, function);
+}
+
+#endif
+
 /**
  * Function to reset the VM's stack
  * Resets the stack's top pointer to the first element
  * not that we don't need to really clear out the values from the array itself
  */
-static void resetStack() {
-    vm.stackTop = vm.stack;
+static void resetStack(VM* vm) {
+    vm->stackTop = vm->stack;
     // The CallFrame stack is empty at the start.
-    vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+    vm->frameCount = 0;
+    vm->openUpvalues = NULL;
 }
 
 /**
  * Handles runtime errors.
+ * @param vm
  * @param format
  * @param ...
  */
-static void runtimeError(const char* format, ...) {
+static void runtimeError(VM* vm, const char* format, ...) {
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
@@ -55,19 +152,287 @@ static void runtimeError(const char* format, ...) {
     // After printing the error message, we start walking the call stack from th etop (the most recently called function)
     // to bottom (the top-level code). For each frame, we find the line number that corresponds to the current ip
     // inside that frame's function. Then we print that line number along with the name of the function.
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame* frame = &vm.frames[i];
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        // A deep recursion would flood the output, only the innermost and the outermost calls are printed then.
+        if (vm->frameCount > TRACE_FRAMES_MAX && i == vm->frameCount - 1 - TRACE_FRAMES_MAX / 2) {
+            int omitted = vm->frameCount - TRACE_FRAMES_MAX;
+            fprintf(stderr, "[... %d more calls]\n", omitted);
+            i -= omitted - 1;
+            continue;
+        }
+        CallFrame* frame = &vm->frames[i];
         ObjFunction* function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
         fprintf(stderr, "[line %d] in ",
-                function->chunk.lines[instruction]);
+                getLine(&function->chunk, (int) instruction));
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
             fprintf(stderr, "%s()\n", function->name->chars);
         }
     }
-    resetStack();
+    // The error stops every fiber, and the closures that captured their locals keep the values they had.
+    closeUpvalues(vm, vm->stack);
+    abortFibers(vm);
+    resetStack(vm);
+}
+
+/**
+ * Checks the number of arguments a native function got, and reports a runtime error if it's off.
+ * @param vm
+ * @param name name of the native function, for the error message.
+ * @param expected number of arguments the native function takes.
+ * @param argCount number of arguments it got.
+ * @return true if the number of arguments is right, false otherwise.
+ */
+static bool checkArity(VM* vm, const char* name, int expected, int argCount) {
+    if (argCount == expected) return true;
+    runtimeError(vm, "%s() expected %d arguments but got %d.", name, expected, argCount);
+    return false;
+}
+
+/**
+ * Checks that a number is a whole one, the way list indices have to be. It has to be done before the number gets
+ * converted to an int, which is undefined for NaN, infinities and numbers out of the range of int.
+ * @param number
+ * @return
+ */
+static bool isInteger(double number) {
+    if (number != number) return false;
+    // Doubles this large have no fraction bits left, and may not fit in an int64_t.
+    if (number <= -9007199254740992.0 || number >= 9007199254740992.0) return true;
+    return (double) (int64_t) number == number;
+}
+
+/**
+ * Native len function that returns the number of items in a list, or of characters in a string.
+ * Natives report errors by calling runtimeError() and returning UNDEFINED_VAL, which callValue() checks for.
+ * @param vm
+ * @param argCount
+ * @param args the list or string.
+ * @return the length.
+ */
+static Value lenNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, "len", 1, argCount)) return UNDEFINED_VAL;
+    if (IS_LIST(args[0])) return NUMBER_VAL(AS_LIST(args[0])->items.count);
+    if (IS_STRING_OR_ROPE(args[0])) return NUMBER_VAL(stringLength(AS_OBJ(args[0])));
+    runtimeError(vm, "len() takes a list or a string.");
+    return UNDEFINED_VAL;
+}
+
+/**
+ * Native append function that adds a value to the end of a list.
+ * @param vm
+ * @param argCount
+ * @param args the list and the value.
+ * @return nil.
+ */
+static Value appendNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, "append", 2, argCount)) return UNDEFINED_VAL;
+    if (!IS_LIST(args[0])) {
+        runtimeError(vm, "append() takes a list.");
+        return UNDEFINED_VAL;
+    }
+    ObjList* list = AS_LIST(args[0]);
+    // Both stay on the stack while the items array grows, so a collection can't free them.
+    writeValueArray(vm, &list->items, args[1]);
+    writeBarrier(vm, (Obj*) list, args[1]);
+    return NIL_VAL;
+}
+
+/**
+ * Native slice function that copies the items from index start up to, but not including, index end into a new list.
+ * @param vm
+ * @param argCount
+ * @param args the list, start and end.
+ * @return the new list.
+ */
+static Value sliceNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, "slice", 3, argCount)) return UNDEFINED_VAL;
+    if (!IS_LIST(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2])) {
+        runtimeError(vm, "slice() takes a list and two indices.");
+        return UNDEFINED_VAL;
+    }
+    ObjList* list = AS_LIST(args[0]);
+    double start = AS_NUMBER(args[1]);
+    double end = AS_NUMBER(args[2]);
+    if (!isInteger(start) || !isInteger(end) || start < 0 || end > list->items.count || start > end) {
+        runtimeError(vm, "slice() indices out of range.");
+        return UNDEFINED_VAL;
+    }
+
+    int count = (int) end - (int) start;
+    ObjList* slice = newList(vm);
+    push(vm, OBJ_VAL(slice));
+    if (count > 0) {
+        slice->items.values = GROW_ARRAY(vm, Value, NULL, 0, count);
+        slice->items.capacity = count;
+        memcpy(slice->items.values, list->items.values + (int) start, count * sizeof(Value));
+        slice->items.count = count;
+        // A collection during the allocation may have made the new list old already.
+        for (int i = 0; i < count; i++) writeBarrier(vm, (Obj*) slice, slice->items.values[i]);
+    }
+    pop(vm);
+    return OBJ_VAL(slice);
+}
+
+/**
+ * qsort() comparator for lists of numbers.
+ */
+static int compareNumbers(const void* a, const void* b) {
+    double x = AS_NUMBER(*(const Value*) a);
+    double y = AS_NUMBER(*(const Value*) b);
+    return (x > y) - (x < y);
+}
+
+/**
+ * qsort() comparator for lists of flat strings, which orders them byte by byte.
+ */
+static int compareStrings(const void* a, const void* b) {
+    ObjString* x = AS_STRING(*(const Value*) a);
+    ObjString* y = AS_STRING(*(const Value*) b);
+    int length = x->length < y->length ? x->length : y->length;
+    int result = memcmp(x->chars, y->chars, length);
+    return result != 0 ? result : (x->length > y->length) - (x->length < y->length);
+}
+
+/**
+ * Native sort function that sorts a list of numbers, or one of strings, in place.
+ * @param vm
+ * @param argCount
+ * @param args the list.
+ * @return nil.
+ */
+static Value sortNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, "sort", 1, argCount)) return UNDEFINED_VAL;
+    if (!IS_LIST(args[0])) {
+        runtimeError(vm, "sort() takes a list.");
+        return UNDEFINED_VAL;
+    }
+    ObjList* list = AS_LIST(args[0]);
+    if (list->items.count < 2) return NIL_VAL;
+
+    bool numbers = IS_NUMBER(list->items.values[0]);
+    for (int i = 0; i < list->items.count; i++) {
+        Value item = list->items.values[i];
+        if (numbers ? !IS_NUMBER(item) : !IS_STRING_OR_ROPE(item)) {
+            runtimeError(vm, "sort() takes a list of numbers or a list of strings.");
+            return UNDEFINED_VAL;
+        }
+    }
+    if (!numbers) {
+        // Ropes are flattened first so the comparator can look at the characters directly. The list is on the stack and
+        // holds the rope, so both survive the allocation.
+        for (int i = 0; i < list->items.count; i++) {
+            Value item = list->items.values[i];
+            if (!IS_ROPE(item)) continue;
+            Value string = OBJ_VAL(flattenRope(vm, AS_ROPE(item)));
+            list->items.values[i] = string;
+            writeBarrier(vm, (Obj*) list, string);
+        }
+    }
+    qsort(list->items.values, list->items.count, sizeof(Value), numbers ? compareNumbers : compareStrings);
+    return NIL_VAL;
+}
+
+/**
+ * Creates a fiber for the function a fiber native got.
+ * @param vm
+ * @param name name of the native, for the error messages.
+ * @param function
+ * @return the fiber, or NULL after reporting an error.
+ */
+static ObjFiber* createFiber(VM* vm, const char* name, Value function) {
+    if (!IS_CLOSURE(function)) {
+        runtimeError(vm, "%s() takes a function.", name);
+        return NULL;
+    }
+    ObjClosure* closure = AS_CLOSURE(function);
+    // The arity has to be known up front, so a function that hasn't been compiled yet gets compiled now.
+    if (closure->function->lazySource != NULL && !compileLazyFunction(vm, closure->function)) return NULL;
+    if (closure->function->arity > 1) {
+        runtimeError(vm, "%s() takes a function with at most one parameter.", name);
+        return NULL;
+    }
+    return newFiber(vm, closure);
+}
+
+/**
+ * Native Fiber function that creates a fiber, which runs the given function once it gets resumed. The value the first
+ * resume passes in is the function's argument, if it takes one.
+ * @param vm
+ * @param argCount
+ * @param args the function.
+ * @return the fiber.
+ */
+static Value fiberNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, "Fiber", 1, argCount)) return UNDEFINED_VAL;
+    ObjFiber* fiber = createFiber(vm, "Fiber", args[0]);
+    return fiber == NULL ? UNDEFINED_VAL : OBJ_VAL(fiber);
+}
+
+/**
+ * Native spawn function that creates a fiber and hands it to the scheduler, which runs it once the running fiber
+ * finishes or waits for something. Its function gets nil, if it takes an argument.
+ * @param vm
+ * @param argCount
+ * @param args the function.
+ * @return the fiber.
+ */
+static Value spawnNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, "spawn", 1, argCount)) return UNDEFINED_VAL;
+    ObjFiber* fiber = createFiber(vm, "spawn", args[0]);
+    if (fiber == NULL) return UNDEFINED_VAL;
+    scheduleFiber(vm, fiber, NIL_VAL);
+    return OBJ_VAL(fiber);
+}
+
+/**
+ * Native sleep function that parks the running fiber for some time, while the other fibers run.
+ * @param vm
+ * @param argCount
+ * @param args number of seconds.
+ * @return nil.
+ */
+static Value sleepNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, "sleep", 1, argCount)) return UNDEFINED_VAL;
+    if (!IS_NUMBER(args[0]) || !(AS_NUMBER(args[0]) >= 0)) {
+        runtimeError(vm, "sleep() takes a number of seconds.");
+        return UNDEFINED_VAL;
+    }
+    sleepFiber(vm, AS_NUMBER(args[0]));
+    return NIL_VAL;
+}
+
+/**
+ * Native readLine function that reads a line from the standard input. Until the line is there, the running fiber is
+ * parked and the other fibers run.
+ * @param vm
+ * @param argCount
+ * @param args
+ * @return the line without its terminator, or nil at the end of the input.
+ */
+static Value readLineNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, "readLine", 0, argCount)) return UNDEFINED_VAL;
+    Value line;
+    // A parked fiber gets the line once it runs again, the value returned here is dropped.
+    return readLineNow(vm, &line) ? line : NIL_VAL;
+}
+
+/**
+ * Native isDone function that tells whether a fiber's function has returned, or a runtime error stopped it.
+ * @param vm
+ * @param argCount
+ * @param args the fiber.
+ * @return
+ */
+static Value isDoneNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, "isDone", 1, argCount)) return UNDEFINED_VAL;
+    if (!IS_FIBER(args[0])) {
+        runtimeError(vm, "isDone() takes a fiber.");
+        return UNDEFINED_VAL;
+    }
+    return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
 }
 
 /**
@@ -78,111 +443,407 @@ static void runtimeError(const char* format, ...) {
  * <code>newNative</code> dynamically allocate memory. That means they can potentially trigger a garbage collection in our
  * Garbage Collector. If that happens, we need to ensure the collector knows we're not done with the name and ObjFunction
  * so that it doesn't free them out from under us. Storing them as a stack value accomplishes that.
+ * @param vm
  * @param name Name by which the native function will be known from, in Tok.
  * @param function pointer to the native C function.
  */
-static void defineNative(const char* name, NativeFn function) {
-    push(OBJ_VAL(copyString(name, (int) strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
+static void defineNative(VM* vm, const char* name, NativeFn function) {
+    push(vm, OBJ_VAL(copyString(vm, name, (int) strlen(name))));
+    push(vm, OBJ_VAL(newNative(vm, function)));
+    int slot = globalSlot(vm, AS_STRING(vm->stack[0]));
+    vm->globalValues.values[slot] = vm->stack[1];
+    pop(vm);
+    pop(vm);
 }
 
 /**
- * Function to initialize the VM before use.
+ * Creates a new VM, ready to interpret code. Each VM has a heap, globals and interned strings of its own, and nothing
+ * in it is shared with the other VMs, so any number of them can live in the same process. A VM may only be used by one
+ * thread at a time.
+ * @return the VM, to be destroyed with freeVM().
  */
-void initVM() {
-    resetStack();
-    vm.objects = NULL;
-    vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+VM* newVM() {
+    VM* vm = malloc(sizeof(VM));
+    if (vm == NULL) exit(1);
+    // Both stacks start out small, and grow as the calls get deeper. The value stack starts out with enough room for the
+    // top level code, and for the compiler, which keeps some of its temporaries in there.
+    vm->frameCapacity = FRAMES_INITIAL;
+    vm->frames = (CallFrame*) malloc(sizeof(CallFrame) * vm->frameCapacity);
+    vm->maxFrames = FRAMES_MAX;
+    vm->lazyCompilation = false;
+    vm->stackCapacity = FRAME_STACK_SLOTS;
+    vm->stack = (Value*) malloc(sizeof(Value) * vm->stackCapacity);
+    if (vm->frames == NULL || vm->stack == NULL) exit(1);
+    resetStack(vm);
+    vm->largePages = NULL;
+    vm->youngPages = NULL;
+    vm->youngStrings = NULL;
+    vm->youngStringCount = 0;
+    vm->youngStringCapacity = 0;
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
+    vm->nextMinorGC = GC_NURSERY_SIZE;
+    vm->rememberedSet = NULL;
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
+    vm->gcPhase = GC_IDLE;
+    vm->gcStepBudget = GC_STEP_BUDGET;
+    vm->nextGCStep = 0;
+    vm->gcCursorList = 0;
+    vm->gcCursor = NULL;
+    vm->gcStats = (GCStats) {0};
+    vm->bytecodeMappings = NULL;
+    vm->profiler = NULL;
+    vm->fiber = NULL;
+    vm->mainFiber = NULL;
+    vm->scheduler = NULL;
+#ifdef DEBUG_STRESS_GC
+    vm->stressCollections = 0;
+#endif
 
     // GC initializations.
-    vm.grayCount = 0;
-    vm.grayCapacity = 0;
-    vm.grayStack = NULL;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+#ifdef OBJECT_POOLS
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        vm->pools[i] = (ObjectPool) {NULL, NULL, 0, NULL};
+    }
+#endif
 
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+    initTable(&vm->globalSlots);
+    initValueArray(&vm->globalNames);
+    initValueArray(&vm->globalValues);
+    initTable(&vm->strings);
+
+#ifdef DEBUG_INLINE_CACHE_STATS
+    vm->cacheHits = 0;
+    vm->cacheMisses = 0;
+#endif
+#ifdef DEBUG_OPCODE_STATS
+    memset(vm->opcodeCounts, 0, sizeof(vm->opcodeCounts));
+    memset(vm->opcodePairCounts, 0, sizeof(vm->opcodePairCounts));
+    memset(vm->opcodeCycles, 0, sizeof(vm->opcodeCycles));
+    vm->lastOpcode = -1;
+    vm->lastOpcodeCycles = 0;
+#endif
 
     // initialize the initString with the reserved keyword for defining initializer functions.
     // Since during the copyString operation, we could trigger a GC. If the collector ran at just
-    // the wrong time, it would read vm.initString before it had been initialized. So, first we zero the field out.
-    vm.initString = NULL;
-    vm.initString = copyString("init", 4);
+    // the wrong time, it would read vm->initString before it had been initialized. So, first we zero the field out.
+    vm->initString = NULL;
+    for (int i = 0; i < BOUND_METHOD_CACHE_SIZE; i++) {
+        vm->boundMethods[i] = NULL;
+    }
+    vm->initString = copyString(vm, "init", 4);
+    // The code that isn't in any fiber runs in the main one, whose stacks are the ones allocated above.
+    vm->mainFiber = newFiber(vm, NULL);
+    vm->fiber = vm->mainFiber;
 
     // initialize native functions.
-    defineNative("clock", clockNative);
+    defineNative(vm, "clock", clockNative);
+    defineNative(vm, "gcStats", gcStatsNative);
+    defineNative(vm, "len", lenNative);
+    defineNative(vm, "append", appendNative);
+    defineNative(vm, "slice", sliceNative);
+    defineNative(vm, "sort", sortNative);
+    defineNative(vm, "Fiber", fiberNative);
+    defineNative(vm, "spawn", spawnNative);
+    defineNative(vm, "sleep", sleepNative);
+    defineNative(vm, "readLine", readLineNative);
+    defineNative(vm, "isDone", isDoneNative);
+    return vm;
+}
+
+#ifdef DEBUG_OPCODE_STATS
+
+/// Number of opcode pairs the report of the opcode statistics lists.
+#define OPCODE_PAIRS_REPORTED 30
+
+/**
+ * An opcode or a pair of opcodes, with the number of times it got executed, for sorting the report.
+ */
+typedef struct {
+    uint64_t count;
+    int first;
+    int second;
+} OpcodeCount;
+
+static int compareOpcodeCounts(const void* a, const void* b) {
+    uint64_t countA = ((const OpcodeCount*) a)->count;
+    uint64_t countB = ((const OpcodeCount*) b)->count;
+    return countA < countB ? 1 : countA > countB ? -1 : 0;
+}
+
+/**
+ * Prints the opcodes executed by the VM, most frequent first, along with the cycles they took on average, followed by
+ * the most frequent pairs of consecutive opcodes.
+ * @param vm
+ * @param file
+ */
+static void printOpcodeStats(VM* vm, FILE* file) {
+    OpcodeCount opcodes[UINT8_COUNT];
+    int opcodeCount = 0;
+    uint64_t total = 0;
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        if (vm->opcodeCounts[i] == 0) continue;
+        opcodes[opcodeCount++] = (OpcodeCount) {vm->opcodeCounts[i], i, -1};
+        total += vm->opcodeCounts[i];
+    }
+    qsort(opcodes, (size_t) opcodeCount, sizeof(OpcodeCount), compareOpcodeCounts);
+
+    fprintf(file, "opcodes: %llu executed\n", (unsigned long long) total);
+    fprintf(file, "  %-28s %14s %7s %12s\n", "opcode", "count", "share", "cycles/op");
+    for (int i = 0; i < opcodeCount; i++) {
+        const char* name = opcodeName((uint8_t) opcodes[i].first);
+        fprintf(file, "  %-28s %14llu %6.2f%% %12.1f\n", name == NULL ? "?" : name,
+                (unsigned long long) opcodes[i].count, 100.0 * (double) opcodes[i].count / (double) total,
+                (double) vm->opcodeCycles[opcodes[i].first] / (double) opcodes[i].count);
+    }
+
+    // Only the most frequent pairs are of interest, but all of them have to be sorted to find those.
+    OpcodeCount* pairs = (OpcodeCount*) malloc(sizeof(OpcodeCount) * UINT8_COUNT * UINT8_COUNT);
+    if (pairs == NULL) return;
+    int pairCount = 0;
+    uint64_t pairTotal = 0;
+    for (int first = 0; first < UINT8_COUNT; first++) {
+        for (int second = 0; second < UINT8_COUNT; second++) {
+            uint64_t count = vm->opcodePairCounts[first][second];
+            if (count == 0) continue;
+            pairs[pairCount++] = (OpcodeCount) {count, first, second};
+            pairTotal += count;
+        }
+    }
+    qsort(pairs, (size_t) pairCount, sizeof(OpcodeCount), compareOpcodeCounts);
+
+    fprintf(file, "opcode pairs: %llu executed\n", (unsigned long long) pairTotal);
+    for (int i = 0; i < pairCount && i < OPCODE_PAIRS_REPORTED; i++) {
+        const char* first = opcodeName((uint8_t) pairs[i].first);
+        const char* second = opcodeName((uint8_t) pairs[i].second);
+        fprintf(file, "  %-28s %-28s %14llu %6.2f%%\n", first == NULL ? "?" : first, second == NULL ? "?" : second,
+                (unsigned long long) pairs[i].count, 100.0 * (double) pairs[i].count / (double) pairTotal);
+    }
+    free(pairs);
+}
+
+#endif
+
+/**
+ * Destroys a VM, freeing every object in its heap along with the VM itself.
+ * @param vm
+ */
+void freeVM(VM* vm) {
+#ifdef DEBUG_INLINE_CACHE_STATS
+    size_t lookups = vm->cacheHits + vm->cacheMisses;
+    fprintf(stderr, "inline caches: %zu hits, %zu misses (%.1f%% hit rate)\n", vm->cacheHits, vm->cacheMisses,
+            lookups == 0 ? 0.0 : 100.0 * (double) vm->cacheHits / (double) lookups);
+#endif
+#ifdef DEBUG_OPCODE_STATS
+    printOpcodeStats(vm, stderr);
+#endif
+    freeTable(vm, &vm->globalSlots);
+    freeValueArray(vm, &vm->globalNames);
+    freeValueArray(vm, &vm->globalValues);
+    freeTable(vm, &vm->strings);
+    vm->initString = NULL;
+    freeObjects(vm);
+    freeBytecode(vm);
+    stopProfiler(vm);
+    freeScheduler(vm);
+    free(vm->frames);
+    free(vm->stack);
+    free(vm);
 }
 
-void freeVM() {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
-    vm.initString = NULL;
-    freeObjects();
+/**
+ * Finds the slot of the global variable with the given name, handing out a new one if this is the first time the name
+ * comes up. The compiler resolves every global variable to its slot up front, so at runtime the VM can access globals
+ * by index, without hashing the name.
+ * A new slot starts out holding UNDEFINED_VAL. Accessing a global before its definition has run still raises an error.
+ * @param vm
+ * @param name name of the global variable.
+ * @return index of the variable in <code>vm->globalValues</code>.
+ */
+int globalSlot(VM* vm, ObjString* name) {
+    Value slot;
+    if (tableGet(&vm->globalSlots, name, &slot)) return (int) AS_NUMBER(slot);
+
+    // keep the name safe from the GC while the arrays and the table grow.
+    push(vm, OBJ_VAL(name));
+    writeValueArray(vm, &vm->globalNames, OBJ_VAL(name));
+    writeValueArray(vm, &vm->globalValues, UNDEFINED_VAL);
+    int index = vm->globalValues.count - 1;
+    tableSet(vm, &vm->globalSlots, name, NUMBER_VAL(index));
+    pop(vm);
+    return index;
 }
 
 /**
  * Push a value into the VM's stack
+ * @param vm
  * @param value
  */
-void push(Value value) {
-    *vm.stackTop = value;
-    vm.stackTop++;
+void push(VM* vm, Value value) {
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
 /**
  * Pop and return the latest element pushed into the stack.
+ * @param vm
  * @return
  */
-Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+Value pop(VM* vm) {
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
 /**
  * Peeks the values in the stack at a given distance.
+ * @param vm
  * @param distance
  * @return
  */
-static Value peek(int distance) {
-    return vm.stackTop[-1 - distance];
+static Value peek(VM* vm, int distance) {
+    return vm->stackTop[-1 - distance];
+}
+
+/**
+ * Moves the value stack to a larger array. The frames' windows into the stack and the open upvalues, which point to
+ * the stack slots they capture, are moved over to the new array along with the values.
+ * Only call() grows the stack, right before the function it calls starts running. Everything else relies on the room
+ * each call made sure of, so code that holds on to pointers into the stack only has to reload them after a call.
+ * @param vm
+ * @param needed number of slots the stack has to be able to hold.
+ */
+static void growStack(VM* vm, int needed) {
+    int capacity = vm->stackCapacity;
+    while (capacity < needed) capacity *= 2;
+
+    Value* stack = (Value*) malloc(sizeof(Value) * capacity);
+    if (stack == NULL) exit(1);
+    memcpy(stack, vm->stack, sizeof(Value) * (vm->stackTop - vm->stack));
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    }
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+    vm->stackTop = stack + (vm->stackTop - vm->stack);
+
+    free(vm->stack);
+    vm->stack = stack;
+    vm->stackCapacity = capacity;
+}
+
+/**
+ * Compiles the body of a function that compile() left for its first call, see compileFunction(). The compiler may push
+ * to the stack and define global slots, so the interpreter has to reload its state from the VM afterwards.
+ * @param vm
+ * @param function
+ * @return false if the body doesn't compile, after reporting why.
+ */
+static bool compileLazyFunction(VM* vm, ObjFunction* function) {
+    if (compileFunction(vm, function)) return true;
+    runtimeError(vm, "Could not compile function %s.", function->name->chars);
+    return false;
+}
+
+static bool call(VM* vm, ObjClosure* closure, int argCount);
+
+/**
+ * Switches to a fiber and hands it a value: the argument of its function if it hasn't started yet, otherwise the result
+ * of the yield, resume or native it was parked in. The interpreter has to reload its state from the VM afterwards.
+ * @param vm
+ * @param fiber fiber that is new, suspended or handed over by the scheduler.
+ * @param value
+ * @return false if the fiber's function couldn't be called, after reporting why.
+ */
+static bool enterFiber(VM* vm, ObjFiber* fiber, Value value) {
+    fiber->state = FIBER_RUNNING;
+    // The scheduler hands the fiber that got parked right back when no other fiber is ready.
+    if (fiber != vm->fiber) {
+        // A spawned fiber is scheduled rather than new by the time it runs, what tells is that it has no frames yet.
+        bool isNew = fiber->frameCount == 0;
+        switchFiber(vm, fiber);
+        if (isNew) {
+            // newFiber() put the closure in stack slot zero.
+            ObjClosure* closure = AS_CLOSURE(vm->stack[0]);
+            if (closure->function->arity == 1) push(vm, value);
+            return call(vm, closure, closure->function->arity);
+        }
+    }
+    push(vm, value);
+    return true;
+}
+
+/**
+ * Switches to the next fiber the scheduler has, after the running one got parked. There always is one, if only the
+ * fiber that got parked.
+ * @param vm
+ * @return false if the fiber's function couldn't be called, after reporting why.
+ */
+static bool runNextFiber(VM* vm) {
+    ObjFiber* fiber = nextFiber(vm);
+    Value value = fiber->transfer;
+    fiber->transfer = NIL_VAL;
+    return enterFiber(vm, fiber, value);
 }
 
 /**
  * Initializes a new CallFrame for a Tok Function call,
+ * @param vm
  * @param function pointer to a ObjFunction for the Object/function being called.
  * @param argCount number of arguments passed to the function.
  * @return
  */
-static bool call(ObjClosure* closure, int argCount) {
+static bool call(VM* vm, ObjClosure* closure, int argCount) {
     if (argCount != closure->function->arity) {
-        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
-        return false;
+        // The arity of a function that hasn't been compiled yet is -1, so that its first call ends up in here, and the
+        // calls of compiled functions don't pay for the check.
+        if (closure->function->lazySource != NULL && !compileLazyFunction(vm, closure->function)) return false;
+        if (argCount != closure->function->arity) {
+            runtimeError(vm, "Expected %d arguments but got %d.", closure->function->arity, argCount);
+            return false;
+        }
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
-        runtimeError("Stack overflow.");
+    if (vm->frameCount >= vm->maxFrames) {
+        runtimeError(vm, "Stack overflow.");
         return false;
     }
 
-    CallFrame* frame = &vm.frames[vm.frameCount++];
+    if (vm->frameCount == vm->frameCapacity) {
+        // run() reloads its pointer to the current frame after every call, so the frames are free to move.
+        vm->frameCapacity *= 2;
+        vm->frames = (CallFrame*) realloc(vm->frames, sizeof(CallFrame) * vm->frameCapacity);
+        if (vm->frames == NULL) exit(1);
+    }
+
+    // -1 is for the stack slot zero set aside for method calls.
+    int base = (int) (vm->stackTop - vm->stack) - argCount - 1;
+    int needed = base + closure->function->maxSlots + FRAME_STACK_SLOTS;
+    if (vm->stackCapacity < needed) growStack(vm, needed);
+
+    CallFrame* frame = &vm->frames[vm->frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    // -1 is for the stack slot zero set aside for method calls.
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->slots = vm->stack + base;
+#ifdef JIT
+    countHotness(vm, closure->function);
+#endif
     return true;
 }
 
 /**
  * Handles a call invocation on a Value. Method to handle Tok Function calls.\n
  * Handles error cases.
+ * @param vm
  * @param callee object on which the call is being invoked.
  * @param argCount number of arguments passed to the call.
  * @return
  */
-static bool callValue(Value callee, int argCount) {
+static bool callValue(VM* vm, Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_BOUND_METHOD: {
@@ -191,132 +852,255 @@ static bool callValue(Value callee, int argCount) {
                 // When a method is called, the top of the stack contains all the arguments,
                 // and then just under this is the closure of the called method. That's where slot zero in the new CallFrame will be.
                 // The -argCount skips past the arguments and the - 1 adjusts for the fact that stackTop points just past the last used stack slot.
-                vm.stackTop[-argCount - 1] = bound->receiver;
+                vm->stackTop[-argCount - 1] = bound->receiver;
                 // pull out the raw closure from the ObjBoundMethod invoke the call.
-                return call(bound->method, argCount);
+                return call(vm, bound->method, argCount);
             }
             case OBJ_CLASS: {
                 // if the value being called is a class, we treat it as constructor call.
                 ObjClass* klass = AS_CLASS(callee);
                 // we create a new instance of the called class and store the result on the stack, at stack slot zero.
-                vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+                vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
 
                 // automatically calling init() on new instances.
                 // After ht runtime allocates the new instance, we look for an init() method on the class.
                 Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer)) {
+                if (tableGet(&klass->methods, vm->initString, &initializer)) {
                     // if we find the init() method, we initiate a call to it. This pushes a new CallFrame for the initializer's closure.
-                    return call(AS_CLOSURE(initializer), argCount);
+                    return call(vm, AS_CLOSURE(initializer), argCount);
                 } else if (argCount != 0) {
                     // Tok doesn't require a class to define an initializer. If omitted, the runtime simply returns the
                     // new uninitialized instance. However, if there is no init() method, then it doesn't make any sense to
                     // pass arguments to the class when creating an instance. We raise an error in that case.
-                    runtimeError("Expected 0 arguments but got %d.", argCount);
+                    runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
                     return false;
                 }
                 return true;
             }
             case OBJ_CLOSURE:
-                return call(AS_CLOSURE(callee), argCount);
+                return call(vm, AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
                 // If the object being called is a native function, we invoke the C function right here.
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
+                Value result = native(vm, argCount, vm->stackTop - argCount);
+                // The native has already reported the error, and the stack is gone with it.
+                if (IS_UNDEFINED(result)) return false;
+                vm->stackTop -= argCount + 1;
+                // A native that waits for something parks the fiber, which gets its result once it runs again.
+                if (vm->fiber->state == FIBER_SCHEDULED) return runNextFiber(vm);
                 // Stuff the result back into the stack.
-                push(result);
+                push(vm, result);
                 return true;
             }
             default:
                 break; // Non-callable object type.
         }
     }
-    runtimeError("Can only call functions and classes.");
+    runtimeError(vm, "Can only call functions and classes.");
     return false;
 }
 
 /**
  * Invokes a given method on a given class.
+ * @param vm
  * @param klass The Tok class on which the method needs to be invoked.
  * @param name name of the method being invoked.
  * @param argCount number of arguments provided to the method.
  * @return true if method call succeeds, false otherwise.
  */
-static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
+static bool invokeFromClass(VM* vm, ObjClass* klass, ObjString* name, int argCount) {
     Value method;
     // find the method in the class's method table.
     if (!tableGet(&klass->methods, name, &method)) {
         // throw an error if the method is not present.
-        runtimeError("Undefined property '%s'.", name->chars);
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
     // push a call to the method's closure onto the CallFrame stack.
-    return call(AS_CLOSURE(method), argCount);
+    return call(vm, AS_CLOSURE(method), argCount);
 }
 
+#ifdef DEBUG_OPCODE_STATS
+
 /**
- * Handles an OP_INVOKE call for an optimized method call flow.
- * @param name name of the method being called.
- * @param argCount number of arguments passed to the method.
- * @return true if invocation succeeded, false otherwise.
+ * Reads the cycle counter, which is the time stamp counter on x86. Other machines count nanoseconds instead.
  */
-static bool invoke(ObjString* name, int argCount) {
-    // grab the receiver off the stack.
-    Value receiver = peek(argCount);
-    // cast receiver Value as instance.
-    if (!IS_INSTANCE(receiver)) {
-        // report error and bail out.
-        runtimeError("Only instances have methods.");
-        return false;
+static inline uint64_t readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(_WIN32)
+    return 0;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+#endif
+}
+
+/**
+ * Counts the dispatch of an opcode for the opcode statistics. The cycles since the previous dispatch go to the previous
+ * opcode, the cost of counting included.
+ * @param vm
+ * @param opcode
+ * @return the opcode.
+ */
+static inline uint8_t countInstruction(VM* vm, uint8_t opcode) {
+    uint64_t now = readCycles();
+    vm->opcodeCounts[opcode]++;
+    if (vm->lastOpcode >= 0) {
+        vm->opcodePairCounts[vm->lastOpcode][opcode]++;
+        vm->opcodeCycles[vm->lastOpcode] += now - vm->lastOpcodeCycles;
+    }
+    vm->lastOpcode = opcode;
+    vm->lastOpcodeCycles = now;
+    return opcode;
+}
+
+#define COUNT_INSTRUCTION(opcode) countInstruction(vm, opcode)
+#else
+#define COUNT_INSTRUCTION(opcode) (opcode)
+#endif
+
+#ifdef DEBUG_INLINE_CACHE_STATS
+#define CACHE_HIT() (vm->cacheHits++)
+#define CACHE_MISS() (vm->cacheMisses++)
+#else
+#define CACHE_HIT() do {} while (false)
+#define CACHE_MISS() do {} while (false)
+#endif
+
+/**
+ * Write barrier for an inline cache that was just filled in. The function the cache belongs to may be a lot older than
+ * the shapes and methods it ends up pointing to.
+ * @param vm
+ * @param function function the cache belongs to.
+ * @param cache
+ */
+static inline void cacheWriteBarrier(VM* vm, ObjFunction* function, InlineCache* cache) {
+    writeBarrier(vm, (Obj*) function, OBJ_VAL(cache->shape));
+    writeBarrier(vm, (Obj*) function, OBJ_VAL(cache->transition));
+    writeBarrier(vm, (Obj*) function, cache->method);
+}
+
+/**
+ * Looks up a property of an instance through a call site's inline cache.
+ * If the instance has the shape the cache was filled in for, the cache already says where the property is: either at
+ * some index in the instance's field array, or a method of the instance's class. Otherwise we look the property up in
+ * the shape's field table and then in the class's method table, and remember the result for the next time around.
+ * Fields take priority over and shadow methods.
+ * @param vm
+ * @param instance instance whose property is being looked up.
+ * @param name name of the property.
+ * @param cache inline cache of the call site, describes the property when the function returns true.
+ * @param function function the call site is in.
+ * @return false if the instance has no property with the given name.
+ */
+static inline bool cachedProperty(VM* vm, ObjInstance* instance, ObjString* name, InlineCache* cache, ObjFunction* function) {
+    if (cache->shape == (Obj*) instance->shape) {
+        CACHE_HIT();
+        return true;
     }
+    CACHE_MISS();
+
+    int field = shapeFieldIndex(instance->shape, name);
+    Value method = NIL_VAL;
+    if (field == -1 && !tableGet(&instance->klass->methods, name, &method)) return false;
+
+    cache->shape = (Obj*) instance->shape;
+    cache->transition = cache->shape;
+    cache->field = field;
+    cache->method = method;
+    cacheWriteBarrier(vm, function, cache);
+    return true;
+}
 
-    ObjInstance* instance = AS_INSTANCE(receiver);
+/**
+ * Moves an instance to a new shape, that has one more field than its current shape, and stores the new field's value.
+ * Grows the field array if it's full. The instance's class then remembers to make room for that many fields inline in
+ * its future instances.
+ * The instance and the value have to be reachable by the GC, since growing the field array may trigger a collection.
+ * @param vm
+ * @param instance
+ * @param shape shape the instance transitions to.
+ * @param value value of the new field.
+ */
+static void addField(VM* vm, ObjInstance* instance, ObjShape* shape, Value value) {
+    if (shape->fieldCount > instance->capacity) {
+        int capacity = instance->capacity < 4 ? 4 : instance->capacity * 2;
+        Value* fields = ALLOCATE(vm, Value, capacity);
+        for (int i = 0; i < instance->shape->fieldCount; i++) {
+            fields[i] = instance->fields[i];
+        }
+        // The inline storage can't be given back, it's part of the instance's own allocation.
+        if (instance->fields != instance->inlineFields) {
+            FREE_ARRAY(vm, Value, instance->fields, instance->capacity);
+        }
+        instance->fields = fields;
+        instance->capacity = capacity;
+    }
 
-    // first we look up a field with the given name
-    Value value;
-    if (tableGet(&instance->fields, name, &value)) {
-        // if found, we store it on the stack in the place of the receiver, under the argument list. (The way OP_GET_PROPERTY
-        // behaves, since the latter instruction executes before a subsequent paranthesized list of arguments has been evaluated).
-        vm.stackTop[-argCount - 1] = value;
-        // try to call the field's value like the callable that it hopefully is.
-        return callValue(value, argCount);
+    instance->fields[shape->fieldCount - 1] = value;
+    instance->shape = shape;
+    writeBarrier(vm, (Obj*) instance, value);
+    writeBarrier(vm, (Obj*) instance, OBJ_VAL(shape));
+    if (shape->fieldCount > instance->klass->fieldCountHint) {
+        instance->klass->fieldCountHint = shape->fieldCount;
     }
+}
 
-    return invokeFromClass(instance->klass, name, argCount);
+/**
+ * Binds a method to a receiver. A bound method that's in the cache for the same receiver and method is reused, since
+ * bound methods never change, otherwise a new one gets allocated and replaces whatever was in its cache entry.
+ * @param vm
+ * @param receiver instance the method is bound to, which has to be reachable by the GC.
+ * @param method
+ * @return the bound method.
+ */
+static ObjBoundMethod* bindCached(VM* vm, Value receiver, ObjClosure* method) {
+    uintptr_t hash = ((uintptr_t) AS_OBJ(receiver) >> 4) ^ ((uintptr_t) method >> 3);
+    ObjBoundMethod** entry = &vm->boundMethods[hash & (BOUND_METHOD_CACHE_SIZE - 1)];
+    if (*entry != NULL && (*entry)->method == method && AS_OBJ((*entry)->receiver) == AS_OBJ(receiver)) {
+        return *entry;
+    }
+    ObjBoundMethod* bound = newBoundMethod(vm, receiver, method);
+    *entry = bound;
+    return bound;
 }
 
 /**
  * Binds a method call to an instance.\n
  * Takes a class of an instance and a name of a method, and places the corresponding the ObjBoundMethod object on top of the stack.
+ * @param vm
  * @param class name of the class.
  * @param name name of the method to be looked up.
  * @return true if method was found, otherwise, false.
  */
-static bool bindMethod(ObjClass* klass, ObjString* name) {
+static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name) {
     Value method;
     // look for the given method in the class's method table. If we don't find one, we report a runtime error and bail out.
     if (!tableGet(&klass->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
 
     // if we find the method, we wrap it in a new ObjBoundMethod (binding it to the instance on top of the stack).
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    ObjBoundMethod* bound = bindCached(vm, peek(vm, 0), AS_CLOSURE(method));
     // pop the receiver/instance from the stack.
-    pop();
+    pop(vm);
     // push the bound method on top of the stack
-    push(OBJ_VAL(bound));
+    push(vm, OBJ_VAL(bound));
     return true;
 }
 
 /**
  * Function to close over a local variable.
+ * @param vm
  * @param local pointer to the captured local's slot in the surrounding function's stack window.
  * @return reference to the ObjUpvalue that was dynamically allocated.
  */
-static ObjUpvalue* captureUpvalue(Value* local) {
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
     ObjUpvalue* prevUpvalue = NULL;
-    ObjUpvalue* upvalue = vm.openUpvalues;
+    ObjUpvalue* upvalue = vm->openUpvalues;
 
     // We want all the references to a closed over local variable to share the same copy of the upvalue. Hence, we do the following:
     // Start at the head of the openUpvalue's list, which is the upvalue closest to the top of the stack.
@@ -336,12 +1120,12 @@ static ObjUpvalue* captureUpvalue(Value* local) {
     // We reach here in either of two cases:
     // 1. we exited the list traversal by going past the end of the list.
     // 2. we exited the list traversal by stopping on the first upvalue whose stack slot is below the one we're looking for.
-    ObjUpvalue* createdUpvalue = newUpvalue(local);
+    ObjUpvalue* createdUpvalue = newUpvalue(vm, local);
     createdUpvalue->next = upvalue;
 
     // In either case, we need to insert the new upvalue before the object pointed at by the upvalue (which may be NULL if we hit the end of the list)
     if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
+        vm->openUpvalues = createdUpvalue;
     } else {
         prevUpvalue->next = createdUpvalue;
     }
@@ -357,33 +1141,39 @@ static ObjUpvalue* captureUpvalue(Value* local) {
  * First, we copy the variable's value into the <code>closed</code> field in the ObjUpvalue. That's where the closed-over
  * variables live on the heap. The <code>OP_GET_UPVALUE</code> and <code>OP_SET_UPVALUE</code> instructions need to look
  * for the variable there after it's been moved.
+ * @param vm
  * @param last pointer to a stack slot where the variable to be closed resides.
  */
-static void closeUpvalues(Value* last) {
+static void closeUpvalues(VM* vm, Value* last) {
     // We walk the VM's list of open upvalues, from top to bottom. If an upvalue's location points into a range of slots
     // we're closing, we close the upvalue. Otherwise, once we reach an upvalue outside of the range, we know the rest
     // will be too, so we stop iterating.
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue* upvalue = vm.openUpvalues;
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+        ObjUpvalue* upvalue = vm->openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        upvalue->fiber = NULL;
+        writeBarrier(vm, (Obj*) upvalue, upvalue->closed);
+        vm->openUpvalues = upvalue->next;
     }
 }
 
 /**
  * Adds a method closure present at the top of the stack to the <code>methods</code> hash table of a given object.
+ * @param vm
  * @param name
  */
-static void defineMethod(ObjString* name) {
+static void defineMethod(VM* vm, ObjString* name) {
     // read the method closure present on the top of the stack.
-    Value method = peek(0);
+    Value method = peek(vm, 0);
     // read the class object present below it
-    ObjClass* klass = AS_CLASS(peek(1));
+    ObjClass* klass = AS_CLASS(peek(vm, 1));
     // add the method to the hash table of the class object.
-    tableSet(&klass->methods, name, method);
+    tableSet(vm, &klass->methods, name, method);
+    writeBarrier(vm, (Obj*) klass, OBJ_VAL(name));
+    writeBarrier(vm, (Obj*) klass, method);
     // pop the closure from the stack since we're done with it.
-    pop();
+    pop(vm);
 }
 
 /**
@@ -398,33 +1188,117 @@ static bool isFalsey(Value value) {
 
 /**
  * String utility function used to concatenate two strings.
+ * Short results are interned right away, longer ones are built as a rope, so that building a string piece by piece
+ * doesn't copy all of it every time.
+ */
+static void concatenate(VM* vm) {
+    // peek the strings and don't pop them just yet - since otherwise they might end up being GC'd during the allocation.
+    Obj* b = AS_OBJ(peek(vm, 0));
+    Obj* a = AS_OBJ(peek(vm, 1));
+
+    int length = stringLength(a) + stringLength(b);
+    Obj* result;
+    if (stringLength(b) == 0) {
+        result = a;
+    } else if (stringLength(a) == 0) {
+        result = b;
+    } else if (length < ROPE_MIN_LENGTH) {
+        // Ropes are never that short, so both pieces are plain strings.
+        char chars[ROPE_MIN_LENGTH];
+        memcpy(chars, ((ObjString*) a)->chars, stringLength(a));
+        memcpy(chars + stringLength(a), ((ObjString*) b)->chars, stringLength(b));
+        result = (Obj*) copyString(vm, chars, length);
+    } else {
+        result = (Obj*) newRope(vm, a, b, length);
+    }
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(result));
+}
+
+/**
+ * Flattens the ropes among the two values on top of the stack, so they can be compared like any other strings.
  */
-static void concatenate() {
-    // peek the strings and don't pop them just yet - since otherwise they might end up being GC'd during the ALLOCATE call.
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
+static void flattenOperands(VM* vm) {
+    for (int distance = 0; distance < 2; distance++) {
+        Value value = peek(vm, distance);
+        if (!IS_ROPE(value)) continue;
+        ObjString* string = flattenRope(vm, AS_ROPE(value));
+        vm->stackTop[-1 - distance] = OBJ_VAL(string);
+    }
+}
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+#ifdef DEBUG_TRACE_EXECUTION
 
-    ObjString* result = takeString(chars, length);
-    pop();
-    pop();
-    push(OBJ_VAL(result));
+/**
+ * Prints the VM's value stack followed by the disassembly of the instruction the given frame is about to execute.
+ * @param vm
+ * @param frame the CallFrame whose next instruction is being traced.
+ */
+static void traceExecution(VM* vm, CallFrame* frame) {
+    printf("          ");
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    // The offset is supposed to be an integer byte offset, hence we do a little pointer math to convert ip back to a
+    // relative offset from the beginning of the bytecode.
+    disassembleInstruction(vm, &frame->closure->function->chunk,
+                           (int) (frame->ip - frame->closure->function->chunk.code));
 }
 
+#endif
+
 /**
  * Responsible for handling all the bytecode interpretation.
+ * @param vm
  * @return <code>InterpretResult</code> indicating whether interpretation was successful or not.
  */
-static InterpretResult run() {
+static InterpretResult run(VM* vm) {
     // Reference to the current topmost CallFrame.
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    // Every write through frame->ip or vm->stackTop has to reach memory before the next call or aliasing store. Keeping the hot parts of the interpreter state in locals lets the C compiler hold them in registers.
+    // They are written back with STORE_FRAME() whenever code outside run() is about to look at them (calls, returns,
+    // runtime errors and anything that may allocate and therefore run the GC), and reloaded with LOAD_FRAME() afterwards.
+    uint8_t* ip = frame->ip;
+    Value* slots = frame->slots;
+    Value* sp = vm->stackTop;
+#ifdef DEBUG_OPCODE_STATS
+    // Pairs and cycles don't carry over from the previous run().
+    vm->lastOpcode = -1;
+#endif
 
-#define READ_BYTE() (*frame->ip++)
+/// Writes the cached instruction pointer and stack top back to the current CallFrame and the VM.
+#define STORE_FRAME() \
+    (frame->ip = ip, vm->stackTop = sp)
+
+/// Reloads the cached interpreter state from the topmost CallFrame and the VM.
+#define LOAD_FRAME() \
+    (frame = &vm->frames[vm->frameCount - 1], \
+    ip = frame->ip, \
+    slots = frame->slots, \
+    sp = vm->stackTop)
+
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+/// Discards the value on top of the stack, for the places that don't need it.
+#define DROP() ((void) --sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+
+/**
+ * Reports a runtime error and bails out of the interpreter. The cached state is stored first, so that runtimeError()
+ * reports the line of the instruction that's currently executing.
+ */
+#define RUNTIME_ERROR(...) \
+    do { \
+      STORE_FRAME(); \
+      runtimeError(vm, __VA_ARGS__); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
+#define READ_BYTE() (*ip++)
 
 /**
  * READ_CONSTANT() treats the next number (in the next byte, to which IP is pointing)
@@ -436,8 +1310,8 @@ static InterpretResult run() {
  * Yanks the next two bytes from the chunk and builds a 16 bit unsigned integer out of them.
  */
 #define READ_SHORT() \
-    (frame->ip += 2, \
-    (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    (ip += 2, \
+    (uint16_t)((ip[-2] << 8) | ip[-1]))
 
 /**
  * READ_STRING() treats the next number (in the next byte, to which IP is pointing)
@@ -445,425 +1319,850 @@ static InterpretResult run() {
  */
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 
+/**
+ * READ_CACHE() treats the next two bytes as the index of an inline cache in the chunk, and yields a pointer to it.
+ */
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+
 // Boilerplate for underlying implementation of all the binary operators.
 #define BINARY_OP(valueType, op) \
     do { \
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
       } \
-      double b = AS_NUMBER(pop()); \
-      double a = AS_NUMBER(pop()); \
-      push(valueType(a op b)); \
+      double b = AS_NUMBER(POP()); \
+      double a = AS_NUMBER(POP()); \
+      PUSH(valueType(a op b)); \
     } while (false)
 
 
+#ifdef COMPUTED_GOTO
+    /**
+     * With computed gotos, every handler ends by jumping straight to the handler of the next instruction through this
+     * table of label addresses, indexed by opcode. Each handler gets its own indirect jump, which the branch predictor
+     * can learn independently, instead of all of them funnelling through the single jump a switch compiles to.
+     * The table is generated from OPCODES, so an opcode without a handler doesn't compile rather than jumping to NULL.
+     */
+    static void* dispatchTable[OPCODE_COUNT] = {
+#define OPCODE_LABEL(name, length) [name] = &&LABEL_##name,
+            OPCODES(OPCODE_LABEL)
+#undef OPCODE_LABEL
+    };
+
+/// Starts executing the instruction stream by dispatching the first instruction.
+#define INTERPRET_LOOP  DISPATCH();
+/// Label for the handler of the given opcode.
+#define CASE(opcode)    LABEL_##opcode
+/// Reads the next opcode and jumps directly to its handler.
+#define DISPATCH() \
+    do { \
+      TRACE_INSTRUCTION(); \
+      goto *dispatchTable[instruction = COUNT_INSTRUCTION(READ_BYTE())]; \
+    } while (false)
+#else
 // Looping over all the instructions in the current chunk.
-    for (;;) {
+#define INTERPRET_LOOP \
+    loop: \
+      TRACE_INSTRUCTION(); \
+      switch (instruction = COUNT_INSTRUCTION(READ_BYTE()))
+#define CASE(opcode)    case opcode
+#define DISPATCH()      goto loop
+#endif
 
 // If the DEBUG_TRACE_EXECUTION flag is defined the debugger disassembles the instructions dynamically.
 #ifdef DEBUG_TRACE_EXECUTION
-        /**
-         * We print the stack with every instruction we execute.
-         */
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        /**
-         * The offset is supposed to be an integer byte offset,
-         * hence we do a little pointer math to convert ip back to a relative offset from the beginning of the bytecode.
-         */
-        disassembleInstruction(&frame->closure->function->chunk,
-                               (int) (frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() (STORE_FRAME(), traceExecution(vm, frame))
+#else
+#define TRACE_INSTRUCTION() do {} while (false)
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NIL:
-                push(NIL_VAL);
-                break;
-            case OP_TRUE:
-                push(BOOL_VAL(true));
-                break;
-            case OP_FALSE:
-                push(BOOL_VAL(false));
-                break;
-            case OP_POP:
-                pop();
-                break;
-            case OP_GET_LOCAL: {
-                // Takes a single byte operand for the stack slot where the local lives.
-                // It loads the value from that index and then pushes it on top of the stack where later instructions can find it.
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                // Takes the assigned value from top of the stack and stores it in the stack slot corresponding to the local variable.
-                // NOTE: the value is not popped from the stack, since assignment is an expression, and every expression
-                // produces a value. The value of an assignment expression is the assigned value itself, so the VM just leaves the value on the stack.
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                // read the name of the variable.
-                ObjString* name = READ_STRING();
-                Value value;
-                // Check if the variable is actually present in the hash table.
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                // push the value of the variable to the stack.
-                push(value);
-                break;
-            }
-            case OP_DEFINE_GLOBAL: {
-                // read the name of the variable.
-                ObjString* name = READ_STRING();
-                // Add the variable to the hashtable, with it's name as the key, and value as value.
-                tableSet(&vm.globals, name, peek(0));
-                // we pop the value of the variable after we've added it to the table.
-                // This ensure that the VM can still find the value if a garbage collection is triggered right in the
-                // middle of adding it to the hashtable. This is a distinct possibility since the hash table requires
-                // dynamic allocation when it resizes.
-                pop();
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                // Read the name of the variable.
-                ObjString* name = READ_STRING();
-                // Try setting the value of the variable in the hash table.
-                // - If it returns true - it means the key didn't exist in the table before, and was just added. This
-                //   This means that the variable did not before, and was just added.
-                //   We don't want this, so we delete it from the table, and throw a runtime error.
-                // - If it returns false - it means the key already existed on the table, and only its value was updated - which is what we want.
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                // NOTE: We don't pop the value off the stack in the end, since assignment is an expression so it needs to
-                // leave the value in there in case the assignment is nested inside some larger expression.
-                break;
-            }
-            case OP_GET_UPVALUE: {
-                // index into the current function's upvalue array.
-                uint8_t slot = READ_BYTE();
-                // we look up the corresponding upvalue and dereference its location pointer to read the value in that slot.
-                push(*frame->closure->upvalues[slot]->location);
-                break;
-            }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                // pick the value on the top of the stack and store it into the slot pointed to by the chosen upvalue.
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
-            }
-            case OP_GET_PROPERTY: {
-                // When the interpreter reaches this instruction, the expression to the left of the dot has already been
-                // executed and the resulting instance is on top of the stack.
-                if (!IS_INSTANCE(peek(0))) {
-                    // In Tok only instances are allowed to have fields, you can't stuff a field on a string or a number.
-                    // So we check for that before trying to access any fields on it.
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-                // We read the field name from the constant pool
-                ObjString* name = READ_STRING();
-
-                // and look it up in the instance's field table.
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    // If the hash table contains an entry with that name, we pop the instance and push the entry's value as the result
-                    pop();
-                    push(value);
-                    break;
-                }
 
-                // fields take priority over and shadow methods, hence method is checked here after field lookup.
-                // if the instance does not have a field with the given property name, then the name may refer to a method.
-                // we take the instance's class and pass it to bindMethod(). If bindMethod finds a method, it places the
-                // method on the stack and returns true, otherwise, returns false.
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+/**
+ * Takes a sample of the call stack for the profiler if its timer went off, at the instruction ip is just past the opcode
+ * of. Without the profiler, all this costs is a load and a branch.
+ */
+#define PROFILE_SAMPLE() \
+    do { \
+      if (profilerTick) { \
+        STORE_FRAME(); \
+        sampleProfile(vm); \
+      } \
+    } while (false)
+
+#ifdef JIT
+/**
+ * Carries on in the machine code of the current function, if it has any for the instruction ip points at. Once the
+ * machine code gets to an instruction it leaves to the interpreter, ip and sp point at that instruction and where the
+ * stack top ended up. The machine code may have made calls and returns of its own, so the frame is reloaded too.
+ * Machine code that leaves the frame it got entered in a few instructions further on mostly just cost the trip in and
+ * out. That happens at a method that starts with a property access, or at a return to an interpreted caller, and every
+ * call would pay for it again. Such an entry gets dropped, and the interpreter carries on there from then on. Leaving
+ * from a caller or callee, or from behind the entry after a loop, counts as getting somewhere.
+ */
+#define JIT_ENTER() \
+    do { \
+      JitCode* jit = frame->closure->function->jit; \
+      if (jit != NULL) { \
+        uint32_t* entry = &jit->entries[ip - frame->closure->function->chunk.code]; \
+        if (*entry != 0) { \
+          CallFrame* entered = frame; \
+          JitFrame state = {slots, sp, ip}; \
+          jitRun(jit, &state, *entry); \
+          frame = &vm->frames[vm->frameCount - 1]; \
+          if (frame == entered && state.ip >= ip && state.ip - ip < JIT_MIN_PROGRESS) *entry = 0; \
+          slots = frame->slots; \
+          ip = state.ip; \
+          sp = state.stackTop; \
+        } \
+      } \
+    } while (false)
+#else
+#define JIT_ENTER() do {} while (false)
+#endif
+
+    uint8_t instruction;
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL):
+            PUSH(NIL_VAL);
+            DISPATCH();
+        CASE(OP_TRUE):
+            PUSH(BOOL_VAL(true));
+            DISPATCH();
+        CASE(OP_FALSE):
+            PUSH(BOOL_VAL(false));
+            DISPATCH();
+        CASE(OP_POP):
+            DROP();
+            DISPATCH();
+        CASE(OP_GET_LOCAL): {
+            // Takes a single byte operand for the stack slot where the local lives.
+            // It loads the value from that index and then pushes it on top of the stack where later instructions can find it.
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            // Takes the assigned value from top of the stack and stores it in the stack slot corresponding to the local variable.
+            // NOTE: the value is not popped from the stack, since assignment is an expression, and every expression
+            // produces a value. The value of an assignment expression is the assigned value itself, so the VM just leaves the value on the stack.
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): {
+            // read the slot of the variable.
+            uint16_t slot = READ_SHORT();
+            Value value = vm->globalValues.values[slot];
+            // Check if the variable has actually been defined.
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm->globalNames.values[slot]));
             }
-            case OP_SET_PROPERTY: {
-                // make sure we're trying to set a property on an instance and nothing else
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            // push the value of the variable to the stack.
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL): {
+            // read the slot of the variable, and store the value in it. Redefining an existing global simply
+            // overwrites it.
+            uint16_t slot = READ_SHORT();
+            vm->globalValues.values[slot] = POP();
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            // Read the slot of the variable.
+            uint16_t slot = READ_SHORT();
+            // Assigning to a variable that has never been defined is an error, we don't implicitly create globals.
+            if (IS_UNDEFINED(vm->globalValues.values[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm->globalNames.values[slot]));
+            }
+            vm->globalValues.values[slot] = PEEK(0);
+            // NOTE: We don't pop the value off the stack in the end, since assignment is an expression so it needs to
+            // leave the value in there in case the assignment is nested inside some larger expression.
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            // index into the current function's upvalue array.
+            uint8_t slot = READ_BYTE();
+            // we look up the corresponding upvalue and dereference its location pointer to read the value in that slot.
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            // pick the value on the top of the stack and store it into the slot pointed to by the chosen upvalue.
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+            *upvalue->location = PEEK(0);
+            writeBarrier(vm, (Obj*) upvalue, PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY): {
+            // When the interpreter reaches this instruction, the expression to the left of the dot has already been
+            // executed and the resulting instance is on top of the stack.
+            if (!IS_INSTANCE(PEEK(0))) {
+                // In Tok only instances are allowed to have fields, you can't stuff a field on a string or a number.
+                // So we check for that before trying to access any fields on it.
+                RUNTIME_ERROR("Only instances have properties.");
+            }
+            ObjInstance* instance = AS_INSTANCE(PEEK(0));
+            // We read the field name from the constant pool
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
 
-                // When this executes, the top of the stack has the instance whose field is being set, and above that,
-                // the value to be stored.
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                // We first read the instruction's operand and find the field name string.
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                // we get the value to be stored off the stack.
-                Value value = pop();
-                // we pop the instance itself off
-                pop();
-                // finally, push the value back on the stack.
-                push(value);
-                break;
-            }
-            case OP_GET_SUPER: {
-                // read the method name from the constant table.
-                ObjString* name = READ_STRING();
-                // Load up the superclass object, which the compiler has placed on top of the stack.
-                ObjClass* superclass = AS_CLASS(pop());
-
-                // bind the method to the superclass.
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
+            // and look it up among the instance's fields and its class's methods.
+            if (!cachedProperty(vm, instance, name, cache, frame->closure->function)) {
+                RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+            }
+            if (cache->field != -1) {
+                // If the instance has a field with that name, we pop the instance and push the field's value as the result
+                Value value = instance->fields[cache->field];
+                DROP();
+                PUSH(value);
+                DISPATCH();
+            }
+
+            // Otherwise the name refers to a method, and we bind it to the instance, which we replace with the
+            // resulting ObjBoundMethod on the stack.
+            STORE_FRAME();
+            ObjBoundMethod* bound = bindCached(vm, PEEK(0), AS_CLOSURE(cache->method));
+            DROP();
+            PUSH(OBJ_VAL(bound));
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY): {
+            // make sure we're trying to set a property on an instance and nothing else
+            if (!IS_INSTANCE(PEEK(1))) {
+                RUNTIME_ERROR("Only instances have fields.");
+            }
+
+            // When this executes, the top of the stack has the instance whose field is being set, and above that,
+            // the value to be stored.
+            ObjInstance* instance = AS_INSTANCE(PEEK(1));
+            // We first read the instruction's operand and find the field name string.
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            // The cache tells us where the field goes for instances of this shape, and which shape the instance ends
+            // up with. The two only differ when the instance doesn't have the field yet.
+            if (cache->shape == (Obj*) instance->shape) {
+                CACHE_HIT();
+            } else {
+                CACHE_MISS();
+                ObjShape* shape = instance->shape;
+                int field = shapeFieldIndex(shape, name);
+                ObjShape* transition = shape;
+                if (field == -1) {
+                    STORE_FRAME();
+                    transition = shapeTransition(vm, shape, name);
+                    field = shape->fieldCount;
                 }
-                break;
-            }
-            case OP_EQUAL: {
-                // get the two operands
-                Value b = pop();
-                Value a = pop();
-                // push the boolean result to the stack
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-            case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
-                break;
-            case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
-                break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    // if operands are strings, perform concatenation.
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    // if operands are numbers, perform arithmetic addition.
-                    // get the two operands from the stack.
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    // push the result onto the stack.
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError(
-                            "Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+                cache->shape = (Obj*) shape;
+                cache->transition = (Obj*) transition;
+                cache->field = field;
+                cache->method = NIL_VAL;
+                cacheWriteBarrier(vm, frame->closure->function, cache);
+            }
+
+            if (cache->transition == cache->shape) {
+                instance->fields[cache->field] = PEEK(0);
+                writeBarrier(vm, (Obj*) instance, PEEK(0));
+            } else {
+                STORE_FRAME();
+                addField(vm, instance, (ObjShape*) cache->transition, PEEK(0));
+            }
+            // we get the value to be stored off the stack.
+            Value value = POP();
+            // we pop the instance itself off
+            DROP();
+            // finally, push the value back on the stack.
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER): {
+            // read the method name from the constant table.
+            ObjString* name = READ_STRING();
+            // Load up the superclass object, which the compiler has placed on top of the stack.
+            ObjClass* superclass = AS_CLASS(POP());
+
+            // bind the method to the superclass.
+            STORE_FRAME();
+            if (!bindMethod(vm, superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            sp = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(OP_EQUAL): {
+            // strings are compared by identity, which only works once both are interned.
+            if (IS_ROPE(PEEK(0)) || IS_ROPE(PEEK(1))) {
+                STORE_FRAME();
+                flattenOperands(vm);
+            }
+            // get the two operands
+            Value b = POP();
+            Value a = POP();
+            // push the boolean result to the stack
+            PUSH(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER):
+            BINARY_OP(BOOL_VAL, >);
+            DISPATCH();
+        CASE(OP_LESS):
+            BINARY_OP(BOOL_VAL, <);
+            DISPATCH();
+        CASE(OP_ADD): {
+            if (IS_STRING_OR_ROPE(PEEK(0)) && IS_STRING_OR_ROPE(PEEK(1))) {
+                // if operands are strings, perform concatenation.
+                STORE_FRAME();
+                concatenate(vm);
+                sp = vm->stackTop;
+            } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                // An addition that sees numbers usually keeps seeing numbers, so the instruction quickens itself into
+                // OP_ADD_NUMBER, which only has to check for those.
+                ip[-1] = OP_ADD_NUMBER;
+                // if operands are numbers, perform arithmetic addition.
+                // get the two operands from the stack.
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                // push the result onto the stack.
+                PUSH(NUMBER_VAL(a + b));
+            } else {
+                RUNTIME_ERROR(
+                        "Operands must be two numbers or two strings.");
+            }
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUMBER): {
+            Value b = PEEK(0);
+            Value a = PEEK(1);
+            // With NaN boxing, the guard is a bit test on each operand.
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                // Wrong guess, the instruction goes back to being a plain OP_ADD, which runs again to handle the operands.
+                ip[-1] = OP_ADD;
+                ip--;
+                DISPATCH();
+            }
+            sp--;
+            sp[-1] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT):
+            BINARY_OP(NUMBER_VAL, -);
+            DISPATCH();
+        CASE(OP_MULTIPLY):
+            BINARY_OP(NUMBER_VAL, *);
+            DISPATCH();
+        CASE(OP_DIVIDE):
+            BINARY_OP(NUMBER_VAL, /);
+            DISPATCH();
+        CASE(OP_NOT):
+            // replace the operand in place, so the stack pointer isn't modified twice in one expression.
+            sp[-1] = BOOL_VAL(isFalsey(PEEK(0)));
+            DISPATCH();
+        CASE(OP_NEGATE):
+            // make sure the operand is a number.
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            // replace the operand with the result.
+            sp[-1] = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        CASE(OP_PRINT): {
+            // pop the value from the stack when printing it.
+            // This is because print is a statement, and statements must have a net 0 impact on the stack.
+            // The value must have been pushed on the stack as a part of evaluating the expression following the TOKEN_PRINT.
+            printValue(POP());
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            // Unlike OP_JUMP_IF_FALSE, this is an unconditional jump forward by 'offset' instruction.
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            // Read the operand for the instruction (the jump offset)
+            uint16_t offset = READ_SHORT();
+            // if the current value on the stack (the result of the condition expression) is false, move the ip by the jump offset.
+            if (isFalsey(PEEK(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            PROFILE_SAMPLE();
+            uint16_t offset = READ_SHORT();
+            // Unconditional jump back by 'offset' number of instructions.
+            ip -= offset;
+#ifdef JIT
+            // A loop that keeps going makes the function hot, and can jump right into its machine code.
+            countHotness(vm, frame->closure->function);
+            JIT_ENTER();
+#endif
+            DISPATCH();
+        }
+        CASE(OP_CALL): {
+            PROFILE_SAMPLE();
+            // we need to know the function being called and the number of arguments passed to it.
+            // We get the latter from the instruction's operand.
+            int argCount = READ_BYTE();
+            // The argCount also tells us where to find the function on the stack by counting past the argument
+            // slots from the top of the stack. We hand this data off to a separate callValue handler.
+            // If that returns false, it means teh call caused some sort of runtime error. When that happens, we abort the interpreter.
+            // If the callValue() was successful, there will be a new CallFrame stack for the called function.
+            // The run() function has its own cached pointer to the current frame, we need to update that.
+            STORE_FRAME();
+            if (!callValue(vm, PEEK(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            /**
+             * Since the bytecode dispatch loop reads from the cached <code>ip</code>, when the VM goes to
+             * execute the next instruction, it will read the <code>ip</code> from the newly called function's
+             * CallFrame and jump to its code.
+             */
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL): {
+            PROFILE_SAMPLE();
+            // A call whose result the function returns right away. The function is done once it makes the call, so
+            // instead of pushing a frame for the callee, the callee takes over the function's frame. Recursion in
+            // tail position runs in constant stack space that way.
+            int argCount = READ_BYTE();
+            Value callee = PEEK(argCount);
+            if (IS_CLOSURE(callee)) {
+                ObjClosure* closure = AS_CLOSURE(callee);
+                if (argCount != closure->function->arity) {
+                    if (closure->function->lazySource != NULL) {
+                        STORE_FRAME();
+                        if (!compileLazyFunction(vm, closure->function)) return INTERPRET_RUNTIME_ERROR;
+                        LOAD_FRAME();
+                    }
+                    if (argCount != closure->function->arity) {
+                        RUNTIME_ERROR("Expected %d arguments but got %d.", closure->function->arity, argCount);
+                    }
                 }
-                break;
-            }
-            case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
-                break;
-            case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
-                break;
-            case OP_DIVIDE:
-                BINARY_OP(NUMBER_VAL, /);
-                break;
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE:
-                // make sure the operand is a number.
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+                // The function's locals die here, like they would when it returns.
+                closeUpvalues(vm, slots);
+                // The callee and its arguments move down to the start of the frame's stack window, which then needs
+                // to be as large as call() would have made it for the callee.
+                memmove(slots, sp - argCount - 1, sizeof(Value) * (argCount + 1));
+                sp = slots + argCount + 1;
+                frame->closure = closure;
+                ip = closure->function->chunk.code;
+                int needed = (int) (slots - vm->stack) + closure->function->maxSlots + FRAME_STACK_SLOTS;
+                if (vm->stackCapacity < needed) {
+                    STORE_FRAME();
+                    growStack(vm, needed);
+                    LOAD_FRAME();
                 }
-                // push the result to the stack.
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_PRINT: {
-                // pop the value from the stack when printing it.
-                // This is because print is a statement, and statements must have a net 0 impact on the stack.
-                // The value must have been pushed on the stack as a part of evaluating the expression following the TOKEN_PRINT.
-                printValue(pop());
-                printf("\n");
-                break;
-            }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                // Unlike OP_JUMP_IF_FALSE, this is an unconditional jump forward by 'offset' instruction.
-                frame->ip += offset;
-                break;
-            }
-            case OP_JUMP_IF_FALSE: {
-                // Read the operand for the instruction (the jump offset)
-                uint16_t offset = READ_SHORT();
-                // if the current value on the stack (the result of the condition expression) is false, move the ip by the jump offset.
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
-            }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                // Unconditional jump back by 'offset' number of instructions.
-                frame->ip -= offset;
-                break;
-            }
-            case OP_CALL: {
-                // we need to know the function being called and the number of arguments passed to it.
-                // We get the latter from the instruction's operand.
-                int argCount = READ_BYTE();
-                // The argCount also tells us where to find the function on the stack by counting past the argument
-                // slots from the top of the stack. We hand this data off to a separate callValue handler.
-                // If that returns false, it means teh call caused some sort of runtime error. When that happens, we abort the interpreter.
-                // If the callValue() was successful, there will be a new CallFrame stack for the called function.
-                // The run() function has its own cached pointer to the current frame, we need to update that.
-                if (!callValue(peek(argCount), argCount)) {
+#ifdef JIT
+                countHotness(vm, closure->function);
+                JIT_ENTER();
+#endif
+                DISPATCH();
+            }
+            // Other callees get called the regular way, the OP_RETURN that follows returns their result.
+            STORE_FRAME();
+            if (!callValue(vm, callee, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE): {
+            PROFILE_SAMPLE();
+            // name of the method being called.
+            ObjString* name = READ_STRING();
+            // number of arguments being passed to the method.
+            int argCount = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+
+            // grab the receiver off the stack.
+            Value receiver = PEEK(argCount);
+            if (!IS_INSTANCE(receiver)) {
+                RUNTIME_ERROR("Only instances have methods.");
+            }
+            ObjInstance* instance = AS_INSTANCE(receiver);
+
+            if (!cachedProperty(vm, instance, name, cache, frame->closure->function)) {
+                RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+            }
+            // first we check if the name refers to a field.
+            if (cache->field != -1) {
+                // if so, we store it on the stack in the place of the receiver, under the argument list. (The way OP_GET_PROPERTY
+                // behaves, since the latter instruction executes before a subsequent paranthesized list of arguments has been evaluated).
+                Value value = instance->fields[cache->field];
+                sp[-argCount - 1] = value;
+                // try to call the field's value like the callable that it hopefully is.
+                STORE_FRAME();
+                if (!callValue(vm, value, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                /**
-                 * Since the bytecode dispatch loop reads from the <code>frame</code> variable, when the VM goes to
-                 * execute the next instruction, it will read the <code>ip</code> from the newly called function's
-                 * CallFrame and jump to its code.
-                 */
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_INVOKE: {
-                // name of the method being called.
-                ObjString* method = READ_STRING();
-                // number of arguments being passed to the method.
-                int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
+            } else {
+                STORE_FRAME();
+                if (!call(vm, AS_CLOSURE(cache->method), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                // if method invocation succeeded, then there is a new CallFrame on the stack, so we refresh our cached
-                // copy of the current frame in frame.
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_SUPER_INVOKE: {
-                //Optimized flow for super method invocation.
-                // The main difference is in how the stack is organized.
-                // read the name of the method being called.
-                ObjString* method = READ_STRING();
-                // read the number of arguments passed to the method.
-                int argCount = READ_BYTE();
-                // load the superclass being referred to.
-                ObjClass* superclass = AS_CLASS(pop());
-                // invoke the method call.
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+            }
+            // if method invocation succeeded, then there is a new CallFrame on the stack, so we refresh our cached
+            // copy of the current frame's state.
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE): {
+            PROFILE_SAMPLE();
+            //Optimized flow for super method invocation.
+            // The main difference is in how the stack is organized.
+            // read the name of the method being called.
+            ObjString* method = READ_STRING();
+            // read the number of arguments passed to the method.
+            int argCount = READ_BYTE();
+            // load the superclass being referred to.
+            ObjClass* superclass = AS_CLASS(POP());
+            // invoke the method call.
+            STORE_FRAME();
+            if (!invokeFromClass(vm, superclass, method, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            // update the cached local frame if the invocation succeeded, since now a new CallFrame has been pushed to the CallFrame stack.
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE): {
+            // Read the function object from the constant table.
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            // A function that captures nothing doesn't need a closure of its own, they'd all be the same. Reusing one
+            // keeps code that passes such functions around as callbacks from allocating every time.
+            if (function->upvalueCount == 0 && function->closure != NULL) {
+                PUSH(OBJ_VAL(function->closure));
+                DISPATCH();
+            }
+            // Wrap it in a closure object and push it onto the stack.
+            STORE_FRAME();
+            ObjClosure* closure = newClosure(vm, function);
+            PUSH(OBJ_VAL(closure));
+            // captureUpvalue() allocates, so the GC needs to see the closure we just pushed.
+            vm->stackTop = sp;
+
+            // We iterate over each upvalue the closure expects. For each one, we read a pair of operand bytes.
+            // If the upvalue closes over a local variable in the enclosing function, we let captureUpvalue() do the work.
+            // Otherwise, we capture an upvalue from the surrounding function. An OP_CLOSURE instruction is emitted
+            // at the end of a function declaration. At the moment we are executing that declaration, the current
+            // function is the surrounding one. That means the current function's closure is stored in the CallFrame
+            // at the top of the callstack. So, to grab an upvalue from the enclosing function, we can read it right
+            // here from the frame local variable, which caches a reference to that CallFrame.
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    // We need to calculate the argument to pass to captureUpvalue. We need to grab a pointer to
+                    // the captured local's slot in the surrounding function's stack window. That window begins at
+                    // slots, which points to slot zero. Adding 'index' offsets that to the local slot we want to capture.
+                    closure->upvalues[i] = captureUpvalue(vm, slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                // update the cached local frame if the invocation succeeded, since now a new CallFrame has been pushed to the CallFrame stack.
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_CLOSURE: {
-                // Read the function object from the constant table.
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                // Wrap it in a closure object and push it onto the stack.
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
-
-                // We iterate over each upvalue the closure expects. For each one, we read a pair of operand bytes.
-                // If the upvalue closes over a local variable in the enclosing function, we let captureUpvalue() do the work.
-                // Otherwise, we capture an upvalue from the surrounding function. An OP_CLOSURE instruction is emitted
-                // at the end of a function declaration. At the moment we are executing that declaration, the current
-                // function is the surrounding one. That means the current function's closure is stored in the CallFrame
-                // at the top of the callstack. So, to grab an upvalue from the enclosing function, we can read it right
-                // here from the frame local variable, which caches a reference to that CallFrame.
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        // We need to calculate the argument to pass to captureUpvalue. We need to grab a pointer to
-                        // the captured local's slot in the surrounding function's stack window. That window begins at
-                        // frame->slots, which points to slot zero. Adding 'index' offsets that to the local slot we want to capture.
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
+                // capturing an upvalue allocates, so the closure itself may have become old by now.
+                writeBarrier(vm, (Obj*) closure, OBJ_VAL(closure->upvalues[i]));
+            }
+            if (function->upvalueCount == 0) {
+                function->closure = closure;
+                writeBarrier(vm, (Obj*) function, OBJ_VAL(closure));
+            }
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE):
+            // The variable we want to hoist is at the top of the stack. We pass the address of the variable's stack slot
+            // to closeUpvalues, which is responsible for closing the upvalue and moving the local from the stack to the heap.
+            closeUpvalues(vm, sp - 1);
+            // After that, the VM is free to discard the stack slot, which it does by calling POP()
+            DROP();
+            DISPATCH();
+        CASE(OP_RETURN): {
+            PROFILE_SAMPLE();
+            // When a function returns a value, that value will be on top of the stack.
+            // We pop that value out into a result variable.
+            Value result = POP();
+            // The compiler does not emit any instructions at the end of the outermost block scope that defines a
+            // function body. That scope contains the function's parameters and any locals declared immediately inside the function.
+            // Those need to get closed too, so we do that here.
+            // By passing the first slot in the function's stack window, we close every remaining open upvalue owned
+            // by the returning function.
+            closeUpvalues(vm, slots);
+            // discard the CallFrame.
+            vm->frameCount--;
+            // if we just discarded the very last CallFrame, it means we've finished executing the top-level code, or
+            // the function of a fiber. We pop the function from the stack, and carry on with the fiber that resumed this
+            // one, or else with the next fiber the scheduler has. Once there's none, the entire program is done and we
+            // exit the interpreter.
+            if (vm->frameCount == 0) {
+                DROP();
+                vm->stackTop = sp;
+                ObjFiber* fiber = vm->fiber;
+                fiber->state = FIBER_DONE;
+                ObjFiber* next = fiber->caller;
+                fiber->caller = NULL;
+                if (next == NULL) {
+                    next = nextFiber(vm);
+                    if (next == NULL) {
+                        if (fiber != vm->mainFiber) switchFiber(vm, vm->mainFiber);
+                        vm->mainFiber->state = FIBER_RUNNING;
+                        return INTERPRET_OK;
                     }
+                    result = next->transfer;
+                    next->transfer = NIL_VAL;
                 }
-                break;
-            }
-            case OP_CLOSE_UPVALUE:
-                // The variable we want to hoist is at the top of the stack. We pass the address of the variable's stack slot
-                // to closeUpvalues, which is responsible for closing the upvalue and moving the local from the stack to the heap.
-                closeUpvalues(vm.stackTop - 1);
-                // After that, the VM is free to discard the stack slot, which it does by calling pop()
-                pop();
-                break;
-            case OP_RETURN: {
-                // When a function returns a value, that value will be on top of the stack.
-                // We pop that value out into a result variable.
-                Value result = pop();
-                // The compiler does not emit any instructions at the end of the outermost block scope that defines a
-                // function body. That scope contains the function's parameters and any locals declared immediately inside the function.
-                // Those need to get closed too, so we do that here.
-                // By passing the first slot in the function's stack window, we close every remaining open upvalue owned
-                // by the returning function.
-                closeUpvalues(frame->slots);
-                // discard the CallFrame.
-                vm.frameCount--;
-                // if we just discarded the very last CallFrame, it means we've finished executing the top-level code.
-                // The entire program is done, so we pop the main script function from the stack and then exit the interpreter.
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
+                if (!enterFiber(vm, next, result)) return INTERPRET_RUNTIME_ERROR;
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
+            }
 
-                // discard all the slots the callee was using for its parameters and local variables.
-                // This includes the same slots the caller used to pass the arguments (if any).
-                vm.stackTop = frame->slots;
-
-                // The top of the stack is now right at the beginning of the returning function's stack window.
-                // We push the return value back onto the stack at this new, lower location.
-                push(result);
-                // Update the run() function's cached pointer to the current frame.
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_CLASS:
-                // Load the string for the class's name from the constant table and pass that to newClass().
-                // This creates a new class object with the given name. We then push this onto the stack.
-                // If the class is bound to a global variable, then the compiler's call to defineVariable() will emit
-                // code to store that object from the stack into the global variable table. Otherwise, it's right where
-                // it needs to be on the stack for a new local variable.
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-            case OP_INHERIT: {
-                // get the superclass
-                Value superclass = peek(1);
-
-                // check if the user is trying to inherit from a valid class.
-                if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            // discard all the slots the callee was using for its parameters and local variables.
+            // This includes the same slots the caller used to pass the arguments (if any).
+            sp = slots;
+
+            // The top of the stack is now right at the beginning of the returning function's stack window.
+            // We push the return value back onto the stack at this new, lower location.
+            PUSH(result);
+            // Update the run() function's cached state to the caller's frame.
+            vm->stackTop = sp;
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_CLASS):
+            // Load the string for the class's name from the constant table and pass that to newClass().
+            // This creates a new class object with the given name. We then push this onto the stack.
+            // If the class is bound to a global variable, then the compiler's call to defineVariable() will emit
+            // code to store that object from the stack into the global variable table. Otherwise, it's right where
+            // it needs to be on the stack for a new local variable.
+            STORE_FRAME();
+            PUSH(OBJ_VAL(newClass(vm, READ_STRING())));
+            DISPATCH();
+        CASE(OP_INHERIT): {
+            // get the superclass
+            Value superclass = PEEK(1);
+
+            // check if the user is trying to inherit from a valid class.
+            if (!IS_CLASS(superclass)) {
+                RUNTIME_ERROR("Superclass must be a class.");
+            }
 
-                // get the subclass
-                ObjClass* subclass = AS_CLASS(peek(0));
-                // copy all the superclass's methods into the subclass.
-                // by the time the subclass's body is about to be parsed, all the methods of the superclass are
-                // present in the subclass's own method table. Hence, no extra work needs to be done at runtime.
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop();  // pop the subclass
-                break;
+            // get the subclass
+            ObjClass* subclass = AS_CLASS(PEEK(0));
+            // copy all the superclass's methods into the subclass.
+            // by the time the subclass's body is about to be parsed, all the methods of the superclass are
+            // present in the subclass's own method table. Hence, no extra work needs to be done at runtime.
+            STORE_FRAME();
+            tableAddAll(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
+            rememberObject(vm, (Obj*) subclass);
+            DROP();  // pop the subclass
+            DISPATCH();
+        }
+        CASE(OP_METHOD):
+            STORE_FRAME();
+            defineMethod(vm, READ_STRING());
+            sp = vm->stackTop;
+            DISPATCH();
+        CASE(OP_BUILD_LIST): {
+            // The items are on top of the stack, in order. They stay there, with the list on top of them, while the
+            // items array allocates, so the GC sees all of them.
+            int itemCount = READ_BYTE();
+            STORE_FRAME();
+            ObjList* list = newList(vm);
+            PUSH(OBJ_VAL(list));
+            if (itemCount > 0) {
+                STORE_FRAME();
+                list->items.values = GROW_ARRAY(vm, Value, NULL, 0, itemCount);
+                list->items.capacity = itemCount;
+                memcpy(list->items.values, sp - 1 - itemCount, itemCount * sizeof(Value));
+                list->items.count = itemCount;
+                // A collection during the allocation may have made the list old already.
+                for (int i = 0; i < itemCount; i++) writeBarrier(vm, (Obj*) list, list->items.values[i]);
+            }
+            sp -= itemCount + 1;
+            PUSH(OBJ_VAL(list));
+            DISPATCH();
+        }
+        CASE(OP_GET_INDEX): {
+            Value index = PEEK(0);
+            Value target = PEEK(1);
+            if (!IS_LIST(target)) {
+                RUNTIME_ERROR("Can only index lists.");
+            }
+            ObjList* list = AS_LIST(target);
+            if (!IS_NUMBER(index) || !isInteger(AS_NUMBER(index))) {
+                RUNTIME_ERROR("List index must be an integer.");
+            }
+            // Only a number within the list fits in an int.
+            if (AS_NUMBER(index) < 0 || AS_NUMBER(index) >= list->items.count) {
+                RUNTIME_ERROR("List index out of range.");
+            }
+            int i = (int) AS_NUMBER(index);
+            sp -= 2;
+            PUSH(list->items.values[i]);
+            DISPATCH();
+        }
+        CASE(OP_SET_INDEX): {
+            Value value = PEEK(0);
+            Value index = PEEK(1);
+            Value target = PEEK(2);
+            if (!IS_LIST(target)) {
+                RUNTIME_ERROR("Can only index lists.");
+            }
+            ObjList* list = AS_LIST(target);
+            if (!IS_NUMBER(index) || !isInteger(AS_NUMBER(index))) {
+                RUNTIME_ERROR("List index must be an integer.");
+            }
+            // Only a number within the list fits in an int.
+            if (AS_NUMBER(index) < 0 || AS_NUMBER(index) >= list->items.count) {
+                RUNTIME_ERROR("List index out of range.");
             }
-            case OP_METHOD:
-                defineMethod(READ_STRING());
-                break;
+            int i = (int) AS_NUMBER(index);
+            list->items.values[i] = value;
+            writeBarrier(vm, (Obj*) list, value);
+            // An assignment is an expression, its value is the one assigned.
+            sp -= 3;
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_YIELD): {
+            // The value goes to the fiber that resumed this one, and becomes the result of its resume. A fiber that
+            // nobody resumed, like a spawned one, lets the scheduler run the others before it carries on.
+            Value value = POP();
+            STORE_FRAME();
+            ObjFiber* fiber = vm->fiber;
+            ObjFiber* caller = fiber->caller;
+            if (caller != NULL) {
+                fiber->caller = NULL;
+                fiber->state = FIBER_SUSPENDED;
+                if (!enterFiber(vm, caller, value)) return INTERPRET_RUNTIME_ERROR;
+            } else {
+                scheduleFiber(vm, fiber, NIL_VAL);
+                if (!runNextFiber(vm)) return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_RESUME): {
+            // Runs a fiber until it yields or returns, handing it the value on top of the stack. The fiber doesn't need
+            // to know who resumed it, it yields back to whichever fiber did.
+            if (!IS_FIBER(PEEK(1))) {
+                RUNTIME_ERROR("Can only resume fibers.");
+            }
+            ObjFiber* fiber = AS_FIBER(PEEK(1));
+            if (fiber->state == FIBER_DONE) {
+                RUNTIME_ERROR("Cannot resume a fiber that is done.");
+            }
+            if (fiber->state == FIBER_RUNNING || fiber->state == FIBER_SCHEDULED) {
+                RUNTIME_ERROR("Cannot resume a fiber that is running or scheduled.");
+            }
+            Value value = PEEK(0);
+            sp -= 2;
+            STORE_FRAME();
+            fiber->caller = vm->fiber;
+            writeBarrier(vm, (Obj*) fiber, OBJ_VAL(vm->fiber));
+            if (!enterFiber(vm, fiber, value)) return INTERPRET_RUNTIME_ERROR;
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_PROPERTY): {
+            // OP_GET_LOCAL followed by OP_GET_PROPERTY. The receiver is read straight out of its local slot, it only
+            // ends up on the stack if the property turns out to be a method that needs binding.
+            Value receiver = slots[READ_BYTE()];
+            if (!IS_INSTANCE(receiver)) {
+                RUNTIME_ERROR("Only instances have properties.");
+            }
+            ObjInstance* instance = AS_INSTANCE(receiver);
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+
+            if (!cachedProperty(vm, instance, name, cache, frame->closure->function)) {
+                RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+            }
+            if (cache->field != -1) {
+                PUSH(instance->fields[cache->field]);
+                DISPATCH();
+            }
+
+            STORE_FRAME();
+            ObjBoundMethod* bound = bindCached(vm, receiver, AS_CLOSURE(cache->method));
+            PUSH(OBJ_VAL(bound));
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_POP): {
+            // OP_SET_LOCAL followed by OP_POP, an assignment to a local used as a statement.
+            uint8_t slot = READ_BYTE();
+            slots[slot] = POP();
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCAL_CONSTANT): {
+            // OP_GET_LOCAL, OP_CONSTANT, OP_ADD. The compiler only fuses number constants, so a string in the local
+            // slot is an error just like it would be for the unfused sequence.
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (!IS_NUMBER(a)) {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_LOCAL_CONSTANT): {
+            // OP_GET_LOCAL, OP_CONSTANT, OP_SUBTRACT.
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (!IS_NUMBER(a)) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            PUSH(NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b)));
+            DISPATCH();
+        }
+        CASE(OP_LESS_LOCAL_CONSTANT_JUMP): {
+            // OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE. Like OP_JUMP_IF_FALSE, the result of the comparison
+            // is left on the stack, since both the code we fall through to and the jump target start by popping it.
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            if (!IS_NUMBER(a)) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            bool isLess = AS_NUMBER(a) < AS_NUMBER(b);
+            PUSH(BOOL_VAL(isLess));
+            if (!isLess) ip += offset;
+            DISPATCH();
         }
     }
+
+    // Only reachable when the switch meets an opcode it has no case for, which the compiler never emits.
+    return INTERPRET_RUNTIME_ERROR;
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
+#undef RUNTIME_ERROR
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
 #undef BINARY_OP
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+#undef TRACE_INSTRUCTION
 }
 
 /**
@@ -875,21 +2174,31 @@ static InterpretResult run() {
  * initialize its <code>ip</code> to point to the beginning of the function's bytecode, and set up its stack window
  * to start at the very bottom of the VM's stack.
  * After finishing, we just run the bytecode we just produced.
+ * @param vm
  * @param source
  * @return
  */
-InterpretResult interpret(const char* source) {
-    ObjFunction* function = compile(source);
+InterpretResult interpret(VM* vm, const char* source) {
+    ObjFunction* function = compile(vm, source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+    return interpretFunction(vm, function);
+}
+
+/**
+ * Runs the top level function of an already compiled script, such as one loaded from a bytecode file.
+ * @param vm
+ * @param function
+ * @return
+ */
+InterpretResult interpretFunction(VM* vm, ObjFunction* function) {
     // We wrap the raw function returned by the compiler in a closure, and pass it into the VM.
     // We push it onto the stack to make sure the GC won't clean it up in the middle of execution.
-    push(OBJ_VAL(function));
-    ObjClosure* closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    call(closure, 0);
-
-    return run();
+    push(vm, OBJ_VAL(function));
+    ObjClosure* closure = newClosure(vm, function);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
+    call(vm, closure, 0);
 
+    return run(vm);
 }
@@ -6,19 +6,28 @@
 #define CTOK_VM_H
 
 #include "chunk.h"
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+/// Default limit on the depth of the call stack, see VM.maxFrames.
+#define FRAMES_MAX (64 * 1024)
+/// Number of CallFrames the call stack starts out with room for.
+#define FRAMES_INITIAL 8
+/// Number of value stack slots every call makes sure are there on top of the ObjFunction.maxSlots its function's code
+/// uses, for the values natives, the runtime and the compiler of lazy functions push on their own. Also the size of the
+/// stack the VM and each fiber start out with.
+#define FRAME_STACK_SLOTS (2 * UINT8_COUNT)
+/// Number of entries in the bound method cache, see VM.boundMethods. Has to be a power of two.
+#define BOUND_METHOD_CACHE_SIZE 256
 
 /**
  * A CallFrame represents a single on-going function call.
  * The <code>closure</code> pointer points to the closure of the function being called.
  * We use that to look up constants, and a few other things. Each time a function is called, we create one of these structs.
  */
-typedef struct {
+typedef struct CallFrame {
     ObjClosure* closure;
     /**
      * Each frame will store it's own <code>ip</code>. When we return from a function, the VM will jump to the <code>ip</code>
@@ -32,38 +41,122 @@ typedef struct {
 } CallFrame;
 
 /**
- * Struct for managing the VM instance.
+ * Struct for managing a VM instance. Every function touching the VM's state takes the VM it works on, created with
+ * newVM().
  */
-typedef struct {
-    /// <code>frames</code> is an array for storing the CallFrames for function calls.
-    CallFrame frames[FRAMES_MAX];
+struct VM {
+    /// <code>frames</code> is an array for storing the CallFrames for function calls. It grows as calls get deeper.
+    CallFrame* frames;
     /// <code>frameCount</code> stores the current height of the CallFrame stack.
     int frameCount;
-    /// <code>stack</code> contains all the runtime values for the VM.
-    Value stack[STACK_MAX];
+    /// Number of CallFrames <code>frames</code> can hold.
+    int frameCapacity;
+    /// Maximum depth of the call stack, calls past it are a stack overflow. Embedders can tune this after newVM().
+    int maxFrames;
+    /// Whether compile() leaves the bodies of the functions it can for later, compiling each one the first time it's
+    /// called, see compileFunction(). Embedders can turn this on after newVM().
+    bool lazyCompilation;
+    /// <code>stack</code> contains all the runtime values for the VM. It grows as calls need more room, and every pointer
+    /// into it is moved along when it does, see growStack().
+    Value* stack;
+    /// Number of values <code>stack</code> can hold.
+    int stackCapacity;
     /// <code>stackTop</code> stores the pointer to the top of the Value stack.
     Value* stackTop;
-    /// <code>globals</code> is a hash table storing all the global variables.
-    Table globals;
+    /// <code>globalSlots</code> maps the name of every global variable the compiler has come across to its slot in <code>globalValues</code>.
+    Table globalSlots;
+    /// <code>globalNames</code> holds the name of the global variable in each slot, for error messages.
+    ValueArray globalNames;
+    /// <code>globalValues</code> holds the value of the global variable in each slot, UNDEFINED_VAL until it gets defined.
+    ValueArray globalValues;
     /// <code>strings</code> is a hashtable containing pointers to all the string objects in the VM, and supports string interning.
     Table strings;
     /// keyword used for init methods on classes, defined here for performance gains incurred by string interning.
     ObjString* initString;
+    /// Bound methods created recently, indexed by a hash of their receiver and method, so that binding the same method to
+    /// the same instance over and over again hands out the same bound method instead of allocating a new one each time.
+    /// Like the string table, it holds on to the bound methods weakly, the GC clears the entries of the ones it frees.
+    ObjBoundMethod* boundMethods[BOUND_METHOD_CACHE_SIZE];
     /// <code>openUpvalues</code> is the list of open upvalues present in the VM at a particular instant of time.
     ObjUpvalue* openUpvalues;
+    /// Fiber that is running, the one the frames, the stack and the open upvalues above belong to.
+    ObjFiber* fiber;
+    /// Fiber the script runs in.
+    ObjFiber* mainFiber;
+    /// Fibers spawned, sleeping or waiting for input, NULL until the program first needs the scheduler, see fiber.c.
+    struct Scheduler* scheduler;
     /// Running total of the number of bytes of managed memory the VM has allocated.
     size_t bytesAllocated;
     //// Threshold number of bytes that triggers the next collection.
     size_t nextGC;
-    /// <code>objects</code> stores all the different kinds of runtime objects for the VM.
-    Obj* objects;
+    /// Pages holding a single large object each, along with every other object when the pools are disabled.
+    HeapPage* largePages;
+    /// Pages that had objects allocated in them since the last collection.
+    HeapPage* youngPages;
+    /// Strings allocated since the last collection, which minor collections have to remove from the string table if they die.
+    ObjString** youngStrings;
+    /// Number of strings in youngStrings.
+    int youngStringCount;
+    /// Number of strings youngStrings can hold.
+    int youngStringCapacity;
+    /// Threshold number of bytes that triggers the next minor collection, one that only collects young objects.
+    size_t nextMinorGC;
+    /// Old objects that may reference young ones, which minor collections have to trace.
+    Obj** rememberedSet;
+    /// Number of objects in the rememberedSet.
+    int rememberedCount;
+    /// Number of objects the rememberedSet can hold.
+    int rememberedCapacity;
+    /// Phase of the major collection in progress.
+    GCPhase gcPhase;
+    /// Number of objects each step of an incremental major collection processes, which bounds the pauses it causes.
+    /// Embedders can tune this after newVM(). 0 makes major collections run in one go instead.
+    int gcStepBudget;
+    /// Threshold number of bytes that triggers the next step of the major collection in progress.
+    size_t nextGCStep;
+    /// List of pages the page being cleared or swept by the major collection is in, see nextCursorPage().
+    int gcCursorList;
+    /// Next page to be cleared or swept by the major collection.
+    HeapPage* gcCursor;
+    /// Counters for gcStats() and --gc-stats.
+    GCStats gcStats;
     /// Number of gray nodes present in the GC grayStack.
     int grayCount;
     /// Number of gray nodes that the GC grayStack can hold.
     int grayCapacity;
     /// Data structure to hold a pointers to Obj* that have been marked gray by the GC.
     Obj** grayStack;
-} VM;
+#ifdef OBJECT_POOLS
+    /// Pools the memory of small objects gets allocated from, one for each size class.
+    ObjectPool pools[POOL_CLASS_COUNT];
+#endif
+#ifdef DEBUG_STRESS_GC
+    /// Number of collections the stress mode has run, so that it can mix major collections in with the minor ones.
+    int stressCollections;
+#endif
+#ifdef DEBUG_INLINE_CACHE_STATS
+    /// Number of property lookups answered by an inline cache.
+    size_t cacheHits;
+    /// Number of property lookups that had to fall back to the hash tables.
+    size_t cacheMisses;
+#endif
+    /// Profiler taking samples of the program, or NULL unless it's being profiled, see startProfiler().
+    struct Profiler* profiler;
+#ifdef DEBUG_OPCODE_STATS
+    /// Number of times each opcode got executed.
+    uint64_t opcodeCounts[UINT8_COUNT];
+    /// Number of times each opcode got executed right after another one, by the first opcode and then the second.
+    uint64_t opcodePairCounts[UINT8_COUNT][UINT8_COUNT];
+    /// Cycles spent from the dispatch of each opcode to the dispatch of the next instruction, by the first opcode.
+    uint64_t opcodeCycles[UINT8_COUNT];
+    /// Opcode dispatched last, or -1 at the start of run().
+    int lastOpcode;
+    /// Cycle counter at the dispatch of lastOpcode.
+    uint64_t lastOpcodeCycles;
+#endif
+    /// Bytecode files functions were loaded from, which have to stay around as long as the functions borrow their code.
+    struct BytecodeMapping* bytecodeMappings;
+};
 
 /**
  *  The VM runs a chunk and responds with one of the values from this enum.
@@ -74,16 +167,18 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+VM* newVM();
 
-void initVM();
+void freeVM(VM* vm);
 
-void freeVM();
+InterpretResult interpret(VM* vm, const char* source);
 
-InterpretResult interpret(const char* source);
+InterpretResult interpretFunction(VM* vm, ObjFunction* function);
 
-void push(Value value);
+int globalSlot(VM* vm, ObjString* name);
 
-Value pop();
+void push(VM* vm, Value value);
+
+Value pop(VM* vm);
 
 #endif //CTOK_VM_H